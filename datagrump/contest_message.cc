@@ -5,6 +5,9 @@
 
 using namespace std;
 
+/* the payload of an ack for a recovered datagram (an ordinary ack's is empty) */
+static const string RECOVERED_MARKER = "DGFR";
+
 /* helper to get the nth uint64_t field (in network byte order) */
 uint64_t get_header_field( const size_t n, const string & str )
 {
@@ -25,7 +28,8 @@ ContestMessage::Header::Header( const string & str )
     ack_sequence_number( get_header_field( 2, str ) ),
     ack_send_timestamp( get_header_field( 3, str ) ),
     ack_recv_timestamp( get_header_field( 4, str ) ),
-    ack_payload_length( get_header_field( 5, str ) )
+    ack_payload_length( get_header_field( 5, str ) ),
+    ack_ce_count( get_header_field( 6, str ) )
 {}
 
 /* Parse incoming message from wire */
@@ -56,7 +60,8 @@ string ContestMessage::Header::to_string() const
     + put_header_field( ack_sequence_number )
     + put_header_field( ack_send_timestamp )
     + put_header_field( ack_recv_timestamp )
-    + put_header_field( ack_payload_length );
+    + put_header_field( ack_payload_length )
+    + put_header_field( ack_ce_count );
 }
 
 /* Make wire representation of message */
@@ -67,7 +72,8 @@ string ContestMessage::to_string() const
 
 /* Transform into an ack of the ContestMessage */
 void ContestMessage::transform_into_ack( const uint64_t sequence_number,
-					 const uint64_t recv_timestamp )
+					 const uint64_t recv_timestamp,
+					 const uint64_t ce_count )
 {
   /* ack the old sequence number */
   header.ack_sequence_number = header.sequence_number;
@@ -79,6 +85,7 @@ void ContestMessage::transform_into_ack( const uint64_t sequence_number,
   header.ack_send_timestamp = header.send_timestamp;
   header.ack_recv_timestamp = recv_timestamp;
   header.ack_payload_length = payload.length();
+  header.ack_ce_count = ce_count;
 
   /* delete the payload */
   payload.clear();
@@ -98,7 +105,8 @@ ContestMessage::Header::Header( const uint64_t s_sequence_number )
     ack_sequence_number( -1 ),
     ack_send_timestamp( -1 ),
     ack_recv_timestamp( -1 ),
-    ack_payload_length( -1 )
+    ack_payload_length( -1 ),
+    ack_ce_count( -1 )
 {}
 
 /* Is this message an ack? */
@@ -106,3 +114,15 @@ bool ContestMessage::is_ack() const
 {
   return header.ack_sequence_number != uint64_t( -1 );
 }
+
+/* Mark an ack as being for a recovered datagram */
+void ContestMessage::mark_recovered()
+{
+  payload = RECOVERED_MARKER;
+}
+
+/* Is this an ack of a recovered datagram? */
+bool ContestMessage::is_recovered_ack() const
+{
+  return is_ack() and payload == RECOVERED_MARKER;
+}
@@ -15,6 +15,10 @@ struct ContestMessage
     uint64_t ack_recv_timestamp;
     uint64_t ack_payload_length;
 
+    /* datagrams from this sender the network has marked CE (congestion
+       experienced) so far; a running count, so a lost ack loses nothing */
+    uint64_t ack_ce_count;
+
     /* Header for new message */
     Header( const uint64_t s_sequence_number );
 
@@ -42,10 +46,18 @@ struct ContestMessage
 
   /* Transform into an ack of the ContestMessage */
   void transform_into_ack( const uint64_t sequence_number,
-			   const uint64_t recv_timestamp );
+			   const uint64_t recv_timestamp,
+			   const uint64_t ce_count );
 
   /* Is this message an ack? */
   bool is_ack() const;
+
+  /* Mark an ack as being for a datagram that never arrived, but that
+     the receiver recovered (with FEC) from the rest of its block */
+  void mark_recovered();
+
+  /* Is this an ack of a recovered datagram? */
+  bool is_recovered_ack() const;
 };
 
 #endif /* CONTEST_MESSAGE_HH */
@@ -1,26 +1,36 @@
-#include <iostream>
-
 #include "controller.hh"
 #include "timestamp.hh"
+#include "profiler.hh"
 
 #include <unistd.h>
 
 using namespace std;
 
+// Window kept on a backoff for CE marks
 #define BETA 0.75
 #define MAX_DELAY 100
 // One tick in Sprout algo
 #define TICK_SIZE_MS 20
 // Maximum time for ack to return to sender
 #define RECV_DELAY_MS 150
+// How many datagrams the loss rate averages over
+#define LOSS_HORIZON 128
+
+// Stages of the Sprout update that the profiler times
+static const Profiler::PhaseID TICK_PHASE = Profiler::phase("controller.tick");
+static const Profiler::PhaseID LIKELIHOOD_PHASE = Profiler::phase("controller.likelihood");
+static const Profiler::PhaseID DIFFUSION_PHASE = Profiler::phase("controller.diffusion");
+static const Profiler::PhaseID FORECAST_PHASE = Profiler::phase("controller.forecast");
 
 /* Default constructor */
-Controller::Controller( const bool debug )
-  : debug_( false || debug ), last_acked_sequence_number_(0),
+Controller::Controller( Tracer * const tracer, const uint16_t flow_id )
+  : tracer_( tracer ), flow_id_( flow_id ), last_acked_sequence_number_(0),
   window_size_(50), window_acks_(0),
   last_update_ms_(timestamp_ms() + RECV_DELAY_MS),
   packets_recv_(), queue_size_estimate_(0), lambda_distr_(),
-  lambda_support_(), gaussian_(200)
+  lambda_support_(), gaussian_(200), departure_ns_(), rtt_ms_(0),
+  last_forecast_(0), loss_rate_(0), last_sent_sequence_number_(0),
+  next_ce_backoff_sequence_number_(0)
 {
   int num_buckets = 200;
   for (int i = 0; i < num_buckets; i++) {
@@ -30,11 +40,71 @@ Controller::Controller( const bool debug )
   }
 }
 
-/* Get current window size, in datagrams */
-unsigned int Controller::window_size()
+/* Datagrams per second the latest forecast expects the path to deliver */
+double Controller::forecast_rate() const
+{
+  return last_forecast_ * 1000. / MAX_DELAY;
+}
+
+/* What this flow has learned so far */
+Controller::LearnedState Controller::learned_state() const
+{
+  LearnedState state = LearnedState();
+  for (double lambda: lambda_support_) {
+    state.posterior.push_back(lambda_distr_.at(lambda));
+  }
+  state.window_size = window_size_;
+  state.rtt_ms = rtt_ms_;
+  return state;
+}
+
+/* Whether this is a real distribution and window */
+bool Controller::LearnedState::valid() const
+{
+  double total = 0;
+  for (double p: posterior) {
+    if (not (p >= 0)) {  // (also catches NaN)
+      return false;
+    }
+    total += p;
+  }
+  return window_size > 0 and total > 0 and std::isfinite(total);
+}
+
+/* Start from what an earlier flow learned */
+bool Controller::warm_start(const LearnedState & state)
+{
+  if (state.posterior.size() != lambda_support_.size() or not state.valid()) {
+    return false;
+  }
+
+  double total = 0;
+  for (double p: state.posterior) {
+    total += p;
+  }
+
+  for (size_t i = 0; i < lambda_support_.size(); i++) {
+    lambda_distr_[lambda_support_[i]] = state.posterior[i] / total;
+  }
+
+  // No acks will count toward a tick for RECV_DELAY_MS yet, so until then
+  // the window is whatever the earlier flow had settled on
+  window_size_ = max(state.window_size, 5);
+  rtt_ms_ = state.rtt_ms;
+  last_forecast_ = forecast();
+
+  if ( tracer_ ) {
+    trace(TRACE_WINDOW);
+  }
+  return true;
+}
+
+/* Advance the rate estimate through every tick that has elapsed */
+void Controller::tick()
 {
   uint64_t current_time = timestamp_ms();
   while (current_time >= last_update_ms_ + TICK_SIZE_MS) {
+    ProfileScope profile(TICK_PHASE);
     vector<uint64_t> remaining;
     int packets_in_update_window = 0;
     for (uint64_t ack_timestamp: packets_recv_) {
@@ -55,15 +125,27 @@ unsigned int Controller::window_size()
 
     if (last_update_ms_ > current_time - TICK_SIZE_MS) {
       int f = forecast();
+      last_forecast_ = f;
       window_size_ = max(int(1.2 * f - queue_size_estimate_ + window_size_), 5);
     }
   }
+}
+
+/* How often the rate estimate advances, in milliseconds */
+unsigned int Controller::tick_ms() const
+{
+  return TICK_SIZE_MS;
+}
+
+/* Get current window size, in datagrams */
+unsigned int Controller::window_size()
+{
+  tick();
 
   unsigned int the_window_size = window_size_;
 
-  if ( debug_ ) {
-    cerr << "At time " << timestamp_ms()
-	 << " window size is " << the_window_size << endl;
+  if ( tracer_ ) {
+    trace(TRACE_WINDOW);
   }
 
   return the_window_size;
@@ -78,12 +160,19 @@ void Controller::datagram_was_sent( const uint64_t sequence_number,
 				    /* datagram was sent because of a timeout */ )
 {
   queue_size_estimate_++;
-  if ( debug_ ) {
-    cerr << "At time " << send_timestamp
-	 << " sent datagram " << sequence_number << " (timeout = " << after_timeout << ")\n";
+  last_sent_sequence_number_ = sequence_number;
+  if ( tracer_ ) {
+    trace(TRACE_SENT, sequence_number, send_timestamp, 0, after_timeout);
   }
 }
 
+/* The kernel reported when a sent datagram actually left the host */
+void Controller::send_completed( const uint64_t sequence_number,
+				 const uint64_t departure_timestamp_ns )
+{
+  departure_ns_[sequence_number] = departure_timestamp_ns;
+}
+
 /* An ack was received */
 void Controller::ack_received( const uint64_t sequence_number_acked,
 			       /* what sequence number was acknowledged */
@@ -91,23 +180,98 @@ void Controller::ack_received( const uint64_t sequence_number_acked,
 			       /* when the acknowledged datagram was sent (sender's clock) */
 			       const uint64_t recv_timestamp_acked,
 			       /* when the acknowledged datagram was received (receiver's clock)*/
-			       const uint64_t timestamp_ack_received )
+			       const uint64_t timestamp_ack_received,
                                /* when the ack was received (by sender) */
+			       const uint64_t timestamp_ack_received_ns )
+                               /* same, in nanoseconds */
 {
   packets_recv_.push_back(recv_timestamp_acked);
   queue_size_estimate_--;
+
+  // Datagrams the ack skipped over were lost (or reordered, which
+  // looks the same from here); each moves the average toward 1, and
+  // this one toward 0
+  const uint64_t skipped = sequence_number_acked > last_acked_sequence_number_
+    ? sequence_number_acked - last_acked_sequence_number_ - 1 : 0;
+  const double keep = 1 - 1. / LOSS_HORIZON;
+  loss_rate_ = (1 - (1 - loss_rate_) * pow(keep, double(skipped))) * keep;
   window_acks_ += sequence_number_acked - last_acked_sequence_number_;
   last_acked_sequence_number_ = sequence_number_acked;
 
-  if ( debug_ ) {
-    cerr << "At time " << timestamp_ack_received
-	 << " received ack for datagram " << sequence_number_acked
-	 << " (send @ time " << send_timestamp_acked
-	 << ", received @ time " << recv_timestamp_acked << " by receiver's clock)"
-	 << endl;
+  // Prefer the kernel's departure time over the userspace send timestamp,
+  // so the sample excludes host-side queueing before the packet left
+  // (unless the ack has no kernel arrival time, which reads as -1).
+  // Only rtt_ms() sees this: tick() and forecast() work from
+  // packets_recv_, on the receiver's clock
+  auto departure = departure_ns_.find(sequence_number_acked);
+  if (departure != departure_ns_.end()
+      and timestamp_ack_received_ns != uint64_t(-1)) {
+    rtt_ms_ = (double(timestamp_ack_received_ns) - departure->second) / 1e6;
+  } else {
+    rtt_ms_ = timestamp_ack_received - send_timestamp_acked;
+  }
+  // Anything older will never be acked (or was already)
+  departure_ns_.erase(departure_ns_.begin(),
+      departure_ns_.upper_bound(sequence_number_acked));
+
+  if ( tracer_ ) {
+    trace(TRACE_ACK, sequence_number_acked, send_timestamp_acked,
+        recv_timestamp_acked, rtt_ms_);
+  }
+}
+
+/* The network marked datagrams CE */
+void Controller::congestion_marked( const uint64_t sequence_number_acked,
+				    /* the ack that reported the marks */
+				    const unsigned int newly_marked )
+				    /* how many datagrams were newly marked */
+{
+  // A mark means a queue is starting to build at the bottleneck, before
+  // it overflows: back off at once rather than wait for the forecast to
+  // notice the rate falling. Every mark on a datagram already in flight
+  // at the last backoff is the same congestion, so back off once per
+  // round trip.
+  if (sequence_number_acked >= next_ce_backoff_sequence_number_) {
+    window_size_ = max(int(window_size_ * BETA), 5);
+    next_ce_backoff_sequence_number_ = last_sent_sequence_number_ + 1;
+  }
+
+  if ( tracer_ ) {
+    trace(TRACE_CE, sequence_number_acked, 0, 0, newly_marked);
+  }
+}
+
+/* The network lost a datagram, but the receiver recovered it */
+void Controller::datagram_recovered( const uint64_t sequence_number )
+                                     /* of the lost datagram */
+{
+  // It's no longer in the network, so no longer counts toward the queue.
+  // But the path didn't deliver it: it isn't a delivery for the rate
+  // estimate, and it stays lost in the loss rate (which has to see the
+  // raw loss, since FEC sizes its parity from it)
+  queue_size_estimate_--;
+
+  if ( tracer_ ) {
+    trace(TRACE_RECOVERED, sequence_number);
   }
 }
 
+// Record an event with the current window and estimate
+void Controller::trace(const uint16_t event, const uint64_t sequence_number,
+    const uint64_t time_ms, const uint64_t other_time_ms, const double value)
+{
+  TraceRecord record = TraceRecord();
+  record.event = event;
+  record.source = flow_id_;
+  record.window = window_size_;
+  record.sequence_number = sequence_number;
+  record.time_ms[0] = time_ms;
+  record.time_ms[1] = other_time_ms;
+  record.estimate = queue_size_estimate_;
+  record.value = value;
+  tracer_->record(record);
+}
+
 /* How long to wait (in milliseconds) if there are no acks
    before sending one more datagram */
 unsigned int Controller::timeout_ms()
@@ -116,6 +280,7 @@ unsigned int Controller::timeout_ms()
 }
 
 void Controller::update_distr(int recv_packets) {
+  ProfileScope profile(LIKELIHOOD_PHASE);
   double normalization_factor = 0.;
   for (auto &supports: lambda_distr_) {
     Poisson p((supports.first + 2.5)  * TICK_SIZE_MS / 1000.);
@@ -131,6 +296,7 @@ void Controller::update_distr(int recv_packets) {
 unordered_map<double, double> Controller::brownian(
     const unordered_map<double, double> &lambda_distr
     ) {
+  ProfileScope profile(DIFFUSION_PHASE);
   // Use the same supports but clear probs
   unordered_map<double, double> updated(lambda_distr);
 
@@ -150,6 +316,7 @@ unordered_map<double, double> Controller::brownian(
 }
 
 int Controller::forecast() {
+  ProfileScope profile(FORECAST_PHASE);
   unordered_map<double, double> lambda_d(lambda_distr_);
   unordered_map<double, double> cum_lambda_d;
   for (int i = 0; i < MAX_DELAY / TICK_SIZE_MS; i++) {
@@ -7,6 +7,19 @@
 #include <unordered_map>
 #include <map>
 
+#include "tracer.hh"
+
+// What the controller records in its trace (TraceRecord::event)
+enum ControllerTraceEvent : uint16_t {
+  TRACE_WINDOW = 1,   // window: window size
+  TRACE_SENT,         // sequence_number, time_ms[0]: send time, value: after timeout?
+  TRACE_ACK,          // sequence_number, time_ms[0]: send time, time_ms[1]: receive time
+                      // (receiver's clock), value: rtt (ms)
+  TRACE_CE,           // sequence_number: acked, value: datagrams newly marked CE
+  TRACE_RECOVERED     // sequence_number: lost, but recovered by the receiver (FEC)
+};
+// (every record also carries the window and queue size estimate)
+
 /* Congestion controller interface */
 class NormalDistribution {
   private:
@@ -38,8 +51,23 @@ class NormalDistribution {
 
 class Controller
 {
+public:
+  // What one flow learned about its path, to give the next flow over the
+  // same path a head start (see WarmStartFile)
+  struct LearnedState {
+    std::vector<double> posterior;  // probability of each rate, in support order
+    int window_size;                // window (datagrams) when the flow ended
+    double rtt_ms;                  // last round-trip time sample
+
+    LearnedState() : posterior(), window_size(0), rtt_ms(0) {}
+
+    // Whether this is a real distribution and window (e.g. not NaN)
+    bool valid() const;
+  };
+
 private:
-  bool debug_; /* Enables debugging output */
+  Tracer * tracer_; /* Where to record events (or nullptr) */
+  uint16_t flow_id_; /* Which flow this is, in the trace */
 
   /* Add member variables here */
   uint64_t last_acked_sequence_number_;
@@ -60,35 +88,110 @@ private:
 
   NormalDistribution gaussian_;
 
+  // When the kernel says each datagram left the host (ns, timestamp_ns timeline),
+  // for datagrams not yet acked; used only for rtt_ms_
+  std::map<uint64_t, uint64_t> departure_ns_;
+
+  // Most recent round-trip sample (ms); the rate forecast doesn't use it
+  // (it counts deliveries by the receiver's clock)
+  double rtt_ms_;
+
+  // Packets the most recent forecast expects to be delivered
+  int last_forecast_;
+
+  // Fraction of datagrams lost (moving average over about LOSS_HORIZON
+  // datagrams, each one skipped over by an ack counting as lost)
+  double loss_rate_;
+
+  // Newest datagram sent, and the first sent after the last backoff for
+  // CE marks (marks on anything earlier are the same congestion)
+  uint64_t last_sent_sequence_number_;
+  uint64_t next_ce_backoff_sequence_number_;
+
 public:
   /* Public interface for the congestion controller */
   /* You can change these if you prefer, but will need to change
      the call site as well (in sender.cc) */
 
-  /* Default constructor */
-  Controller( const bool debug );
+  /* Default constructor (events are recorded to tracer, if there is one) */
+  Controller( Tracer * const tracer = nullptr, const uint16_t flow_id = 0 );
+
+  /* Forbid copying (every copy would trace as the same flow) */
+  Controller( const Controller & other ) = delete;
+  Controller & operator=( const Controller & other ) = delete;
 
   /* Get current window size, in datagrams */
   unsigned int window_size();
 
+  /* Advance the rate estimate through every tick that has elapsed
+     (also done lazily by window_size()) */
+  void tick();
+
+  /* How often tick() has work to do, in milliseconds */
+  unsigned int tick_ms() const;
+
   /* A datagram was sent */
   void datagram_was_sent( const uint64_t sequence_number,
 			  const uint64_t send_timestamp,
 			  const bool after_timeout );
 
+  /* The kernel reported when a sent datagram actually left the host
+     (this refines rtt_ms() only) */
+  void send_completed( const uint64_t sequence_number,
+		       const uint64_t departure_timestamp_ns );
+
   /* An ack was received */
   void ack_received( const uint64_t sequence_number_acked,
 		     const uint64_t send_timestamp_acked,
 		     const uint64_t recv_timestamp_acked,
-		     const uint64_t timestamp_ack_received );
+		     const uint64_t timestamp_ack_received,
+		     const uint64_t timestamp_ack_received_ns );
+
+  /* The network marked datagrams CE (ECN congestion experienced)
+     instead of dropping them; the ack for sequence_number_acked was
+     the first to report marks newly_marked */
+  void congestion_marked( const uint64_t sequence_number_acked,
+			  const unsigned int newly_marked );
+
+  /* The network lost a datagram, but the receiver recovered it (with FEC) */
+  void datagram_recovered( const uint64_t sequence_number );
 
   /* How long to wait (in milliseconds) if there are no acks
      before sending one more datagram */
   unsigned int timeout_ms();
 
+  /* Most recent round-trip time sample, in milliseconds (for the sender's
+     statistics, the multipath scheduler and warm starts; the window doesn't
+     depend on it) */
+  double rtt_ms() const { return rtt_ms_; }
+
+  /* What the controller currently believes (for monitoring; no side effects) */
+  int current_window_size() const { return window_size_; }
+  int queue_size_estimate() const { return queue_size_estimate_; }
+  int last_forecast() const { return last_forecast_; }
+
+  /* Datagrams per second the latest forecast expects the path to deliver */
+  double forecast_rate() const;
+
+  /* Fraction of recent datagrams that were lost */
+  double loss_rate() const { return loss_rate_; }
+
+  /* What this flow has learned so far */
+  LearnedState learned_state() const;
+
+  /* Start from what an earlier flow learned instead of a uniform
+     posterior (returns false, changing nothing, if it doesn't fit) */
+  bool warm_start(const LearnedState & state);
+
   void update_distr(int);
   std::unordered_map<double, double> brownian(const std::unordered_map<double, double> &);
   int forecast();
+
+private:
+  // Record an event with the current window and estimate
+  void trace(const uint16_t event, const uint64_t sequence_number = 0,
+      const uint64_t time_ms = 0, const uint64_t other_time_ms = 0,
+      const double value = 0);
 };
 
 class Poisson {
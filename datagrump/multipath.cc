@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstring>
+
+#include <endian.h>
+
+#include "multipath.hh"
+
+using namespace std;
+
+/* marks a payload that starts with a multipath header (ordinary
+   datagrums' payloads are all 'x') */
+static const char MULTIPATH_MAGIC[ 4 ] = { 'D', 'G', 'M', 'P' };
+
+MultipathHeader::MultipathHeader( const uint64_t s_connection_id,
+				  const uint64_t s_data_sequence_number,
+				  const uint32_t s_path_id )
+  : connection_id( s_connection_id ),
+    data_sequence_number( s_data_sequence_number ),
+    path_id( s_path_id )
+{}
+
+/* Parse header from the start of a payload */
+bool MultipathHeader::parse( const string & payload, MultipathHeader & header )
+{
+  if ( payload.size() < SIZE
+       or memcmp( payload.data(), MULTIPATH_MAGIC, sizeof( MULTIPATH_MAGIC ) ) ) {
+    return false;
+  }
+
+  uint32_t path_id;
+  uint64_t connection_id, data_sequence_number;
+  memcpy( &path_id, payload.data() + 4, sizeof( path_id ) );
+  memcpy( &connection_id, payload.data() + 8, sizeof( connection_id ) );
+  memcpy( &data_sequence_number, payload.data() + 16, sizeof( data_sequence_number ) );
+
+  header = MultipathHeader( be64toh( connection_id ), be64toh( data_sequence_number ),
+			    be32toh( path_id ) );
+  return true;
+}
+
+/* Make wire representation of header (all fields in network byte order) */
+string MultipathHeader::to_string() const
+{
+  const uint32_t network_path_id = htobe32( path_id );
+  const uint64_t network_connection_id = htobe64( connection_id );
+  const uint64_t network_data_sequence_number = htobe64( data_sequence_number );
+
+  string ret( MULTIPATH_MAGIC, sizeof( MULTIPATH_MAGIC ) );
+  ret.append( reinterpret_cast<const char *>( &network_path_id ), sizeof( network_path_id ) );
+  ret.append( reinterpret_cast<const char *>( &network_connection_id ),
+	      sizeof( network_connection_id ) );
+  ret.append( reinterpret_cast<const char *>( &network_data_sequence_number ),
+	      sizeof( network_data_sequence_number ) );
+  return ret;
+}
+
+MultipathConnection::MultipathConnection( const uint64_t now_ns )
+  : next_data_sequence_number( 0 ),
+    waiting(),
+    paths(),
+    delivered( 0 ),
+    lost( 0 ),
+    duplicates( 0 ),
+    first_arrival_ns( now_ns ),
+    last_arrival_ns( now_ns ),
+    reorder_wait_us()
+{}
+
+void MultipathConnection::record_datagram( const MultipathHeader & header, const uint64_t now_ns )
+{
+  if ( header.path_id < MAX_PATHS ) {
+    if ( header.path_id >= paths.size() ) {
+      paths.resize( header.path_id + 1, Path() );
+    }
+    Path & path = paths.at( header.path_id );
+    path.datagrams++;
+    path.highest_data_sequence_number = max( path.highest_data_sequence_number,
+					     header.data_sequence_number );
+    path.last_arrival_ns = now_ns;
+  }
+  last_arrival_ns = now_ns;
+
+  if ( header.data_sequence_number < next_data_sequence_number
+       or not waiting.emplace( header.data_sequence_number, now_ns ).second ) {
+    duplicates++; /* (or arrived after it was given up on) */
+    return;
+  }
+
+  deliver_in_order( now_ns );
+
+  /* give up on whatever the oldest waiting datagram is still waiting for */
+  while ( not waiting.empty() and next_is_lost( now_ns ) ) {
+    lost += waiting.begin()->first - next_data_sequence_number;
+    next_data_sequence_number = waiting.begin()->first;
+    deliver_in_order( now_ns );
+  }
+}
+
+void MultipathConnection::deliver_in_order( const uint64_t now_ns )
+{
+  while ( not waiting.empty() and waiting.begin()->first == next_data_sequence_number ) {
+    reorder_wait_us.record( (now_ns - waiting.begin()->second) / 1000 );
+    waiting.erase( waiting.begin() );
+    next_data_sequence_number++;
+    delivered++;
+  }
+}
+
+bool MultipathConnection::next_is_lost( const uint64_t now_ns ) const
+{
+  if ( now_ns > waiting.begin()->second + REORDER_TIMEOUT_NS or waiting.size() > MAX_WAITING ) {
+    return true;
+  }
+
+  for ( const Path & path : paths ) {
+    const bool in_use = path.datagrams and now_ns <= path.last_arrival_ns + REORDER_TIMEOUT_NS;
+    if ( in_use and path.highest_data_sequence_number <= next_data_sequence_number ) {
+      return false; /* it could still come this way */
+    }
+  }
+
+  return true;
+}
+
+MultipathTable::MultipathTable( const uint64_t idle_timeout_ns )
+  : connections_(),
+    idle_timeout_ns_( idle_timeout_ns )
+{}
+
+MultipathConnection & MultipathTable::record_arrival( const MultipathHeader & header,
+						      const uint64_t now_ns )
+{
+  auto it = connections_.find( header.connection_id );
+  if ( it == connections_.end() ) {
+    it = connections_.emplace( header.connection_id, MultipathConnection( now_ns ) ).first;
+  }
+
+  it->second.record_datagram( header, now_ns );
+  return it->second;
+}
+
+void MultipathTable::evict_idle( const uint64_t now_ns, const ConnectionCallback & on_evict )
+{
+  for ( auto it = connections_.begin(); it != connections_.end(); ) {
+    if ( now_ns > it->second.last_arrival_ns + idle_timeout_ns_ ) {
+      on_evict( it->first, it->second );
+      it = connections_.erase( it );
+    } else {
+      ++it;
+    }
+  }
+}
@@ -0,0 +1,112 @@
+#ifndef MULTIPATH_HH
+#define MULTIPATH_HH
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "histogram.hh"
+
+/* In multipath mode, one sender stripes a single stream of datagrams
+   across several paths (sockets bound to different local addresses or
+   interfaces), each with its own Controller. Every datagram's payload
+   starts with this header, saying which connection and path it belongs
+   to and its place in the connection's stream. The receiver acks each
+   path on its own, as usual, and echoes the header in the ack with how
+   much of the stream it has merged back into order. */
+struct MultipathHeader
+{
+  static const size_t SIZE = 24; /* on the wire */
+
+  uint64_t connection_id;
+
+  /* datagrams: place in the stream;
+     acks: every datagram before this one has been delivered (or given up on) */
+  uint64_t data_sequence_number;
+
+  uint32_t path_id;
+
+  MultipathHeader( const uint64_t s_connection_id = 0,
+		   const uint64_t s_data_sequence_number = 0,
+		   const uint32_t s_path_id = 0 );
+
+  /* parse from the start of a payload
+     (returns false if the payload doesn't start with one) */
+  static bool parse( const std::string & payload, MultipathHeader & header );
+
+  /* Make wire representation of header */
+  std::string to_string() const;
+};
+
+/* what the receiver knows about one multipath connection */
+struct MultipathConnection
+{
+  static const uint32_t MAX_PATHS = 16;
+
+  /* Each path delivers in order, so a missing datagram is given up on
+     once every path still in use has delivered a later one. Failing
+     that, the datagrams after it stop waiting for it after this long,
+     or once this many are waiting. */
+  static const uint64_t REORDER_TIMEOUT_NS = 500000000;
+  static const size_t MAX_WAITING = 65536;
+
+  struct Path
+  {
+    uint64_t datagrams;
+    uint64_t highest_data_sequence_number;
+    uint64_t last_arrival_ns;
+  };
+
+  uint64_t next_data_sequence_number; /* the first not yet delivered */
+  std::map< uint64_t, uint64_t > waiting; /* arrived early: arrival time (ns), by data sequence number */
+
+  std::vector< Path > paths; /* by path id */
+  uint64_t delivered, lost, duplicates;
+  uint64_t first_arrival_ns, last_arrival_ns; /* on the monotonic_ns() timeline */
+
+  /* how long each datagram waited for the ones before it
+     (the cost of striping over paths with different delays) */
+  Histogram reorder_wait_us;
+
+  MultipathConnection( const uint64_t now_ns );
+
+  /* account for one datagram, delivering whatever is now in order */
+  void record_datagram( const MultipathHeader & header, const uint64_t now_ns );
+
+private:
+  /* deliver every waiting datagram that's next in order */
+  void deliver_in_order( const uint64_t now_ns );
+
+  /* whether the next datagram in order can't still be on its way */
+  bool next_is_lost( const uint64_t now_ns ) const;
+};
+
+/* multipath connections keyed by connection id, forgotten after they go quiet */
+class MultipathTable
+{
+public:
+  typedef std::unordered_map< uint64_t, MultipathConnection > Connections;
+  typedef std::function<void(const uint64_t, const MultipathConnection &)> ConnectionCallback;
+
+private:
+  Connections connections_;
+  uint64_t idle_timeout_ns_;
+
+public:
+  MultipathTable( const uint64_t idle_timeout_ns );
+
+  /* account for a datagram of a multipath connection, starting it if needed */
+  MultipathConnection & record_arrival( const MultipathHeader & header, const uint64_t now_ns );
+
+  /* forget every connection idle for longer than the timeout,
+     calling on_evict with each one first */
+  void evict_idle( const uint64_t now_ns, const ConnectionCallback & on_evict );
+
+  /* accessors */
+  const Connections & connections() const { return connections_; }
+};
+
+#endif /* MULTIPATH_HH */
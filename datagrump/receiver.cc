@@ -1,12 +1,151 @@
 /* simple UDP receiver that acknowledges every datagram */
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
 
 #include "socket.hh"
 #include "contest_message.hh"
+#include "poller.hh"
+#include "signalfd.hh"
+#include "eventfd.hh"
+#include "io_uring.hh"
+#include "session_table.hh"
+#include "multipath.hh"
+#include "stream.hh"
+#include "histogram.hh"
+#include "stats_file.hh"
+#include "profiler.hh"
+#include "pcap_writer.hh"
+#include "link_trace_writer.hh"
+#include "timestamp.hh"
+#include "util.hh"
 
 using namespace std;
+using namespace PollerShortNames;
+
+/* stdout, where every shard writes its senders' byte streams: left alone
+   until some sender streams, then made non-blocking once (the flag belongs
+   to the open file, which every descriptor for it shares, the shell's too) */
+class StreamOutput
+{
+private:
+  mutex mutex_;
+  bool opened_;
+  int original_flags_;
+
+public:
+  StreamOutput() : mutex_(), opened_( false ), original_flags_( 0 ) {}
+
+  /* a descriptor for stdout (safe from any thread) */
+  FileDescriptor open();
+
+  /* put stdout's flags back as they were found (once every shard is done) */
+  void restore();
+};
+
+/* one shard of the receiver: its own socket, event loop and sessions
+   (with SO_REUSEPORT, a given sender's packets always reach the same shard) */
+class DatagrumpReceiver
+{
+private:
+  unsigned int shard_id_;
+  UDPSocket socket_;
+  EventFD stop_event_;
+  EventFD report_event_;
+
+  SessionTable sessions_; /* one per sender */
+  MultipathTable connections_; /* one per multipath sender, over its paths' sessions */
+
+  unsigned int busy_poll_usec_;
+  bool use_io_uring_;
+
+  /* live metrics (if asked for), and what they're computed from */
+  unique_ptr< StatsFile > stats_;
+  unique_ptr< PcapWriter > pcap_; /* captures every datagram (if asked for) */
+  unique_ptr< LinkTraceWriter > link_trace_; /* records deliveries for mm-link (if asked for) */
+
+  /* where senders' byte streams go (stdout, opened on the first stream),
+     and whether some stream has bytes for it */
+  StreamOutput & stream_output_;
+  unique_ptr< FileDescriptor > output_;
+  bool output_pending_;
+  Address local_address_;
+  uint64_t datagrams_, bytes_; /* received by this shard */
+  uint64_t published_datagrams_, published_bytes_; /* as of the last snapshot */
+  Histogram interval_delay_ms_; /* queueing delay since the last snapshot */
+
+  static const uint64_t METRICS_INTERVAL_MS = 1000;
+
+  Poller poller_;
+
+  void acknowledge( const UDPSocket::received_datagram & recd );
+  void send_ack( const Address & destination, ContestMessage & message );
+  void open_output();
+  void write_streams();
+  void publish_metrics( const uint64_t interval_ms );
+  void report( const Address & source, const ReceiverSession & session,
+	       const std::string & state ) const;
+  void report( const uint64_t connection_id, const MultipathConnection & connection,
+	       const std::string & state ) const;
+
+public:
+  DatagrumpReceiver( const unsigned int shard_id, const string & port,
+		     const bool reuseport, const unsigned int busy_poll_usec,
+		     const bool use_io_uring, const uint64_t idle_timeout_ms,
+		     const string & stats_path, const string & pcap_path,
+		     const uint32_t snaplen, const string & link_trace_path,
+		     StreamOutput & stream_output );
+
+  UDPSocket & socket() { return socket_; }
+
+  /* acknowledge datagrams until stop() is called */
+  void loop();
+
+  /* ask loop() to return (safe from any thread) */
+  void stop() { stop_event_.signal(); }
+
+  /* ask loop() to report on every session (safe from any thread) */
+  void request_report() { report_event_.signal(); }
+};
+
+/* steer each packet to shard (hash or CPU) mod shard count */
+vector< sock_filter > steering_program( const string & steer, const unsigned int shards )
+{
+  uint32_t ancillary;
+  if ( steer == "hash" ) {
+    ancillary = SKF_AD_RXHASH;
+  } else if ( steer == "cpu" ) {
+    ancillary = SKF_AD_CPU;
+  } else {
+    throw runtime_error( "unknown steering \"" + steer + "\" (expected hash or cpu)" );
+  }
+
+  return { BPF_STMT( BPF_LD | BPF_W | BPF_ABS, uint32_t( SKF_AD_OFF ) + ancillary ),
+	   BPF_STMT( BPF_ALU | BPF_MOD | BPF_K, shards ),
+	   BPF_STMT( BPF_RET | BPF_A, 0 ) };
+}
+
+void usage( const char * const argv0 )
+{
+  cerr << "Usage: " << argv0 << " [--busy-poll=USEC] [--io-uring]"
+       << " [--threads=N [--pin] [--steer=hash|cpu]] [--idle-timeout=MS]"
+       << " [--stats=FILE] [--profile[=FILE]] [--pcap=FILE [--snaplen=BYTES]]"
+       << " [--link-trace=FILE] PORT" << endl
+       << "(send SIGUSR1 for a report on every session;"
+       << " a multipath sender's paths must all reach one shard;"
+       << " streams are written to stdout)" << endl;
+}
 
 int main( int argc, char *argv[] )
 {
@@ -15,38 +154,629 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[ 0 ] << " PORT" << endl;
+  unsigned int busy_poll_usec = 0;
+  bool use_io_uring = false;
+  unsigned int threads = 1;
+  bool pin = false;
+  string steer;
+  uint64_t idle_timeout_ms = 30000;
+  string stats_path, profile_path, pcap_path, link_trace_path;
+  uint32_t snaplen = PcapWriter::HEADERS_ONLY;
+  bool profile = false;
+
+  const option command_line_options[] = {
+    { "busy-poll", required_argument, nullptr, 'b' },
+    { "io-uring",  no_argument,       nullptr, 'u' },
+    { "threads",   required_argument, nullptr, 't' },
+    { "pin",       no_argument,       nullptr, 'p' },
+    { "steer",     required_argument, nullptr, 's' },
+    { "idle-timeout", required_argument, nullptr, 'i' },
+    { "stats",     required_argument, nullptr, 'm' },
+    { "profile",   optional_argument, nullptr, 'f' },
+    { "pcap",      required_argument, nullptr, 'c' },
+    { "snaplen",   required_argument, nullptr, 'l' },
+    { "link-trace", required_argument, nullptr, 'r' },
+    { nullptr,     0,                 nullptr, 0 }
+  };
+
+  while ( true ) {
+    const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+    if ( opt == -1 ) {
+      break;
+    }
+
+    switch ( opt ) {
+    case 'b':
+      busy_poll_usec = stoul( optarg );
+      break;
+    case 'u':
+      use_io_uring = true;
+      break;
+    case 't':
+      threads = stoul( optarg );
+      break;
+    case 'p':
+      pin = true;
+      break;
+    case 's':
+      steer = optarg;
+      break;
+    case 'i':
+      idle_timeout_ms = stoull( optarg );
+      break;
+    case 'm':
+      stats_path = optarg;
+      break;
+    case 'f':
+      profile = true;
+      profile_path = optarg ? optarg : "";
+      break;
+    case 'c':
+      pcap_path = optarg;
+      break;
+    case 'l':
+      snaplen = stoul( optarg );
+      break;
+    case 'r':
+      link_trace_path = optarg;
+      break;
+    default:
+      usage( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( optind != argc - 1 or threads == 0 or idle_timeout_ms == 0 ) {
+    usage( argv[ 0 ] );
     return EXIT_FAILURE;
   }
 
-  /* create UDP socket for incoming datagrams */
-  UDPSocket socket;
+  /* optionally receive and send through io_uring (if this kernel can) */
+  if ( use_io_uring and not IOUring::available() ) {
+    cerr << "Warning: io_uring unavailable, falling back to poll" << endl;
+    use_io_uring = false;
+  }
+
+  if ( use_io_uring and threads > 1 ) {
+    cerr << "The io_uring engine uses one ring per process, so it needs --threads=1" << endl;
+    return EXIT_FAILURE;
+  }
+
+  /* optionally time each phase of every shard's event loop
+     (a table at exit, and collapsed stacks for flamegraph.pl in FILE) */
+  if ( profile ) {
+    Profiler::enable();
+  }
+
+  /* handle SIGINT/SIGTERM as events, so we can report before exiting,
+     and SIGUSR1 as a request to report now
+     (blocked before any threads start, so none of them get them) */
+  SignalMask handled_signals( { SIGINT, SIGTERM, SIGUSR1 } );
+  handled_signals.set_as_mask();
+  SignalFD signal_fd( handled_signals );
+
+  /* one socket per shard, all bound to the same port */
+  StreamOutput stream_output;
+  vector< unique_ptr< DatagrumpReceiver > > shards;
+  for ( unsigned int i = 0; i < threads; i++ ) {
+    /* (each shard publishes its own metrics and writes its own capture and trace) */
+    auto shard_path = [&] ( const string & path ) {
+      return (path.empty() or threads == 1) ? path : path + "." + to_string( i );
+    };
+    shards.emplace_back( new DatagrumpReceiver( i, argv[ optind ], threads > 1,
+						busy_poll_usec, use_io_uring, idle_timeout_ms,
+						shard_path( stats_path ), shard_path( pcap_path ),
+						snaplen, shard_path( link_trace_path ),
+						stream_output ) );
+  }
+
+  if ( not steer.empty() ) {
+    shards.front()->socket().attach_reuseport_cbpf( steering_program( steer, threads ) );
+  }
+
+  cerr << "Listening on " << shards.front()->socket().local_address().to_string();
+  if ( threads > 1 ) {
+    cerr << " (" << threads << " shards)";
+  }
+  cerr << endl;
+
+  /* run each shard on its own thread */
+  vector< thread > workers;
+  for ( unsigned int i = 0; i < threads; i++ ) {
+    workers.emplace_back( [&, i] () {
+	try {
+	  if ( pin ) {
+	    pin_to_core( i );
+	  }
+	  shards.at( i )->loop();
+	} catch ( const exception & e ) {
+	  print_exception( e );
+	  kill( getpid(), SIGTERM ); /* bring down the other shards too */
+	}
+      } );
+  }
+
+  /* wait for SIGINT/SIGTERM, then stop every shard
+     (each shard reports on its own sessions, from its own thread) */
+  Poller poller;
+  poller.add_action( Action( signal_fd, Direction::In, [&] () {
+	if ( signal_fd.read_signal().ssi_signo == SIGUSR1 ) {
+	  for ( auto & shard : shards ) {
+	    shard->request_report();
+	  }
+	  return ResultType::Continue;
+	}
+	return ResultType::Exit;
+      } ) );
+
+  while ( poller.poll( -1 ).result != PollResult::Exit ) {}
+
+  for ( auto & shard : shards ) {
+    shard->stop();
+  }
+
+  for ( auto & worker : workers ) {
+    worker.join();
+  }
+
+  stream_output.restore();
+
+  if ( profile ) {
+    Profiler::report( cerr );
+    if ( not profile_path.empty() ) {
+      ofstream collapsed( profile_path );
+      Profiler::write_collapsed( collapsed );
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+FileDescriptor StreamOutput::open()
+{
+  FileDescriptor output( SystemCall( "dup", dup( STDOUT_FILENO ) ) );
+
+  unique_lock< mutex > lock( mutex_ );
+  if ( not opened_ ) {
+    original_flags_ = SystemCall( "fcntl", fcntl( STDOUT_FILENO, F_GETFL ) );
+
+    /* a slow reader of our stdout holds up only the streams it's reading
+       (a terminal is left alone, since the shell shares it) */
+    if ( not isatty( STDOUT_FILENO ) ) {
+      output.set_blocking( false );
+    }
+    opened_ = true;
+  }
+
+  return output;
+}
+
+void StreamOutput::restore()
+{
+  unique_lock< mutex > lock( mutex_ );
+  if ( opened_ ) {
+    SystemCall( "fcntl", fcntl( STDOUT_FILENO, F_SETFL, original_flags_ ) );
+  }
+}
+
+DatagrumpReceiver::DatagrumpReceiver( const unsigned int shard_id, const string & port,
+				      const bool reuseport, const unsigned int busy_poll_usec,
+				      const bool use_io_uring, const uint64_t idle_timeout_ms,
+				      const string & stats_path, const string & pcap_path,
+				      const uint32_t snaplen, const string & link_trace_path,
+				      StreamOutput & stream_output )
+  : shard_id_( shard_id ),
+    socket_(),
+    stop_event_(),
+    report_event_(),
+    sessions_( idle_timeout_ms * 1000000 ),
+    connections_( idle_timeout_ms * 1000000 ),
+    busy_poll_usec_( busy_poll_usec ),
+    use_io_uring_( use_io_uring ),
+    stats_(),
+    pcap_(),
+    link_trace_(),
+    stream_output_( stream_output ),
+    output_(),
+    output_pending_( false ),
+    local_address_(),
+    datagrams_( 0 ),
+    bytes_( 0 ),
+    published_datagrams_( 0 ),
+    published_bytes_( 0 ),
+    interval_delay_ms_(),
+    poller_()
+{
+  if ( not pcap_path.empty() ) {
+    pcap_.reset( new PcapWriter( pcap_path, snaplen ) );
+  }
+
+  if ( not link_trace_path.empty() ) {
+    link_trace_.reset( new LinkTraceWriter( link_trace_path ) );
+  }
+
+  if ( not stats_path.empty() ) {
+    stats_.reset( new StatsFile( stats_path, { "datagrams_per_s", "goodput_mbps", "sessions",
+	    "delay_p50_ms", "delay_p95_ms", "delay_p99_ms", "poller_wakeups" } ) );
+  }
 
   /* turn on timestamps on receipt */
-  socket.set_timestamps();
+  socket_.set_timestamps();
+
+  /* and the ECN codepoint each datagram arrived with (to count CE marks for the sender) */
+  socket_.set_recv_ecn();
+
+  /* let every shard bind the same port */
+  if ( reuseport ) {
+    socket_.set_reuseport();
+  }
 
   /* "bind" the socket to the user-specified local port number */
-  socket.bind( Address( "::0", argv[ 1 ] ) );
+  socket_.bind( Address( "::0", port ) );
+  local_address_ = socket_.local_address();
+
+  /* optionally spin instead of sleeping while waiting for datagrams */
+  if ( busy_poll_usec_ ) {
+    try {
+      socket_.set_busy_poll( busy_poll_usec_ );
+    } catch ( const unix_error & e ) {
+      cerr << "Warning: kernel busy polling unavailable (" << e.what() << ")" << endl;
+    }
+  }
+}
+
+/* acknowledge a datagram back to its source */
+void DatagrumpReceiver::acknowledge( const UDPSocket::received_datagram & recd )
+{
+  ContestMessage message = recd.payload;
+  const uint64_t now_ns = fast_monotonic_ns();
 
-  cerr << "Listening on " << socket.local_address().to_string() << endl;
+  const int64_t one_way_delay_ms = int64_t( recd.timestamp ) - int64_t( message.header.send_timestamp );
+  ReceiverSession & session = sessions_.record_arrival( recd.source_address,
+							 recd.payload.size(),
+							 now_ns,
+							 recd.timestamp_ns,
+							 one_way_delay_ms );
 
-  uint64_t sequence_number = 0;
+  /* a multipath sender's datagram also joins its connection's stream */
+  MultipathHeader multipath;
+  const bool is_multipath = MultipathHeader::parse( message.payload, multipath );
 
-  /* Loop and acknowledge every incoming datagram back to its source */
+  /* a stream's data is put back in order, to be written out as it's ready */
+  StreamHeader stream;
+  const bool is_stream = not is_multipath and StreamHeader::parse( message.payload, stream )
+    and message.payload.size() >= StreamHeader::SIZE + stream.length;
+
+  if ( is_multipath ) {
+    multipath.data_sequence_number
+      = connections_.record_arrival( multipath, now_ns ).next_data_sequence_number;
+  } else if ( is_stream ) {
+    if ( not session.stream ) {
+      session.stream.reset( new StreamReceiver() );
+      if ( not output_ ) {
+	open_output();
+      }
+    }
+    stream = session.stream->receive( stream, message.payload.data() + StreamHeader::SIZE );
+    output_pending_ = output_pending_ or session.stream->readable();
+  }
+
+  /* with FEC, lost datagrams come back as soon as enough of their block
+     arrives (each carries a copy of its header, so anything delivered
+     with another sequence number than this datagram's was recovered) */
+  vector< string > recovered;
+  if ( not is_multipath and not is_stream ) {
+    session.fec.receive( message.payload, [&] ( const string & data ) {
+	if ( data.size() >= sizeof( ContestMessage::Header )
+	     and ContestMessage::Header( data ).sequence_number != message.header.sequence_number ) {
+	  recovered.push_back( data );
+	}
+      } );
+  }
+
+  session.ecn_datagrams[ recd.ecn ]++;
+
+  datagrams_++;
+  bytes_ += recd.payload.size();
+  if ( stats_ ) {
+    interval_delay_ms_.record( one_way_delay_ms - session.min_one_way_delay_ms );
+  }
+
+  /* assemble the acknowledgment */
+  message.transform_into_ack( session.next_ack_sequence_number++, recd.timestamp,
+			      session.ecn_datagrams[ UDPSocket::CE ] );
+
+  /* (and tell a multipath sender how much of its stream is in order) */
+  if ( is_multipath ) {
+    message.payload = multipath.to_string();
+  }
+
+  /* (or a streaming one which segment arrived, and how much room is left) */
+  if ( is_stream ) {
+    message.payload = stream.to_string();
+  }
+
+  /* (counted as IPv4 and UDP on the wire, like mahimahi's packets) */
+  if ( link_trace_ ) {
+    link_trace_->record_delivery( recd.payload.size() + 28, recd.timestamp_ns );
+  }
+
+  if ( pcap_ ) {
+    pcap_->write( recd.source_address, local_address_, recd.payload, recd.timestamp_ns, recd.ecn );
+  }
+
+  send_ack( recd.source_address, message );
+
+  /* then ack each recovered datagram, as of now, so the sender needn't wait
+     for it to time out (it's marked, so the sender still counts it as lost) */
+  for ( const auto & data : recovered ) {
+    ContestMessage recovered_message( data );
+    recovered_message.transform_into_ack( session.next_ack_sequence_number++, recd.timestamp,
+					  session.ecn_datagrams[ UDPSocket::CE ] );
+    recovered_message.header.ack_payload_length = data.size();
+    recovered_message.mark_recovered();
+    send_ack( recd.source_address, recovered_message );
+  }
+}
+
+/* timestamp an ack, and send it */
+void DatagrumpReceiver::send_ack( const Address & destination, ContestMessage & message )
+{
+  /* timestamp the ack just before sending */
+  message.set_send_timestamp();
+  const string ack = message.to_string();
+
+  /* (the ack is captured as of just before it's sent) */
+  if ( pcap_ ) {
+    pcap_->write( local_address_, destination, ack, timestamp_ns() );
+  }
+
+  /* send the ack */
+  if ( use_io_uring_ ) {
+    IOUring::process_ring().sendto( socket_, destination, ack );
+  } else {
+    socket_.sendto( destination, ack );
+  }
+}
+
+void DatagrumpReceiver::loop()
+{
+  if ( busy_poll_usec_ ) {
+    poller_.set_busy_poll( busy_poll_usec_ * 1000 );
+  }
+
+  /* first rule: acknowledge every incoming datagram
+     (and any others already waiting behind it) */
+  if ( use_io_uring_ ) {
+    /* acks are submitted in one batch per wakeup */
+    IOUring & ring = IOUring::process_ring();
+    ring.add_to( poller_ );
+    ring.recv_datagrams( socket_, [&] ( const UDPSocket::received_datagram & recd ) {
+	acknowledge( recd );
+      } );
+  } else {
+    poller_.add_action( Action( socket_, Direction::In, [&] () {
+	  UDPSocket::received_datagram recd = socket_.recv();
+	  do {
+	    acknowledge( recd );
+	  } while ( socket_.try_recv( recd ) );
+	  return ResultType::Continue;
+	} ) );
+  }
+
+  /* second rule: forget senders that have gone quiet */
+  const uint64_t eviction_interval_ns = min( sessions_.idle_timeout_ns(), uint64_t( 1000000000 ) );
+  poller_.add_timer( eviction_interval_ns, [&] () {
+      sessions_.evict_idle( fast_monotonic_ns(), [&] ( const Address & source,
+						       const ReceiverSession & session ) {
+			      report( source, session, "idle" );
+			    } );
+      connections_.evict_idle( fast_monotonic_ns(), [&] ( const uint64_t connection_id,
+							  const MultipathConnection & connection ) {
+				 report( connection_id, connection, "idle" );
+			       } );
+      return ResultType::Continue;
+    }, eviction_interval_ns );
+
+  /* third rule: publish live metrics (if asked for) */
+  if ( stats_ ) {
+    poller_.add_timer( METRICS_INTERVAL_MS * 1000000, [&] () {
+	publish_metrics( METRICS_INTERVAL_MS );
+	return ResultType::Continue;
+      }, METRICS_INTERVAL_MS * 1000000 );
+  }
+
+  /* fourth rule: report on every session when asked to */
+  poller_.add_action( Action( report_event_, Direction::In, [&] () {
+	report_event_.read_event();
+	for ( const auto & session : sessions_.sessions() ) {
+	  report( session.first, session.second, "active" );
+	}
+	for ( const auto & connection : connections_.connections() ) {
+	  report( connection.first, connection.second, "active" );
+	}
+	return ResultType::Continue;
+      } ) );
+
+  /* fifth rule: quit when asked to
+     (and open_output() adds a sixth: write out the streams' data) */
+  poller_.add_action( Action( stop_event_, Direction::In, [&] () {
+	stop_event_.read_event();
+	return ResultType::Exit;
+      } ) );
+
+  /* Loop and acknowledge every incoming datagram until it's time to quit */
   while ( true ) {
-    const UDPSocket::received_datagram recd = socket.recv();
-    ContestMessage message = recd.payload;
+    const auto ret = poller_.poll( -1 );
+    if ( ret.result == PollResult::Exit ) {
+      break;
+    }
+  }
 
-    /* assemble the acknowledgment */
-    message.transform_into_ack( sequence_number++, recd.timestamp );
+  /* hand over whatever the streams still have, however long stdout takes */
+  if ( output_ ) {
+    output_->set_blocking( true );
+    write_streams();
+  }
 
-    /* timestamp the ack just before sending */
-    message.set_send_timestamp();
+  for ( const auto & session : sessions_.sessions() ) {
+    report( session.first, session.second, "active" );
+  }
+  for ( const auto & connection : connections_.connections() ) {
+    report( connection.first, connection.second, "active" );
+  }
 
-    /* send the ack */
-    socket.sendto( recd.source_address, message.to_string() );
+  if ( pcap_ ) {
+    pcap_->flush(); /* (so the count covers the last of it) */
+    const uint64_t dropped = pcap_->dropped_packets();
+    if ( dropped ) {
+      cerr << "Shard " << shard_id_ << " capture: " << dropped << " of " << pcap_->packets()
+	   << " datagrams dropped" << endl;
+    }
   }
 
-  return EXIT_SUCCESS;
+  if ( link_trace_ ) {
+    link_trace_->flush();
+    const uint64_t dropped = link_trace_->dropped_opportunities();
+    if ( dropped ) {
+      /* (mm-link would replay each gap as an outage that never happened) */
+      cerr << "Shard " << shard_id_ << " link trace: " << dropped << " of "
+	   << link_trace_->opportunities() << " delivery opportunities dropped;"
+	   << " the trace has gaps and shouldn't be replayed" << endl;
+    }
+  }
+
+  if ( use_io_uring_ ) {
+    const IOUring & ring = IOUring::process_ring();
+    if ( ring.oversized_datagrams() ) {
+      cerr << "Shard " << shard_id_ << " io_uring: " << ring.oversized_datagrams()
+	   << " datagrams too big for a receive buffer dropped" << endl;
+    }
+    if ( ring.failed_sends() ) {
+      cerr << "Shard " << shard_id_ << " io_uring: " << ring.failed_sends() << " acks not sent (last: "
+	   << strerror( ring.last_send_error() ) << ")" << endl;
+    }
+  }
+
+  if ( busy_poll_usec_ ) {
+    const auto & stats = poller_.busy_poll_stats();
+    cerr << "Shard " << shard_id_ << " busy poll: spun " << stats.spin_ns / 1000000 << " ms ("
+	 << stats.spin_wakeups << " wakeups), slept " << stats.idle_ns / 1000000 << " ms ("
+	 << stats.idle_wakeups << " wakeups)" << endl;
+  }
+}
+
+/* start writing senders' byte streams to stdout */
+void DatagrumpReceiver::open_output()
+{
+  output_.reset( new FileDescriptor( stream_output_.open() ) );
+
+  /* write out the streams' data as it comes in order (and stdout has room for it) */
+  poller_.add_action( Action( *output_, Direction::Out, [&] () {
+	write_streams();
+	return ResultType::Continue;
+      },
+      [&] () { return output_pending_; } ) );
+}
+
+/* write every stream's in-order bytes to stdout, until it's full */
+void DatagrumpReceiver::write_streams()
+{
+  output_pending_ = false;
+
+  for ( auto & session : sessions_.sessions() ) {
+    StreamReceiver * const stream = session.second.stream.get();
+    if ( not stream ) {
+      continue;
+    }
+
+    while ( stream->readable() and stream->write_to( *output_ ) ) {}
+
+    /* (no room: try again when there is) */
+    output_pending_ = output_pending_ or stream->readable();
+  }
+}
+
+/* print a session's receive statistics and their distributions */
+void DatagrumpReceiver::report( const Address & source, const ReceiverSession & session,
+				const string & state ) const
+{
+  const uint64_t duration_ms = (session.last_arrival_ns - session.first_arrival_ns) / 1000000;
+
+  cerr << "Shard " << shard_id_ << ": " << source.to_string() << " (" << state << "): "
+       << session.datagrams << " datagrams, " << session.bytes << " bytes over "
+       << duration_ms << " ms" << endl;
+
+  if ( session.datagrams < 2 ) {
+    return;
+  }
+
+  cerr << "  queueing delay (ms): " << session.queueing_delay_ms.summary() << endl
+       << "  inter-arrival (us): " << session.interarrival_us.summary() << endl;
+
+  if ( session.throughput_kbps.count() ) {
+    cerr << "  throughput (kbit/s per " << ReceiverSession::THROUGHPUT_INTERVAL_NS / 1000000
+	 << " ms): " << session.throughput_kbps.summary() << endl;
+  }
+
+  if ( session.ecn_datagrams[ UDPSocket::NotECT ] < session.datagrams ) {
+    cerr << "  ECN: " << session.ecn_datagrams[ UDPSocket::ECT0 ] << " ECT(0), "
+	 << session.ecn_datagrams[ UDPSocket::ECT1 ] << " ECT(1), "
+	 << session.ecn_datagrams[ UDPSocket::CE ] << " CE, "
+	 << session.ecn_datagrams[ UDPSocket::NotECT ] << " not ECN-capable" << endl;
+  }
+
+  if ( session.stream ) {
+    const StreamReceiver::Statistics & stream = session.stream->statistics();
+    cerr << "  stream: " << session.stream->bytes_read() << " bytes written out"
+	 << ( session.stream->finished() ? " (complete)" : "" ) << ", "
+	 << stream.duplicate_bytes << " received twice, "
+	 << stream.dropped_segments << " segments dropped for lack of room" << endl;
+  }
+
+  const FecDecoder::Statistics & fec = session.fec.statistics();
+  if ( fec.parity ) {
+    cerr << "  FEC: " << fec.recovered << " datagrams recovered, " << fec.unrecovered
+	 << " lost for good (" << fec.data << " data and " << fec.parity << " parity received)" << endl;
+  }
+}
+
+/* print how well a multipath connection's paths merged back into one stream */
+void DatagrumpReceiver::report( const uint64_t connection_id, const MultipathConnection & connection,
+				const string & state ) const
+{
+  const uint64_t duration_ms = (connection.last_arrival_ns - connection.first_arrival_ns) / 1000000;
+
+  cerr << "Shard " << shard_id_ << ": multipath connection " << hex << connection_id << dec
+       << " (" << state << "): " << connection.delivered << " datagrams delivered in order over "
+       << duration_ms << " ms, " << connection.lost << " given up on, "
+       << connection.duplicates << " duplicate or late" << endl;
+
+  cerr << "  datagrams by path:";
+  for ( size_t i = 0; i < connection.paths.size(); i++ ) {
+    cerr << " " << i << ": " << connection.paths.at( i ).datagrams;
+  }
+  cerr << endl;
+
+  if ( connection.reorder_wait_us.count() ) {
+    cerr << "  reorder wait (us): " << connection.reorder_wait_us.summary() << endl;
+  }
+}
+
+/* publish this shard's metrics (rates over the last interval) */
+void DatagrumpReceiver::publish_metrics( const uint64_t interval_ms )
+{
+  const double seconds = interval_ms / 1000.0;
+
+  stats_->publish( { (datagrams_ - published_datagrams_) / seconds,
+	(bytes_ - published_bytes_) * 8 / seconds / 1e6,
+	double( sessions_.sessions().size() ),
+	double( interval_delay_ms_.percentile( 50 ) ),
+	double( interval_delay_ms_.percentile( 95 ) ),
+	double( interval_delay_ms_.percentile( 99 ) ),
+	double( poller_.wakeup_stats().wakeups ) } );
+
+  published_datagrams_ = datagrams_;
+  published_bytes_ = bytes_;
+  interval_delay_ms_.clear();
 }
@@ -2,20 +2,70 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <deque>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
 #include "socket.hh"
 #include "contest_message.hh"
 #include "controller.hh"
+#include "fec.hh"
+#include "gf256.hh"
+#include "multipath.hh"
+#include "stream.hh"
+#include "mapped_file.hh"
+#include "histogram.hh"
 #include "poller.hh"
+#include "signalfd.hh"
+#include "profiler.hh"
+#include "pcap_writer.hh"
+#include "stats_file.hh"
+#include "timestamp.hh"
+#include "tracer.hh"
+#include "util.hh"
+#include "warm_start.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
-/* simple sender class to handle the accounting */
+/* nanoseconds per millisecond */
+static const uint64_t MILLION = 1000000;
+
+class MultipathScheduler;
+
+/* simple sender class to handle the accounting for one flow */
 class DatagrumpSender
 {
+public:
+  /* what one flow achieved */
+  struct Statistics {
+    uint64_t datagrams_sent;
+    uint64_t datagrams_acked;
+    uint64_t bytes_acked;
+    double rtt_ms_total; /* round-trip time, summed over acked datagrams */
+    uint64_t timeouts; /* datagrams sent because no ack came */
+    uint64_t parity_sent; /* FEC parity datagrams (counted in datagrams_sent) */
+    uint64_t datagrams_recovered; /* lost, but recovered by the receiver with FEC
+				     (counted in bytes_acked, not datagrams_acked) */
+    uint64_t ce_marked; /* datagrams the network marked CE, as the receiver last reported */
+  };
+
 private:
+  unsigned int flow_id_;
   UDPSocket socket_;
+  UDPSocket::ECN ecn_; /* codepoint every datagram is sent with */
+  Address local_address_, destination_;
+  PcapWriter * pcap_; /* captures every datagram, if not nullptr */
+  MultipathScheduler * scheduler_; /* in multipath mode, decides which path sends each datagram */
+  unique_ptr< FecEncoder > fec_; /* codes what's sent in blocks, if asked for */
+  StreamSender * stream_; /* in stream mode, the byte stream every datagram carries part of */
   Controller controller_; /* your class */
 
   uint64_t sequence_number_; /* next outgoing sequence number */
@@ -25,16 +75,146 @@ private:
      next expects will be acknowledged by the receiver */
   uint64_t next_ack_expected_;
 
+  /* sequence numbers of sent datagrams still waiting for the kernel's
+     send timestamp, and the send id of the first one */
+  std::deque<uint64_t> awaiting_send_timestamp_;
+  uint32_t first_awaiting_send_id_;
+  static const size_t MAX_AWAITING_SEND_TIMESTAMPS = 4096;
+
+  Poller::TimerID timeout_timer_;
+
+  Statistics statistics_;
+  Histogram interval_rtt_us_; /* since the last metrics snapshot */
+
   void send_datagram( const bool after_timeout );
-  void got_ack( const uint64_t timestamp, const ContestMessage & msg );
+
+  /* the next payload with FEC: a block's parity once it's complete, otherwise
+     data (a copy of header, so the receiver can ack the datagram if it recovers it) */
+  string next_fec_payload( const ContestMessage::Header & header );
+  void got_ack( const UDPSocket::received_datagram & recd, const ContestMessage & msg );
+  void got_send_completion( const UDPSocket::send_completion & completion );
+
+  /* the window is open (and in multipath mode, the scheduler picked this path;
+     in stream mode, there's something to send) */
+  bool ready_to_send();
+
+public:
+  /* (local is the address or interface to send through, in multipath mode,
+     fec_block_size, if not 0, how many datagrams each FEC block has, and
+     stream, if not nullptr, what to send instead of dummy payloads) */
+  DatagrumpSender( const unsigned int flow_id, const Address & destination,
+		   const string & local, Tracer * const tracer, PcapWriter * const pcap,
+		   const unsigned int busy_poll_usec, MultipathScheduler * const scheduler,
+		   const unsigned int fec_block_size, StreamSender * const stream,
+		   const UDPSocket::ECN ecn );
+
+  /* add this flow's rules to a poller (which may be shared with other flows) */
+  void add_to( Poller & poller );
+
+  unsigned int flow_id() const { return flow_id_; }
+  const UDPSocket & socket() const { return socket_; }
+  const Statistics & statistics() const { return statistics_; }
+  const Controller & controller() const { return controller_; }
+  Controller & controller() { return controller_; }
+  Histogram & interval_rtt_us() { return interval_rtt_us_; }
+
+  /* room for another datagram in the window */
   bool window_is_open();
 
+  /* datagrams sent but not yet acked */
+  uint64_t in_flight() const { return sequence_number_ - next_ack_expected_; }
+
+  /* rules added to a poller refer back to the sender */
+  DatagrumpSender( const DatagrumpSender & other ) = delete;
+  DatagrumpSender & operator=( const DatagrumpSender & other ) = delete;
+};
+
+/* multipath mode: stripes one stream of datagrams over every path,
+   sending each on the path expected to deliver it soonest (so a slow
+   path only carries what the fast ones can't, without holding up the
+   stream behind it) */
+class MultipathScheduler
+{
+private:
+  uint64_t connection_id_;
+  uint64_t next_data_sequence_number_;
+  uint64_t data_delivered_; /* receiver has everything before this in order (or gave up on it) */
+  vector< DatagrumpSender * > paths_;
+
+  /* a path's forecast capacity, in datagrams per second, is taken to be at least this */
+  static constexpr double MIN_RATE = 10;
+
+  /* how long the path takes to send one more datagram (ms) */
+  static double interval_ms( const DatagrumpSender & path );
+
+  /* how soon a datagram sent on the path now would arrive (ms):
+     half a round trip, after everything already in flight */
+  static double delivery_ms( const DatagrumpSender & path );
+
 public:
-  DatagrumpSender( const char * const host, const char * const port,
-		   const bool debug );
-  int loop();
+  MultipathScheduler( const uint64_t connection_id );
+
+  void add_path( DatagrumpSender & path ) { paths_.push_back( &path ); }
+
+  /* whether path (whose window is open) should send the next datagram,
+     or leave it for a path that would deliver it sooner, even if that
+     one has to wait for its window to open */
+  bool should_send( const DatagrumpSender & path );
+
+  /* header for the next datagram of the stream, to send on path_id */
+  MultipathHeader next_header( const unsigned int path_id );
+
+  /* the receiver acked a datagram (on any path) */
+  void got_ack( const MultipathHeader & ack );
+
+  /* accessors */
+  uint64_t connection_id() const { return connection_id_; }
+  uint64_t datagrams_sent() const { return next_data_sequence_number_; }
+  uint64_t datagrams_delivered() const { return data_delivered_; }
 };
 
+/* print per-flow and aggregate throughput and round-trip time, and how fairly the flows shared */
+void report( const vector< unique_ptr< DatagrumpSender > > & flows, const uint64_t duration_ms );
+
+/* what these flows learned, for the next run to start from
+   (nothing if no flow got an ack) */
+bool learned_state( const vector< const DatagrumpSender * > & flows,
+		    Controller::LearnedState & state );
+
+/* live metrics for statstail to watch (totals over every flow) */
+class SenderMetrics
+{
+private:
+  StatsFile stats_;
+
+  /* totals as of the last snapshot */
+  uint64_t last_ms_, last_sent_, last_bytes_acked_;
+
+public:
+  /* how often to publish */
+  static const uint64_t INTERVAL_MS = 1000;
+
+  SenderMetrics( const string & path );
+
+  /* take a snapshot of every flow (rates since the last one) and publish it */
+  void publish( const vector< unique_ptr< DatagrumpSender > > & flows, const Poller & poller );
+};
+
+
+/* where the debug argument sends the controllers' trace */
+static const string DEBUG_TRACE_FILE = "sender.trace";
+
+void usage( const char * const argv0 )
+{
+  cerr << "Usage: " << argv0 << " [--busy-poll=USEC] [--flows=N] [--trace=FILE] [--stats=FILE]"
+       << " [--profile[=FILE]] [--warm-start=FILE] [--pcap=FILE [--snaplen=BYTES]]"
+       << " [--path=ADDRESS|INTERFACE ...] [--fec=BLOCK_SIZE] [--stream=FILE|-] [--ecn=ect0|ect1]"
+       << " HOST PORT [debug]" << endl
+       << "(debug is short for --trace=" << DEBUG_TRACE_FILE << ";"
+       << " each --path adds a path for one multipath flow;"
+       << " --stream sends FILE, or stdin, reliably to the receiver's stdout)" << endl;
+}
+
 int main( int argc, char *argv[] )
 {
    /* check the command-line arguments */
@@ -42,57 +222,489 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  bool debug = false;
-  if ( argc == 4 and string( argv[ 3 ] ) == "debug" ) {
-    debug = true;
-  } else if ( argc == 3 ) {
+  unsigned int busy_poll_usec = 0;
+  unsigned int flow_count = 1;
+  unsigned int fec_block_size = 0;
+  string trace_path, stats_path, profile_path, pcap_path, warm_start_path, stream_path;
+  vector< string > paths; /* local address or interface of each path (multipath mode) */
+  uint32_t snaplen = PcapWriter::HEADERS_ONLY;
+  bool profile = false;
+  UDPSocket::ECN ecn = UDPSocket::NotECT;
+
+  const option command_line_options[] = {
+    { "busy-poll", required_argument, nullptr, 'b' },
+    { "flows",     required_argument, nullptr, 'f' },
+    { "trace",     required_argument, nullptr, 't' },
+    { "stats",     required_argument, nullptr, 's' },
+    { "profile",   optional_argument, nullptr, 'p' },
+    { "pcap",      required_argument, nullptr, 'c' },
+    { "snaplen",   required_argument, nullptr, 'l' },
+    { "warm-start", required_argument, nullptr, 'w' },
+    { "path",      required_argument, nullptr, 'a' },
+    { "fec",       required_argument, nullptr, 'e' },
+    { "stream",    required_argument, nullptr, 'r' },
+    { "ecn",       required_argument, nullptr, 'n' },
+    { nullptr,     0,                 nullptr, 0 }
+  };
+
+  while ( true ) {
+    const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+    if ( opt == -1 ) {
+      break;
+    }
+
+    switch ( opt ) {
+    case 'b':
+      busy_poll_usec = stoul( optarg );
+      break;
+    case 'f':
+      flow_count = stoul( optarg );
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 's':
+      stats_path = optarg;
+      break;
+    case 'p':
+      profile = true;
+      profile_path = optarg ? optarg : "";
+      break;
+    case 'c':
+      pcap_path = optarg;
+      break;
+    case 'l':
+      snaplen = stoul( optarg );
+      break;
+    case 'w':
+      warm_start_path = optarg;
+      break;
+    case 'a':
+      paths.push_back( optarg );
+      break;
+    case 'e':
+      fec_block_size = stoul( optarg );
+      break;
+    case 'r':
+      stream_path = optarg;
+      break;
+    case 'n':
+      if ( string( optarg ) == "ect0" ) {
+	ecn = UDPSocket::ECT0;
+      } else if ( string( optarg ) == "ect1" ) {
+	ecn = UDPSocket::ECT1; /* (L4S) */
+      } else {
+	usage( argv[ 0 ] );
+	return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+  }
+
+  const int positional_args = argc - optind;
+
+  if ( positional_args == 3 and string( argv[ optind + 2 ] ) == "debug" ) {
+    trace_path = DEBUG_TRACE_FILE;
+  } else if ( positional_args == 2 ) {
     /* do nothing */
   } else {
-    cerr << "Usage: " << argv[ 0 ] << " HOST PORT [debug]" << endl;
+    usage( argv[ 0 ] );
     return EXIT_FAILURE;
   }
 
-  /* create sender object to handle the accounting */
-  /* all the interesting work is done by the Controller */
-  DatagrumpSender sender( argv[ 1 ], argv[ 2 ], debug );
-  return sender.loop();
+  /* (FEC, multipath and stream headers would each want the front of the payload,
+     and a stream is carried by one flow) */
+  const unsigned int payload_modes = bool( fec_block_size ) + not paths.empty() + not stream_path.empty();
+  if ( flow_count == 0 or ( flow_count > 1 and not paths.empty() ) or payload_modes > 1
+       or ( flow_count > 1 and not stream_path.empty() ) ) {
+    usage( argv[ 0 ] );
+    return EXIT_FAILURE;
+  }
+
+  /* optionally time each phase of the event loop and the controllers
+     (a table at exit, and collapsed stacks for flamegraph.pl in FILE) */
+  if ( profile ) {
+    Profiler::enable();
+  }
+
+  /* handle SIGINT/SIGTERM as events, so we can report before exiting */
+  SignalMask exit_signals( { SIGINT, SIGTERM } );
+  exit_signals.set_as_mask();
+  SignalFD signal_fd( exit_signals );
+
+  /* optionally record what every controller does (written out by a background
+     thread, so tracing hardly changes the timing being traced) */
+  unique_ptr< Tracer > tracer;
+  if ( not trace_path.empty() ) {
+    tracer.reset( new Tracer( trace_path ) );
+    cerr << "Tracing to " << trace_path << " (decode with tracedump)" << endl;
+  }
+
+  /* optionally capture every datagram sent and received (headers only,
+     unless a snaplen says otherwise) */
+  unique_ptr< PcapWriter > pcap;
+  if ( not pcap_path.empty() ) {
+    pcap.reset( new PcapWriter( pcap_path, snaplen ) );
+  }
+
+  /* every flow shares one event-driven "poller" (and so one core) */
+  Poller poller;
+
+  /* optionally spin instead of sleeping while waiting for acks */
+  if ( busy_poll_usec ) {
+    poller.set_busy_poll( busy_poll_usec * 1000 );
+  }
+
+  /* in multipath mode, one flow is striped over every path
+     (each a sender object of its own, with its own Controller) */
+  unique_ptr< MultipathScheduler > scheduler;
+  if ( not paths.empty() ) {
+    random_device random;
+    scheduler.reset( new MultipathScheduler( (uint64_t( random() ) << 32) | random() ) );
+    flow_count = paths.size();
+  }
+
+  /* in stream mode, the flow carries a file (sent straight from its mapping)
+     or whatever arrives on stdin, as the receiver has room for it */
+  unique_ptr< MappedFile > stream_file;
+  unique_ptr< StreamSender > stream;
+  unique_ptr< FileDescriptor > stream_input;
+  auto read_input = [&] () {
+    poller.add_action( Action( *stream_input, Direction::In, [&] () {
+	  stream->write( stream_input->read( stream->writable() ) );
+	  if ( stream_input->eof() ) {
+	    stream->close();
+	    return ResultType::Cancel;
+	  }
+
+	  /* (flow control: stop reading while the receiver is behind,
+	     until acks drain the stream) */
+	  return stream->writable() ? ResultType::Continue : ResultType::Cancel;
+	} ) );
+  };
+
+  if ( stream_path == "-" ) {
+    stream.reset( new StreamSender() );
+    stream_input.reset( new FileDescriptor( STDIN_FILENO ) );
+    stream->set_drain_handler( read_input );
+    read_input();
+  } else if ( not stream_path.empty() ) {
+    stream_file.reset( new MappedFile( stream_path ) );
+    stream.reset( new StreamSender( stream_file->data(), stream_file->size() ) );
+  }
+
+  /* create one sender object per flow to handle the accounting */
+  /* all the interesting work is done by each flow's Controller */
+  const Address destination( argv[ optind ], argv[ optind + 1 ] );
+  vector< unique_ptr< DatagrumpSender > > flows;
+  for ( unsigned int i = 0; i < flow_count; i++ ) {
+    flows.emplace_back( new DatagrumpSender( i, destination, scheduler ? paths.at( i ) : "",
+						tracer.get(), pcap.get(), busy_poll_usec,
+						scheduler.get(), fec_block_size, stream.get(), ecn ) );
+    flows.back()->add_to( poller );
+    if ( scheduler ) {
+      scheduler->add_path( *flows.back() );
+    }
+  }
+
+  cerr << "Sending to " << destination.to_string();
+  if ( scheduler ) {
+    cerr << " (multipath connection " << hex << scheduler->connection_id() << dec << " via";
+    for ( const auto & path : paths ) {
+      cerr << " " << path;
+    }
+    cerr << ")";
+  } else if ( flow_count > 1 ) {
+    cerr << " (" << flow_count << " flows)";
+  } else if ( stream ) {
+    cerr << " (streaming " << ( stream_file ? stream_path : "stdin" ) << ")";
+  }
+  cerr << endl;
+
+  /* optionally start every flow from what the last run to this
+     destination learned (and save what this run learns at exit;
+     in multipath mode, each path learns on its own) */
+  auto warm_start_key = [&] ( const unsigned int flow_id ) {
+    return scheduler ? destination.ip() + " via " + paths.at( flow_id ) : destination.ip();
+  };
+
+  unique_ptr< WarmStartFile > warm_start;
+  if ( not warm_start_path.empty() ) {
+    warm_start.reset( new WarmStartFile( warm_start_path ) );
+
+    for ( auto & flow : flows ) {
+      const string key = warm_start_key( flow->flow_id() );
+      Controller::LearnedState state;
+      if ( warm_start->lookup( key, state ) ) {
+	if ( not flow->controller().warm_start( state ) ) {
+	  cerr << "Warning: unusable warm start for " << key << endl;
+	} else if ( scheduler or flow->flow_id() == 0 ) { /* (once per key) */
+	  cerr << "Warm start from " << warm_start_path << " for " << key
+	       << " (window " << state.window_size << ")" << endl;
+	}
+      }
+    }
+  }
+
+  /* optionally publish live metrics for statstail to watch */
+  unique_ptr< SenderMetrics > metrics;
+  if ( not stats_path.empty() ) {
+    metrics.reset( new SenderMetrics( stats_path ) );
+    poller.add_timer( SenderMetrics::INTERVAL_MS * MILLION, [&] () {
+	metrics->publish( flows, poller );
+	return ResultType::Continue;
+      }, SenderMetrics::INTERVAL_MS * MILLION );
+  }
+
+  /* quit on SIGINT/SIGTERM */
+  poller.add_action( Action( signal_fd, Direction::In, [&] () {
+	signal_fd.read_signal();
+	return ResultType::Exit;
+      } ) );
+
+  /* Run every flow's rules until it's time to quit */
+  const uint64_t start_ms = monotonic_ms();
+  while ( true ) {
+    const auto ret = poller.poll( -1 );
+    if ( ret.result == PollResult::Exit ) {
+      report( flows, monotonic_ms() - start_ms );
+
+      if ( scheduler ) {
+	cerr << "Multipath: " << scheduler->datagrams_delivered() << " of "
+	     << scheduler->datagrams_sent() << " datagrams delivered in order" << endl;
+      }
+
+      if ( fec_block_size ) {
+	uint64_t parity_sent = 0, datagrams_sent = 0, datagrams_recovered = 0;
+	for ( const auto & flow : flows ) {
+	  parity_sent += flow->statistics().parity_sent;
+	  datagrams_sent += flow->statistics().datagrams_sent;
+	  datagrams_recovered += flow->statistics().datagrams_recovered;
+	}
+	cerr << "FEC: " << parity_sent << " of " << datagrams_sent << " datagrams were parity ("
+	     << GF256::implementation() << "), " << datagrams_recovered
+	     << " lost datagrams recovered by the receiver, loss estimate "
+	     << 100 * flows.front()->controller().loss_rate() << "%" << endl;
+      }
+
+      if ( ecn != UDPSocket::NotECT ) {
+	uint64_t ce_marked = 0, datagrams_acked = 0;
+	for ( const auto & flow : flows ) {
+	  ce_marked += flow->statistics().ce_marked;
+	  datagrams_acked += flow->statistics().datagrams_acked;
+	}
+	cerr << "ECN: " << ce_marked << " of " << datagrams_acked << " datagrams acked were marked CE" << endl;
+      }
+
+      if ( stream ) {
+	/* what the transfer itself achieved (all of it, if it finished) */
+	const uint64_t duration_ms = max( uint64_t( 1 ), monotonic_ms() - start_ms );
+	const auto & stats = stream->statistics();
+	cerr << "Stream: " << stream->bytes_acked() << " of " << stream->bytes_written()
+	     << " bytes delivered in " << duration_ms << " ms ("
+	     << stream->bytes_acked() * 8.0 / duration_ms / 1000.0 << " Mbit/s goodput, "
+	     << ( stream->complete() ? "complete" : "incomplete" ) << "), "
+	     << stats.retransmissions << " of " << stats.segments_sent << " segments retransmitted" << endl;
+      }
+
+      if ( warm_start ) {
+	/* (in multipath mode, each path learned on its own) */
+	vector< vector< const DatagrumpSender * > > learners( scheduler ? flows.size() : 1 );
+	for ( const auto & flow : flows ) {
+	  learners.at( scheduler ? flow->flow_id() : 0 ).push_back( flow.get() );
+	}
+
+	for ( unsigned int i = 0; i < learners.size(); i++ ) {
+	  Controller::LearnedState state;
+	  if ( learned_state( learners.at( i ), state ) ) {
+	    warm_start->store( warm_start_key( i ), state );
+	  }
+	}
+	warm_start->save();
+      }
+
+      if ( busy_poll_usec ) {
+	const auto & stats = poller.busy_poll_stats();
+	cerr << "Busy poll: spun " << stats.spin_ns / MILLION << " ms ("
+	     << stats.spin_wakeups << " wakeups), slept " << stats.idle_ns / MILLION << " ms ("
+	     << stats.idle_wakeups << " wakeups)" << endl;
+      }
+
+      if ( profile ) {
+	Profiler::report( cerr );
+	if ( not profile_path.empty() ) {
+	  ofstream collapsed( profile_path );
+	  Profiler::write_collapsed( collapsed );
+	}
+      }
+
+      if ( pcap ) {
+	flows.clear(); /* (no more datagrams) */
+	pcap->flush(); /* (so the count covers the last of it) */
+	const uint64_t dropped = pcap->dropped_packets();
+	if ( dropped ) {
+	  cerr << "Capture: " << dropped << " of " << pcap->packets() << " datagrams dropped" << endl;
+	}
+      }
+
+      if ( tracer ) {
+	flows.clear(); /* (no more events) */
+	const uint64_t dropped = tracer->dropped();
+	tracer.reset();
+	if ( dropped ) {
+	  cerr << "Trace: " << dropped << " events dropped (ring full)" << endl;
+	}
+      }
+      return ret.exit_status;
+    }
+  }
 }
 
-DatagrumpSender::DatagrumpSender( const char * const host,
-				  const char * const port,
-				  const bool debug )
-  : socket_(),
-    controller_( debug ),
+DatagrumpSender::DatagrumpSender( const unsigned int flow_id,
+				  const Address & destination,
+				  const string & local,
+				  Tracer * const tracer,
+				  PcapWriter * const pcap,
+				  const unsigned int busy_poll_usec,
+				  MultipathScheduler * const scheduler,
+				  const unsigned int fec_block_size,
+				  StreamSender * const stream,
+				  const UDPSocket::ECN ecn )
+  : flow_id_( flow_id ),
+    socket_(),
+    ecn_( ecn ),
+    local_address_(),
+    destination_( destination ),
+    pcap_( pcap ),
+    scheduler_( scheduler ),
+    fec_(),
+    stream_( stream ),
+    controller_( tracer, flow_id ),
     sequence_number_( 0 ),
-    next_ack_expected_( 0 )
+    next_ack_expected_( 0 ),
+    awaiting_send_timestamp_(),
+    first_awaiting_send_id_( 0 ),
+    timeout_timer_( 0 ),
+    statistics_(),
+    interval_rtt_us_()
 {
+  if ( fec_block_size ) {
+    fec_.reset( new FecEncoder( fec_block_size ) );
+  }
+
   /* turn on timestamps when socket receives a datagram */
   socket_.set_timestamps();
 
+  /* optionally tell routers we'll back off if they mark datagrams CE
+     (the receiver counts the marks and reports them in every ack) */
+  if ( ecn_ != UDPSocket::NotECT ) {
+    socket_.set_ecn( ecn_ );
+  }
+
+  /* and when each datagram actually leaves the host */
+  socket_.set_send_timestamps();
+  first_awaiting_send_id_ = socket_.send_id();
+
+  /* optionally spin instead of sleeping while waiting for acks */
+  if ( busy_poll_usec ) {
+    try {
+      socket_.set_busy_poll( busy_poll_usec );
+    } catch ( const unix_error & e ) {
+      if ( flow_id_ == 0 ) { /* (once is enough) */
+	cerr << "Warning: kernel busy polling unavailable (" << e.what() << ")" << endl;
+      }
+    }
+  }
+
+  /* optionally send through a particular local address or interface */
+  if ( not local.empty() ) {
+    in6_addr scratch;
+    if ( inet_pton( AF_INET, local.c_str(), &scratch ) == 1
+	 or inet_pton( AF_INET6, local.c_str(), &scratch ) == 1 ) {
+      socket_.bind( Address( local, 0 ) );
+    } else {
+      socket_.set_bindtodevice( local );
+    }
+  }
+
   /* connect socket to the remote host */
   /* (note: this doesn't send anything; it just tags the socket
      locally with the remote address */
-  socket_.connect( Address( host, port ) );  
-
-  cerr << "Sending to " << socket_.peer_address().to_string() << endl;
+  socket_.connect( destination );
+  local_address_ = socket_.local_address();
 }
-
-void DatagrumpSender::got_ack( const uint64_t timestamp,
+void DatagrumpSender::got_ack( const UDPSocket::received_datagram & recd,
 			       const ContestMessage & ack )
 {
   if ( not ack.is_ack() ) {
     throw runtime_error( "sender got something other than an ack from the receiver" );
   }
 
+  /* a datagram the receiver recovered with FEC: it's delivered, but the
+     network still lost it (so it's no RTT sample, and still a loss) */
+  if ( ack.is_recovered_ack() ) {
+    statistics_.datagrams_recovered++;
+    statistics_.bytes_acked += ack.header.ack_payload_length;
+    controller_.datagram_recovered( ack.header.ack_sequence_number );
+    return;
+  }
+
   /* Update sender's counter */
   next_ack_expected_ = max( next_ack_expected_,
 			    ack.header.ack_sequence_number + 1 );
 
+  /* Update statistics */
+  statistics_.datagrams_acked++;
+  statistics_.bytes_acked += ack.header.ack_payload_length;
   /* Inform congestion controller */
   controller_.ack_received( ack.header.ack_sequence_number,
 			    ack.header.ack_send_timestamp,
 			    ack.header.ack_recv_timestamp,
-			    timestamp );
+			    recd.timestamp,
+			    recd.timestamp_ns );
+  statistics_.rtt_ms_total += controller_.rtt_ms();
+  interval_rtt_us_.record( max( 0.0, controller_.rtt_ms() ) * 1000 );
+
+  /* tell the controller about any CE marks this ack is the first to report
+     (the count only grows, so an ack that arrives late reports none) */
+  if ( ack.header.ack_ce_count > statistics_.ce_marked ) {
+    controller_.congestion_marked( ack.header.ack_sequence_number,
+				   ack.header.ack_ce_count - statistics_.ce_marked );
+    statistics_.ce_marked = ack.header.ack_ce_count;
+  }
+
+  /* in multipath mode, the ack also says how much of the stream is in order */
+  MultipathHeader multipath;
+  if ( scheduler_ and MultipathHeader::parse( ack.payload, multipath ) ) {
+    scheduler_->got_ack( multipath );
+  }
+
+  /* in stream mode, it also says which segment arrived and how much room is left */
+  StreamHeader stream;
+  if ( stream_ and StreamHeader::parse( ack.payload, stream ) ) {
+    stream_->got_ack( ack.header.ack_sequence_number, stream );
+  }
+}
+
+void DatagrumpSender::got_send_completion( const UDPSocket::send_completion & completion )
+{
+  /* how far is this report past the oldest datagram we're waiting on?
+     (reports we never got are skipped; wraparound-safe) */
+  const uint32_t offset = completion.send_id - first_awaiting_send_id_;
+  if ( offset >= awaiting_send_timestamp_.size() ) {
+    return; /* stale or unknown report */
+  }
+
+  const uint64_t sequence_number = awaiting_send_timestamp_.at( offset );
+  awaiting_send_timestamp_.erase( awaiting_send_timestamp_.begin(),
+				  awaiting_send_timestamp_.begin() + offset + 1 );
+  first_awaiting_send_id_ = completion.send_id + 1;
+
+  /* Inform congestion controller */
+  controller_.send_completed( sequence_number, completion.timestamp_ns );
 }
 
 void DatagrumpSender::send_datagram( const bool after_timeout )
@@ -100,9 +712,46 @@ void DatagrumpSender::send_datagram( const bool after_timeout )
   /* All messages use the same dummy payload */
   static const string dummy_payload( 1424, 'x' );
 
-  ContestMessage cm( sequence_number_++, dummy_payload );
+  const uint64_t sequence_number = sequence_number_++;
+  ContestMessage cm( sequence_number, ( stream_ or fec_ ) ? string() : dummy_payload );
+
+  /* in stream mode, the payload is the segment's header, then its data,
+     which is sent from where it is (see below) */
+  StreamSender::Payload segment;
+  if ( stream_ ) {
+    segment = stream_->next_segment( sequence_number );
+    cm.payload = segment.header;
+  }
+
+  if ( scheduler_ ) {
+    /* (the stream's next datagram, in the same size of payload) */
+    cm.payload.replace( 0, MultipathHeader::SIZE, scheduler_->next_header( flow_id_ ).to_string() );
+  }
   cm.set_send_timestamp();
-  socket_.send( cm.to_string() );
+  if ( fec_ ) {
+    cm.payload = next_fec_payload( cm.header );
+  }
+  awaiting_send_timestamp_.push_back( cm.header.sequence_number );
+  if ( awaiting_send_timestamp_.size() > MAX_AWAITING_SEND_TIMESTAMPS ) {
+    /* kernel isn't reporting (or is dropping) send timestamps */
+    awaiting_send_timestamp_.pop_front();
+    first_awaiting_send_id_++;
+  }
+  const string datagram = cm.to_string();
+  const uint64_t send_time_ns = pcap_ ? timestamp_ns() : 0;
+  if ( stream_ ) {
+    /* (gathered, so a segment's data is never copied on its way to the kernel) */
+    const iovec pieces[] = { { const_cast<char *>( datagram.data() ), datagram.size() },
+			     segment.data[ 0 ], segment.data[ 1 ] };
+    socket_.send( pieces, 3 );
+  } else {
+    socket_.send( datagram );
+  }
+  if ( pcap_ ) {
+    pcap_->write( local_address_, destination_, stream_ ? datagram + segment.copy_data() : datagram,
+		  send_time_ns, ecn_ );
+  }
+  statistics_.datagrams_sent++;
 
   /* Inform congestion controller */
   controller_.datagram_was_sent( cm.header.sequence_number,
@@ -110,46 +759,281 @@ void DatagrumpSender::send_datagram( const bool after_timeout )
 				 after_timeout );
 }
 
+string DatagrumpSender::next_fec_payload( const ContestMessage::Header & header )
+{
+  /* (data is shorter by the FEC header and the header copy,
+     so every datagram stays the same size) */
+  static const string dummy_payload( 1424 - FecEncoder::HEADER_SIZE
+				     - sizeof( ContestMessage::Header ), 'x' );
+
+  if ( fec_->has_parity() ) {
+    statistics_.parity_sent++;
+    return fec_->next_parity();
+  }
+
+  /* each block gets as much parity as the loss rate calls for */
+  if ( fec_->at_block_start() ) {
+    fec_->set_parity_count( FecEncoder::parity_for_loss( fec_->data_count(),
+							 controller_.loss_rate() ) );
+  }
+
+  return fec_->encode( header.to_string() + dummy_payload );
+}
+
 bool DatagrumpSender::window_is_open()
 {
   return sequence_number_ - next_ack_expected_ < controller_.window_size();
 }
 
-int DatagrumpSender::loop()
+bool DatagrumpSender::ready_to_send()
 {
-  /* read and write from the receiver using an event-driven "poller" */
-  Poller poller;
+  return window_is_open() and ( not scheduler_ or scheduler_->should_send( *this ) )
+    and ( not stream_ or stream_->has_segment() );
+}
 
+void DatagrumpSender::add_to( Poller & poller )
+{
   /* first rule: if the window is open, close it by
      sending more datagrams */
-  poller.add_action( Action( socket_, Direction::Out, [&] () {
+  poller.add_action( Action( socket_, Direction::Out, [this] () {
 	/* Close the window */
-	while ( window_is_open() ) {
+	while ( ready_to_send() ) {
 	  send_datagram( false );
 	}
 	return ResultType::Continue;
       },
       /* We're only interested in this rule when the window is open */
-      [&] () { return window_is_open(); } ) );
+      [this] () { return ready_to_send(); } ) );
 
   /* second rule: if sender receives an ack,
      process it and inform the controller
      (by using the sender's got_ack method) */
-  poller.add_action( Action( socket_, Direction::In, [&] () {
+  poller.add_action( Action( socket_, Direction::In, [this, &poller] () {
 	const UDPSocket::received_datagram recd = socket_.recv();
+	if ( pcap_ ) {
+	  pcap_->write( recd.source_address, local_address_, recd.payload, recd.timestamp_ns );
+	}
 	const ContestMessage ack  = recd.payload;
-	got_ack( recd.timestamp, ack );
+	got_ack( recd, ack );
+
+	/* the network is moving, so push back the timeout */
+	poller.reschedule_timer( timeout_timer_, controller_.timeout_ms() * MILLION );
+
+	/* in stream mode, we're done once the receiver has the whole stream */
+	return ( stream_ and stream_->complete() ) ? ResultType::Exit : ResultType::Continue;
+      } ) );
+
+  /* third rule: if the kernel has reported when datagrams left the host,
+     match the reports to sequence numbers and inform the controller */
+  poller.add_action( Action( socket_, Direction::Error, [this] () {
+	for ( const auto & completion : socket_.recv_send_completions() ) {
+	  got_send_completion( completion );
+	}
 	return ResultType::Continue;
       } ) );
 
-  /* Run these two rules forever */
-  while ( true ) {
-    const auto ret = poller.poll( controller_.timeout_ms() );
-    if ( ret.result == PollResult::Exit ) {
-      return ret.exit_status;
-    } else if ( ret.result == PollResult::Timeout ) {
-      /* After a timeout, send one datagram to try to get things moving again */
+  /* fourth rule: if no ack arrives for a while, send one datagram
+     to try to get things moving again (and keep doing so;
+     in stream mode, it carries the oldest segment still unacked) */
+  timeout_timer_ = poller.add_timer( controller_.timeout_ms() * MILLION, [this] () {
+      statistics_.timeouts++;
+      if ( stream_ ) {
+	stream_->timeout();
+      }
       send_datagram( true );
+      return ResultType::Continue;
+    }, controller_.timeout_ms() * MILLION );
+
+  /* fifth rule: advance the controller's estimate on every tick,
+     so the window opens on time even when nothing else wakes us up */
+  poller.add_timer( controller_.tick_ms() * MILLION, [this] () {
+      controller_.tick();
+      return ResultType::Continue;
+    }, controller_.tick_ms() * MILLION );
+}
+
+bool learned_state( const vector< const DatagrumpSender * > & flows,
+		    Controller::LearnedState & state )
+{
+  /* average over the flows that got anywhere (each flow's posterior is
+     over its own share, so a run with as many flows starts right) */
+  vector< Controller::LearnedState > learned;
+  for ( const auto & flow : flows ) {
+    const Controller::LearnedState one = flow->controller().learned_state();
+    if ( flow->statistics().datagrams_acked and one.valid() ) {
+      learned.push_back( one );
+    }
+  }
+
+  if ( learned.empty() ) {
+    return false;
+  }
+
+  state = Controller::LearnedState();
+  state.posterior.resize( learned.front().posterior.size() );
+  double window_size = 0;
+  for ( const auto & one : learned ) {
+    for ( size_t i = 0; i < state.posterior.size(); i++ ) {
+      state.posterior.at( i ) += one.posterior.at( i ) / learned.size();
+    }
+    window_size += double( one.window_size ) / learned.size();
+    state.rtt_ms += one.rtt_ms / learned.size();
+  }
+  state.window_size = window_size + 0.5;
+
+  return true;
+}
+
+constexpr double MultipathScheduler::MIN_RATE;
+
+MultipathScheduler::MultipathScheduler( const uint64_t connection_id )
+  : connection_id_( connection_id ),
+    next_data_sequence_number_( 0 ),
+    data_delivered_( 0 ),
+    paths_()
+{}
+
+double MultipathScheduler::interval_ms( const DatagrumpSender & path )
+{
+  return 1000 / max( path.controller().forecast_rate(), MIN_RATE );
+}
+
+double MultipathScheduler::delivery_ms( const DatagrumpSender & path )
+{
+  return path.controller().rtt_ms() / 2 + (path.in_flight() + 1) * interval_ms( path );
+}
+
+bool MultipathScheduler::should_send( const DatagrumpSender & path )
+{
+  const double mine = delivery_ms( path );
+
+  for ( DatagrumpSender * const other : paths_ ) {
+    if ( other == &path ) {
+      continue;
+    }
+
+    /* a path with its window shut can send about one datagram-time from now */
+    const double theirs = delivery_ms( *other )
+      + ( other->window_is_open() ? 0 : interval_ms( *other ) );
+    if ( theirs < mine ) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+MultipathHeader MultipathScheduler::next_header( const unsigned int path_id )
+{
+  return MultipathHeader( connection_id_, next_data_sequence_number_++, path_id );
+}
+
+void MultipathScheduler::got_ack( const MultipathHeader & ack )
+{
+  if ( ack.connection_id == connection_id_ ) {
+    data_delivered_ = max( data_delivered_, ack.data_sequence_number );
+  }
+}
+
+void report( const vector< unique_ptr< DatagrumpSender > > & flows, const uint64_t duration_ms )
+{
+  if ( duration_ms == 0 ) {
+    return;
+  }
+
+  /* megabits per second over the whole run */
+  auto throughput = [&] ( const uint64_t bytes ) {
+    return bytes * 8.0 / duration_ms / 1000.0;
+  };
+
+  auto mean_rtt = [] ( const DatagrumpSender::Statistics & stats ) {
+    return stats.datagrams_acked ? stats.rtt_ms_total / stats.datagrams_acked : 0.0;
+  };
+
+  DatagrumpSender::Statistics total = DatagrumpSender::Statistics();
+  double sum_throughput = 0, sum_squared_throughput = 0;
+
+  cerr << fixed << setprecision( 2 );
+
+  for ( const auto & flow : flows ) {
+    const auto & stats = flow->statistics();
+    const double flow_throughput = throughput( stats.bytes_acked );
+
+    if ( flows.size() > 1 ) {
+      cerr << "Flow " << flow->flow_id() << " (" << flow->socket().local_address().to_string()
+	   << "): " << flow_throughput << " Mbit/s, mean RTT " << mean_rtt( stats ) << " ms, "
+	   << stats.datagrams_acked << "/" << stats.datagrams_sent << " datagrams acked" << endl;
     }
+
+    total.datagrams_sent += stats.datagrams_sent;
+    total.datagrams_acked += stats.datagrams_acked;
+    total.bytes_acked += stats.bytes_acked;
+    total.rtt_ms_total += stats.rtt_ms_total;
+
+    sum_throughput += flow_throughput;
+    sum_squared_throughput += flow_throughput * flow_throughput;
   }
+
+  cerr << "Total: " << throughput( total.bytes_acked ) << " Mbit/s over " << duration_ms
+       << " ms, mean RTT " << mean_rtt( total ) << " ms, "
+       << total.datagrams_acked << "/" << total.datagrams_sent << " datagrams acked" << endl;
+
+  if ( flows.size() > 1 ) {
+    /* Jain's fairness index: 1 when every flow got the same throughput, 1/N when one got it all */
+    const double fairness = sum_squared_throughput > 0
+      ? sum_throughput * sum_throughput / (flows.size() * sum_squared_throughput)
+      : 1.0;
+    cerr << "Fairness (Jain's index): " << setprecision( 3 ) << fairness << endl;
+  }
+
+  /* how much of one core the flows (and their controllers) used */
+  timespec cpu_time;
+  SystemCall( "clock_gettime", clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &cpu_time ) );
+  const uint64_t cpu_ms = cpu_time.tv_sec * 1000 + cpu_time.tv_nsec / MILLION;
+  cerr << "CPU: " << cpu_ms << " ms (" << setprecision( 1 ) << 100.0 * cpu_ms / duration_ms
+       << "% of one core)" << endl;
+}
+
+SenderMetrics::SenderMetrics( const string & path )
+  : stats_( path, { "datagrams_per_s", "goodput_mbps", "window", "queue_estimate", "forecast",
+	"rtt_p50_ms", "rtt_p95_ms", "rtt_p99_ms", "timeouts", "poller_wakeups", "flows" } ),
+    last_ms_( monotonic_ms() ),
+    last_sent_( 0 ),
+    last_bytes_acked_( 0 )
+{}
+
+void SenderMetrics::publish( const vector< unique_ptr< DatagrumpSender > > & flows,
+			     const Poller & poller )
+{
+  const uint64_t now_ms = monotonic_ms();
+  uint64_t sent = 0, bytes_acked = 0, timeouts = 0;
+  int window = 0, queue_estimate = 0, forecast = 0;
+  Histogram rtt_us;
+
+  for ( const auto & flow : flows ) {
+    const auto & flow_stats = flow->statistics();
+    sent += flow_stats.datagrams_sent;
+    bytes_acked += flow_stats.bytes_acked;
+    timeouts += flow_stats.timeouts;
+
+    window += flow->controller().current_window_size();
+    queue_estimate += flow->controller().queue_size_estimate();
+    forecast += flow->controller().last_forecast();
+
+    rtt_us.merge( flow->interval_rtt_us() );
+    flow->interval_rtt_us().clear();
+  }
+
+  const double seconds = max( uint64_t( 1 ), now_ms - last_ms_ ) / 1000.0;
+
+  stats_.publish( { (sent - last_sent_) / seconds,
+	(bytes_acked - last_bytes_acked_) * 8 / seconds / 1e6,
+	double( window ), double( queue_estimate ), double( forecast ),
+	rtt_us.percentile( 50 ) / 1000.0, rtt_us.percentile( 95 ) / 1000.0,
+	rtt_us.percentile( 99 ) / 1000.0,
+	double( timeouts ), double( poller.wakeup_stats().wakeups ), double( flows.size() ) } );
+
+  last_ms_ = now_ms;
+  last_sent_ = sent;
+  last_bytes_acked_ = bytes_acked;
 }
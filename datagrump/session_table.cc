@@ -0,0 +1,80 @@
+#include <limits>
+
+#include "session_table.hh"
+
+using namespace std;
+
+ReceiverSession::ReceiverSession( const uint64_t now_ns )
+  : next_ack_sequence_number( 0 ),
+    datagrams( 0 ),
+    bytes( 0 ),
+    first_arrival_ns( now_ns ),
+    last_arrival_ns( now_ns ),
+    queueing_delay_ms(),
+    interarrival_us(),
+    throughput_kbps(),
+    min_one_way_delay_ms( numeric_limits< int64_t >::max() ),
+    last_timestamp_ns( 0 ),
+    interval_start_ns( now_ns ),
+    interval_bytes( 0 ),
+    ecn_datagrams(),
+    fec(),
+    stream()
+{}
+
+void ReceiverSession::record_datagram( const size_t size, const uint64_t now_ns,
+				       const uint64_t timestamp_ns, const int64_t one_way_delay_ms )
+{
+  /* close out the throughput intervals that have ended (with any
+     that passed without a datagram all recorded at once, as zeros) */
+  if ( now_ns >= interval_start_ns + THROUGHPUT_INTERVAL_NS ) {
+    const uint64_t intervals = (now_ns - interval_start_ns) / THROUGHPUT_INTERVAL_NS;
+    throughput_kbps.record( interval_bytes * 8 * 1000000 / THROUGHPUT_INTERVAL_NS );
+    throughput_kbps.record( 0, intervals - 1 );
+    interval_start_ns += intervals * THROUGHPUT_INTERVAL_NS;
+    interval_bytes = 0;
+  }
+  interval_bytes += size;
+
+  if ( datagrams > 0 and timestamp_ns >= last_timestamp_ns ) {
+    interarrival_us.record( (timestamp_ns - last_timestamp_ns) / 1000 );
+  }
+  last_timestamp_ns = timestamp_ns;
+
+  min_one_way_delay_ms = min( min_one_way_delay_ms, one_way_delay_ms );
+  queueing_delay_ms.record( one_way_delay_ms - min_one_way_delay_ms );
+
+  datagrams++;
+  bytes += size;
+  last_arrival_ns = now_ns;
+}
+
+SessionTable::SessionTable( const uint64_t idle_timeout_ns )
+  : sessions_(),
+    idle_timeout_ns_( idle_timeout_ns )
+{}
+
+ReceiverSession & SessionTable::record_arrival( const Address & source, const size_t bytes,
+						const uint64_t now_ns, const uint64_t timestamp_ns,
+						const int64_t one_way_delay_ms )
+{
+  auto it = sessions_.find( source );
+  if ( it == sessions_.end() ) {
+    it = sessions_.emplace( source, ReceiverSession( now_ns ) ).first;
+  }
+
+  it->second.record_datagram( bytes, now_ns, timestamp_ns, one_way_delay_ms );
+  return it->second;
+}
+
+void SessionTable::evict_idle( const uint64_t now_ns, const SessionCallback & on_evict )
+{
+  for ( auto it = sessions_.begin(); it != sessions_.end(); ) {
+    if ( now_ns > it->second.last_arrival_ns + idle_timeout_ns_ ) {
+      on_evict( it->first, it->second );
+      it = sessions_.erase( it );
+    } else {
+      ++it;
+    }
+  }
+}
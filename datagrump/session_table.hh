@@ -0,0 +1,81 @@
+#ifndef SESSION_TABLE_HH
+#define SESSION_TABLE_HH
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+#include "address.hh"
+#include "histogram.hh"
+#include "fec.hh"
+#include "stream.hh"
+
+/* what the receiver knows about one sender */
+struct ReceiverSession
+{
+  uint64_t next_ack_sequence_number; /* each sender gets its own ack sequence space */
+
+  /* receive statistics */
+  uint64_t datagrams;
+  uint64_t bytes;
+  uint64_t first_arrival_ns, last_arrival_ns; /* on the monotonic_ns() timeline */
+
+  /* distributions over the session's life (a fixed size, however long it runs) */
+  Histogram queueing_delay_ms; /* one-way delay above the smallest seen so far */
+  Histogram interarrival_us;
+  Histogram throughput_kbps; /* per THROUGHPUT_INTERVAL_NS, counting idle intervals as 0 */
+
+  static const uint64_t THROUGHPUT_INTERVAL_NS = 100000000;
+
+  /* one-way delay includes the offset between the two hosts' clocks, so
+     only its excess over the minimum means anything */
+  int64_t min_one_way_delay_ms;
+  uint64_t last_timestamp_ns; /* kernel receive timestamp of the previous datagram */
+  uint64_t interval_start_ns, interval_bytes;
+
+  uint64_t ecn_datagrams[ 4 ]; /* by ECN codepoint (UDPSocket::ECN) as they arrived */
+
+  FecDecoder fec; /* recovers lost datagrams, if the sender sends FEC */
+  std::unique_ptr< StreamReceiver > stream; /* puts the byte stream back together, if the sender sends one */
+
+  ReceiverSession( const uint64_t now_ns );
+
+  /* account for one datagram (O(1)) */
+  void record_datagram( const size_t size, const uint64_t now_ns,
+			const uint64_t timestamp_ns, const int64_t one_way_delay_ms );
+};
+
+/* sessions keyed by source address (hashed over the raw sockaddr),
+   forgotten after they go quiet */
+class SessionTable
+{
+public:
+  typedef std::unordered_map< Address, ReceiverSession > Sessions;
+  typedef std::function<void(const Address &, const ReceiverSession &)> SessionCallback;
+
+private:
+  Sessions sessions_;
+  uint64_t idle_timeout_ns_;
+
+public:
+  SessionTable( const uint64_t idle_timeout_ns );
+
+  /* account for a datagram from source, starting a session if needed
+     (timestamp_ns is its kernel receive timestamp, and one_way_delay_ms
+     the difference between that and the sender's send timestamp) */
+  ReceiverSession & record_arrival( const Address & source, const size_t bytes,
+				    const uint64_t now_ns, const uint64_t timestamp_ns,
+				    const int64_t one_way_delay_ms );
+
+  /* forget every session idle for longer than the timeout,
+     calling on_evict with each one first */
+  void evict_idle( const uint64_t now_ns, const SessionCallback & on_evict );
+
+  /* accessors */
+  const Sessions & sessions() const { return sessions_; }
+  Sessions & sessions() { return sessions_; }
+  uint64_t idle_timeout_ns() const { return idle_timeout_ns_; }
+};
+
+#endif /* SESSION_TABLE_HH */
@@ -0,0 +1,72 @@
+/* watch the live metrics a sender or receiver publishes with --stats */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "stats_file.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* rows between repeats of the column names */
+static const unsigned int ROWS_PER_HEADER = 20;
+
+void print_header( const StatsFile::Snapshot & snapshot )
+{
+  for ( const auto & name : snapshot.names ) {
+    cout << setw( max( size_t( 10 ), name.size() ) + 1 ) << name;
+  }
+  cout << endl;
+}
+
+void print_values( const StatsFile::Snapshot & snapshot )
+{
+  for ( size_t i = 0; i < snapshot.values.size(); i++ ) {
+    cout << setw( max( size_t( 10 ), snapshot.names[ i ].size() ) + 1 ) << snapshot.values[ i ];
+  }
+  cout << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc != 2 and argc != 3 ) {
+    cerr << "Usage: " << argv[ 0 ] << " STATS_FILE [INTERVAL_MS]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const chrono::milliseconds interval( argc == 3 ? stoul( argv[ 2 ] ) : 1000 );
+
+  try {
+    const StatsFile stats( argv[ 1 ] );
+
+    cout << fixed << setprecision( 2 );
+
+    uint64_t last_sequence = 0;
+    unsigned int rows = 0;
+    while ( true ) {
+      const StatsFile::Snapshot snapshot = stats.read();
+
+      /* print only new snapshots (the first is 2) */
+      if ( snapshot.sequence != last_sequence ) {
+	if ( rows++ % ROWS_PER_HEADER == 0 ) {
+	  print_header( snapshot );
+	}
+	print_values( snapshot );
+	last_sequence = snapshot.sequence;
+      }
+
+      this_thread::sleep_for( interval );
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <endian.h>
+#include <sys/uio.h>
+
+#include "stream.hh"
+
+using namespace std;
+
+/* marks a payload that starts with a stream header (ordinary
+   datagrums' payloads are all 'x') */
+static const char STREAM_MAGIC[ 4 ] = { 'D', 'G', 'B', 'S' };
+
+const size_t StreamSender::SEGMENT_SIZE;
+const size_t StreamReceiver::CAPACITY;
+
+StreamHeader::StreamHeader( const uint64_t s_offset, const uint16_t s_length,
+			    const uint16_t s_flags )
+  : offset( s_offset ),
+    length( s_length ),
+    flags( s_flags ),
+    delivered( 0 ),
+    window( 0 )
+{}
+
+/* Parse header from the start of a payload */
+bool StreamHeader::parse( const string & payload, StreamHeader & header )
+{
+  if ( payload.size() < SIZE
+       or memcmp( payload.data(), STREAM_MAGIC, sizeof( STREAM_MAGIC ) ) ) {
+    return false;
+  }
+
+  uint16_t flags, length;
+  uint64_t offset, delivered;
+  uint32_t window;
+  memcpy( &flags, payload.data() + 4, sizeof( flags ) );
+  memcpy( &length, payload.data() + 6, sizeof( length ) );
+  memcpy( &offset, payload.data() + 8, sizeof( offset ) );
+  memcpy( &delivered, payload.data() + 16, sizeof( delivered ) );
+  memcpy( &window, payload.data() + 24, sizeof( window ) );
+
+  header = StreamHeader( be64toh( offset ), be16toh( length ), be16toh( flags ) );
+  header.delivered = be64toh( delivered );
+  header.window = be32toh( window );
+  return true;
+}
+
+/* Make wire representation of header (all fields in network byte order) */
+string StreamHeader::to_string() const
+{
+  const uint16_t network_flags = htobe16( flags );
+  const uint16_t network_length = htobe16( length );
+  const uint64_t network_offset = htobe64( offset );
+  const uint64_t network_delivered = htobe64( delivered );
+  const uint32_t network_window = htobe32( window );
+
+  string ret( STREAM_MAGIC, sizeof( STREAM_MAGIC ) );
+  ret.append( reinterpret_cast<const char *>( &network_flags ), sizeof( network_flags ) );
+  ret.append( reinterpret_cast<const char *>( &network_length ), sizeof( network_length ) );
+  ret.append( reinterpret_cast<const char *>( &network_offset ), sizeof( network_offset ) );
+  ret.append( reinterpret_cast<const char *>( &network_delivered ), sizeof( network_delivered ) );
+  ret.append( reinterpret_cast<const char *>( &network_window ), sizeof( network_window ) );
+  return ret;
+}
+
+StreamSender::StreamSender()
+  : mapped_( nullptr ),
+    ring_(),
+    end_( 0 ),
+    closed_( false ),
+    full_( false ),
+    next_offset_( 0 ),
+    fin_sent_( false ),
+    fin_acked_( false ),
+    acked_( 0 ),
+    send_limit_( StreamReceiver::CAPACITY ), /* (until it says otherwise, the receiver's ring is empty) */
+    outstanding_(),
+    in_flight_(),
+    lost_(),
+    statistics_(),
+    drain_handler_()
+{}
+
+StreamSender::StreamSender( const char * const data, const size_t length )
+  : StreamSender()
+{
+  mapped_ = data;
+  end_ = length;
+  closed_ = true;
+}
+
+void StreamSender::write( const string & data )
+{
+  if ( mapped_ or closed_ ) {
+    throw runtime_error( "write to a closed stream" );
+  }
+
+  if ( data.size() > writable() ) {
+    throw runtime_error( "write past the end of the stream's buffer" );
+  }
+
+  if ( ring_.empty() ) {
+    ring_.resize( MAX_BUFFERED );
+  }
+
+  const size_t position = end_ % MAX_BUFFERED;
+  const size_t first = min( data.size(), MAX_BUFFERED - position );
+  memcpy( ring_.data() + position, data.data(), first );
+  memcpy( ring_.data(), data.data() + first, data.size() - first );
+  end_ += data.size();
+  full_ = writable() == 0;
+}
+
+size_t StreamSender::writable() const
+{
+  if ( mapped_ or closed_ ) {
+    return 0;
+  }
+
+  const uint64_t buffered = end_ - acked_;
+  return buffered < MAX_BUFFERED ? MAX_BUFFERED - buffered : 0;
+}
+
+bool StreamSender::has_segment() const
+{
+  return not lost_.empty()
+    or next_offset_ < min( end_, send_limit_ )
+    or ( closed_ and not fin_sent_ and next_offset_ == end_ ); /* (a FIN of its own, after all the data) */
+}
+
+string StreamSender::Payload::copy_data() const
+{
+  string ret;
+  for ( const auto & piece : data ) {
+    ret.append( static_cast<const char *>( piece.iov_base ), piece.iov_len );
+  }
+  return ret;
+}
+
+StreamSender::Payload StreamSender::send_segment( const uint64_t offset, const uint16_t length,
+						  const bool fin, const uint64_t sequence_number )
+{
+  outstanding_[ offset ] = Segment { length, fin, sequence_number };
+  in_flight_[ sequence_number ] = offset;
+  statistics_.segments_sent++;
+
+  Payload payload( StreamHeader( offset, length, fin ? StreamHeader::FIN : 0 ).to_string() );
+  if ( mapped_ ) {
+    payload.data[ 0 ] = { const_cast<char *>( mapped_ ) + offset, length };
+  } else {
+    const size_t position = offset % MAX_BUFFERED;
+    const size_t first = min( size_t( length ), MAX_BUFFERED - position );
+    payload.data[ 0 ] = { ring_.data() + position, first };
+    payload.data[ 1 ] = { ring_.data(), length - first };
+  }
+  return payload;
+}
+
+StreamSender::Payload StreamSender::next_segment( const uint64_t sequence_number )
+{
+  /* first, anything the receiver is missing (oldest first) */
+  if ( not lost_.empty() ) {
+    const uint64_t offset = *lost_.begin();
+    lost_.erase( lost_.begin() );
+    const Segment segment = outstanding_.at( offset );
+    statistics_.retransmissions++;
+    statistics_.bytes_retransmitted += segment.length;
+    return send_segment( offset, segment.length, segment.fin, sequence_number );
+  }
+
+  /* then new data, as far as the receiver has room for */
+  const uint64_t limit = min( end_, send_limit_ );
+  if ( next_offset_ < limit or ( closed_ and not fin_sent_ and next_offset_ == end_ ) ) {
+    const uint64_t offset = next_offset_;
+    const uint16_t length = min( uint64_t( SEGMENT_SIZE ), limit - offset );
+    const bool fin = closed_ and offset + length == end_;
+
+    next_offset_ += length;
+    fin_sent_ = fin_sent_ or fin;
+    return send_segment( offset, length, fin, sequence_number );
+  }
+
+  /* otherwise just ask for an ack (e.g. to hear when the receiver has room again) */
+  statistics_.probes++;
+  return Payload( StreamHeader( next_offset_ ).to_string() );
+}
+
+void StreamSender::forget( const map< uint64_t, Segment >::iterator & segment )
+{
+  const auto in_flight = in_flight_.find( segment->second.sequence_number );
+  if ( in_flight != in_flight_.end() and in_flight->second == segment->first ) {
+    in_flight_.erase( in_flight );
+  }
+  lost_.erase( segment->first );
+  outstanding_.erase( segment );
+}
+
+void StreamSender::got_ack( const uint64_t sequence_number, const StreamHeader & ack )
+{
+  /* flow control: the receiver's room only grows (as its reader catches up),
+     so an ack that arrives late can't shrink it */
+  send_limit_ = max( send_limit_, ack.delivered + ack.window );
+  fin_acked_ = fin_acked_ or ( ack.flags & StreamHeader::FIN );
+
+  /* everything before delivered has arrived: let it go */
+  const uint64_t delivered = min( ack.delivered, end_ );
+  if ( delivered > acked_ ) {
+    acked_ = delivered;
+
+    /* (a writer that backed off can come back for a good share at once) */
+    if ( full_ and writable() >= MAX_BUFFERED / 2 ) {
+      full_ = false;
+      if ( drain_handler_ ) {
+	drain_handler_();
+      }
+    }
+  }
+
+  while ( not outstanding_.empty() ) {
+    const auto oldest = outstanding_.begin();
+    if ( oldest->first + oldest->second.length > acked_
+	 or ( oldest->second.fin and not fin_acked_ ) ) {
+      break;
+    }
+    forget( oldest );
+  }
+
+  /* the acked segment has arrived (unless the receiver had no room for it) */
+  const auto segment = outstanding_.find( ack.offset );
+  if ( segment != outstanding_.end() and segment->second.length == ack.length
+       and ( not segment->second.fin or fin_acked_ ) ) {
+    forget( segment );
+  }
+
+  /* datagrams arrive in order unless something went wrong, so a segment
+     sent well before the acked datagram, and still unacked, is lost */
+  while ( not in_flight_.empty()
+	  and in_flight_.begin()->first + REORDER_THRESHOLD < sequence_number ) {
+    lost_.insert( in_flight_.begin()->second );
+    in_flight_.erase( in_flight_.begin() );
+  }
+}
+
+void StreamSender::timeout()
+{
+  if ( not in_flight_.empty() ) {
+    lost_.insert( in_flight_.begin()->second );
+    in_flight_.erase( in_flight_.begin() );
+  }
+}
+
+StreamReceiver::StreamReceiver()
+  : ring_( CAPACITY ),
+    read_offset_( 0 ),
+    delivered_( 0 ),
+    out_of_order_(),
+    fin_received_( false ),
+    end_( 0 ),
+    statistics_()
+{}
+
+void StreamReceiver::place( const uint64_t offset, const char * const data, const size_t length )
+{
+  const size_t position = offset % CAPACITY;
+  const size_t first = min( length, CAPACITY - position );
+  memcpy( ring_.data() + position, data, first );
+  memcpy( ring_.data(), data + first, length - first );
+}
+
+StreamHeader StreamReceiver::receive( const StreamHeader & segment, const char * const data )
+{
+  const uint64_t end = segment.offset + segment.length;
+  StreamHeader ack( segment.offset );
+
+  if ( end > read_offset_ + CAPACITY ) {
+    /* past the window we offered (so the sender will send it again) */
+    statistics_.dropped_segments++;
+  } else {
+    ack.length = segment.length;
+    statistics_.segments++;
+    statistics_.bytes += segment.length;
+
+    if ( segment.flags & StreamHeader::FIN ) {
+      fin_received_ = true;
+      end_ = end;
+    }
+
+    if ( end <= delivered_ ) {
+      statistics_.duplicate_bytes += segment.length;
+    } else {
+      /* keep what's new, and note that it's here */
+      uint64_t start = max( segment.offset, delivered_ ), stop = end;
+      place( start, data + (start - segment.offset), stop - start );
+
+      auto next = out_of_order_.upper_bound( start );
+      if ( next != out_of_order_.begin() and prev( next )->second >= start ) {
+	start = prev( next )->first;
+	stop = max( stop, prev( next )->second );
+	out_of_order_.erase( prev( next ) );
+      }
+      while ( next != out_of_order_.end() and next->first <= stop ) {
+	stop = max( stop, next->second );
+	next = out_of_order_.erase( next );
+      }
+
+      /* (if it filled the gap, everything up to the next one is in order) */
+      if ( start == delivered_ ) {
+	delivered_ = stop;
+      } else {
+	out_of_order_.emplace( start, stop );
+      }
+    }
+  }
+
+  ack.flags = fin_received_ ? StreamHeader::FIN : 0;
+  ack.delivered = delivered_;
+  ack.window = read_offset_ + CAPACITY - delivered_;
+  return ack;
+}
+
+string StreamReceiver::read( const size_t limit )
+{
+  const size_t length = min( limit, readable() );
+  const size_t position = read_offset_ % CAPACITY;
+  const size_t first = min( length, CAPACITY - position );
+
+  string ret( ring_.data() + position, first );
+  ret.append( ring_.data(), length - first );
+  read_offset_ += length;
+  return ret;
+}
+
+size_t StreamReceiver::write_to( FileDescriptor & fd )
+{
+  const size_t length = readable();
+  if ( length == 0 ) {
+    return 0;
+  }
+
+  const size_t position = read_offset_ % CAPACITY;
+  const size_t first = min( length, CAPACITY - position );
+  iovec pieces[ 2 ] = { { ring_.data() + position, first },
+			{ ring_.data(), length - first } };
+
+  const size_t written = fd.write( pieces, length > first ? 2 : 1 );
+  read_offset_ += written;
+  return written;
+}
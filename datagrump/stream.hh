@@ -0,0 +1,225 @@
+#ifndef STREAM_HH
+#define STREAM_HH
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "file_descriptor.hh"
+
+/* In stream mode, datagrams carry a reliable, ordered byte stream
+   instead of dummy payloads. Every datagram's payload starts with this
+   header, saying where its data goes in the stream. The receiver acks
+   each datagram as usual, echoing the header with how much of the stream
+   it has in order and how much more it has room for, so every ack is
+   also a selective acknowledgment of one segment. */
+struct StreamHeader
+{
+  static const size_t SIZE = 28; /* on the wire */
+
+  /* flags */
+  static const uint16_t FIN = 1; /* datagrams: the stream ends after this segment;
+				    acks: the receiver knows where the stream ends */
+
+  /* datagrams: where the data goes in the stream;
+     acks: the offset of the segment being acked */
+  uint64_t offset;
+
+  uint16_t length; /* bytes of data (acks: that the receiver kept) */
+  uint16_t flags;
+
+  /* acks only: every byte before this has arrived, and the receiver
+     has room for window more after it */
+  uint64_t delivered;
+  uint32_t window;
+
+  StreamHeader( const uint64_t s_offset = 0, const uint16_t s_length = 0,
+		const uint16_t s_flags = 0 );
+
+  /* parse from the start of a payload
+     (returns false if the payload doesn't start with one) */
+  static bool parse( const std::string & payload, StreamHeader & header );
+
+  /* Make wire representation of header */
+  std::string to_string() const;
+};
+
+/* the sending half: holds what's been written until the receiver has it,
+   and decides what each datagram carries (retransmissions first) */
+class StreamSender
+{
+public:
+  typedef std::function<void(void)> DrainHandler;
+
+  /* data per datagram (so a segment is as big as a dummy payload) */
+  static const size_t SEGMENT_SIZE = 1424 - StreamHeader::SIZE;
+
+  /* write() takes at most this much more than the receiver has acked */
+  static const size_t MAX_BUFFERED = 8 * 1024 * 1024;
+
+  /* a segment is taken to be lost once an ack arrives for a datagram sent this much later */
+  static const uint64_t REORDER_THRESHOLD = 3;
+
+  struct Statistics
+  {
+    uint64_t segments_sent;
+    uint64_t retransmissions, bytes_retransmitted;
+    uint64_t probes; /* header-only datagrams (nothing to send, or no room at the receiver) */
+  };
+
+  /* a datagram's payload: the segment's header, and its data where it
+     already is (in the mapped file, or in the ring, in two pieces if it
+     wraps around), valid until the next call that changes the stream */
+  struct Payload
+  {
+    std::string header;
+    iovec data[ 2 ];
+
+    Payload( const std::string & s_header = std::string() ) : header( s_header ), data() {}
+
+    /* the data, copied into one string (e.g. for a capture) */
+    std::string copy_data() const;
+  };
+
+private:
+  struct Segment
+  {
+    uint16_t length;
+    bool fin;
+    uint64_t sequence_number; /* of the datagram it was last sent in */
+  };
+
+  /* the stream's bytes, from a mapped file or written into a ring
+     (stream offset n at ring_[ n % MAX_BUFFERED ], from acked_ on) */
+  const char * mapped_;
+  std::vector< char > ring_;
+
+  uint64_t end_; /* bytes in the stream so far */
+  bool closed_; /* nothing more will be written */
+  bool full_; /* write() filled the ring, and acks haven't yet freed half of it */
+  uint64_t next_offset_; /* first byte not yet sent */
+  bool fin_sent_, fin_acked_;
+
+  /* what the receiver has told us */
+  uint64_t acked_; /* every byte before this has arrived */
+  uint64_t send_limit_; /* it has room for everything before this */
+
+  std::map< uint64_t, Segment > outstanding_; /* sent and not acked, by offset */
+  std::map< uint64_t, uint64_t > in_flight_; /* outstanding and not lost: offset, by datagram sequence number */
+  std::set< uint64_t > lost_; /* outstanding and due for retransmission, by offset */
+
+  Statistics statistics_;
+  DrainHandler drain_handler_;
+
+  /* the receiver has a segment (or no longer needs it) */
+  void forget( const std::map< uint64_t, Segment >::iterator & segment );
+
+  /* header and data for a segment, recording which datagram it went in */
+  Payload send_segment( const uint64_t offset, const uint16_t length, const bool fin,
+			const uint64_t sequence_number );
+
+public:
+  /* a stream written with write() */
+  StreamSender();
+
+  /* a stream of length bytes at data, which must outlive the sender
+     (e.g. a MappedFile); segments are sent straight from there */
+  StreamSender( const char * const data, const size_t length );
+
+  /* append to the stream */
+  void write( const std::string & data );
+
+  /* how much write() can take now (flow control: the receiver hasn't acked the rest) */
+  size_t writable() const;
+
+  /* called when write() had filled the stream, and acks have freed half of it */
+  void set_drain_handler( const DrainHandler & handler ) { drain_handler_ = handler; }
+
+  /* end the stream */
+  void close() { closed_ = true; }
+
+  /* whether there's a segment to send: something lost, or new data the receiver has room for */
+  bool has_segment() const;
+
+  /* payload for datagram sequence_number: the next segment due, or
+     (if nothing is) a header-only probe for a fresh ack */
+  Payload next_segment( const uint64_t sequence_number );
+
+  /* an ack of datagram sequence_number arrived */
+  void got_ack( const uint64_t sequence_number, const StreamHeader & ack );
+
+  /* no acks for a while: retransmit the oldest segment in flight */
+  void timeout();
+
+  /* the stream has ended, and the receiver has all of it */
+  bool complete() const { return closed_ and fin_acked_ and acked_ == end_; }
+
+  /* accessors */
+  uint64_t bytes_written() const { return end_; }
+  uint64_t bytes_acked() const { return acked_; }
+  const Statistics & statistics() const { return statistics_; }
+
+  /* forbid copying (a copy would share a mapped stream's memory) */
+  StreamSender( const StreamSender & other ) = delete;
+  StreamSender & operator=( const StreamSender & other ) = delete;
+};
+
+/* the receiving half: puts segments back in order in a ring buffer,
+   and hands out the bytes that are ready */
+class StreamReceiver
+{
+public:
+  /* bytes held for the reader (in order or not); the sender is told how much is free */
+  static const size_t CAPACITY = StreamSender::MAX_BUFFERED;
+
+  struct Statistics
+  {
+    uint64_t segments, bytes; /* received and kept */
+    uint64_t duplicate_bytes; /* received again (retransmitted needlessly) */
+    uint64_t dropped_segments; /* no room for them */
+  };
+
+private:
+  std::vector< char > ring_; /* stream offset n is at ring_[ n % CAPACITY ] */
+  uint64_t read_offset_; /* first byte not yet read */
+  uint64_t delivered_; /* every byte before this has arrived */
+  std::map< uint64_t, uint64_t > out_of_order_; /* arrived past a gap: end, by start */
+  bool fin_received_;
+  uint64_t end_; /* length of the stream, once the FIN is in */
+
+  Statistics statistics_;
+
+  /* copy length bytes of the stream, from offset on, into the ring */
+  void place( const uint64_t offset, const char * const data, const size_t length );
+
+public:
+  StreamReceiver();
+
+  /* take a segment (data is the header's length bytes after it),
+     returning the header to echo in its ack */
+  StreamHeader receive( const StreamHeader & segment, const char * const data );
+
+  /* bytes ready to read, in order */
+  size_t readable() const { return delivered_ - read_offset_; }
+
+  /* read up to limit bytes of the stream */
+  std::string read( const size_t limit );
+
+  /* write what's ready to fd (with one writev(), straight from the ring),
+     returning how much was written (0 if a non-blocking fd had no room) */
+  size_t write_to( FileDescriptor & fd );
+
+  /* the whole stream has arrived and been read */
+  bool finished() const { return fin_received_ and read_offset_ == end_; }
+
+  /* accessors */
+  uint64_t bytes_read() const { return read_offset_; }
+  const Statistics & statistics() const { return statistics_; }
+};
+
+#endif /* STREAM_HH */
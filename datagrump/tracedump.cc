@@ -0,0 +1,107 @@
+/* print a binary controller trace (from sender --trace) as text */
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include <fcntl.h>
+
+#include "controller.hh"
+#include "file_descriptor.hh"
+#include "read_buffer.hh"
+#include "tracer.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* print one record in the words of the old debug output */
+void print_record( const TraceRecord & record )
+{
+  cout << setw( 14 ) << record.timestamp_ns / 1000 << " us: flow " << record.source << ": ";
+
+  switch ( record.event ) {
+  case TRACE_WINDOW:
+    cout << "window size is " << record.window;
+    break;
+  case TRACE_SENT:
+    cout << "at time " << record.time_ms[ 0 ] << " sent datagram " << record.sequence_number
+	 << " (timeout = " << record.value << ")";
+    break;
+  case TRACE_ACK:
+    cout << "received ack for datagram " << record.sequence_number
+	 << " (send @ time " << record.time_ms[ 0 ]
+	 << ", received @ time " << record.time_ms[ 1 ] << " by receiver's clock"
+	 << ", rtt " << record.value << " ms)";
+    break;
+  case TRACE_CE:
+    cout << "ack for datagram " << record.sequence_number << " reported "
+	 << record.value << " more datagrams marked CE";
+    break;
+  case TRACE_RECOVERED:
+    cout << "datagram " << record.sequence_number << " was lost, but the receiver recovered it";
+    break;
+  default:
+    cout << "unknown event " << record.event;
+    break;
+  }
+
+  cout << " [window " << record.window << ", queue estimate " << record.estimate << "]\n";
+}
+
+int main( int argc, char *argv[] )
+{
+  /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc != 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " TRACE_FILE" << endl;
+    return EXIT_FAILURE;
+  }
+
+  FileDescriptor file( SystemCall( "open", open( argv[ 1 ], O_RDONLY | O_CLOEXEC ) ) );
+  ReadBuffer buffer( 1 << 20 );
+
+  /* read until there's at least length bytes (or the file ends) */
+  auto fill = [&] ( const size_t length ) {
+    while ( buffer.size() < length and not file.eof() ) {
+      file.read( buffer, buffer.capacity() );
+    }
+    return buffer.size() >= length;
+  };
+
+  TraceFileHeader header;
+  if ( not fill( sizeof( header ) ) ) {
+    cerr << argv[ 1 ] << ": too short to be a trace" << endl;
+    return EXIT_FAILURE;
+  }
+  memcpy( &header, buffer.data(), sizeof( header ) );
+  buffer.consume( sizeof( header ) );
+
+  if ( memcmp( header.magic, TRACE_MAGIC, sizeof( TRACE_MAGIC ) )
+       or header.record_size != sizeof( TraceRecord ) ) {
+    cerr << argv[ 1 ] << ": not a trace (or from an incompatible version)" << endl;
+    return EXIT_FAILURE;
+  }
+
+  uint64_t count = 0;
+  while ( fill( sizeof( TraceRecord ) ) ) {
+    /* (records from each thread are in order; threads' records interleave in chunks) */
+    TraceRecord record;
+    memcpy( &record, buffer.data(), sizeof( record ) );
+    buffer.consume( sizeof( record ) );
+    print_record( record );
+    count++;
+  }
+
+  if ( not buffer.empty() ) {
+    cerr << "Warning: trace ends with a partial record" << endl;
+  }
+
+  cout << flush;
+  cerr << count << " records" << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "warm_start.hh"
+#include "file_descriptor.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+using namespace std;
+
+static const char WARM_START_MAGIC[ 8 ] = { 'D', 'G', 'W', 'A', 'R', 'M', '0', '1' };
+
+/* The file is a header, then one record per destination, all in host byte order:
+
+     header: magic (8 bytes), entry count (uint32), rates per posterior (uint32)
+     record: saved time in ms since the epoch (uint64), window (int32),
+             rtt in ms (float), destination length (uint16), destination,
+	     posterior (one float per rate) */
+
+/* append a value's bytes */
+template <typename T>
+static void put( string & out, const T & value )
+{
+  out.append( reinterpret_cast< const char * >( &value ), sizeof( value ) );
+}
+
+/* take a value's bytes from the front of in */
+template <typename T>
+static T get( const string & in, size_t & offset )
+{
+  if ( in.size() - offset < sizeof( T ) ) {
+    throw runtime_error( "truncated warm-start file" );
+  }
+
+  T value;
+  memcpy( &value, in.data() + offset, sizeof( value ) );
+  offset += sizeof( value );
+  return value;
+}
+
+WarmStartFile::WarmStartFile( const string & path )
+  : path_( path ), entries_()
+{
+  const int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 and errno == ENOENT ) {
+    return; /* nothing learned yet */
+  }
+  FileDescriptor file( SystemCall( "open " + path, fd ) );
+
+  string contents;
+  while ( not file.eof() ) {
+    contents += file.read();
+  }
+
+  try {
+    parse( contents );
+  } catch ( const exception & e ) {
+    throw runtime_error( path + ": " + e.what() );
+  }
+}
+
+void WarmStartFile::parse( const string & contents )
+{
+  if ( contents.size() < sizeof( WARM_START_MAGIC )
+       or memcmp( contents.data(), WARM_START_MAGIC, sizeof( WARM_START_MAGIC ) ) ) {
+    throw runtime_error( "not a warm-start file" );
+  }
+
+  size_t offset = sizeof( WARM_START_MAGIC );
+  const uint32_t entry_count = get< uint32_t >( contents, offset );
+  const uint32_t rates = get< uint32_t >( contents, offset );
+
+  for ( uint32_t i = 0; i < entry_count; i++ ) {
+    Entry entry;
+    entry.saved_ms = get< uint64_t >( contents, offset );
+    entry.state.window_size = get< int32_t >( contents, offset );
+    entry.state.rtt_ms = get< float >( contents, offset );
+
+    const uint16_t length = get< uint16_t >( contents, offset );
+    if ( contents.size() - offset < length ) {
+      throw runtime_error( "truncated warm-start file" );
+    }
+    const string destination = contents.substr( offset, length );
+    offset += length;
+
+    for ( uint32_t j = 0; j < rates; j++ ) {
+      entry.state.posterior.push_back( get< float >( contents, offset ) );
+    }
+
+    entries_[ destination ] = entry;
+  }
+}
+
+bool WarmStartFile::lookup( const string & destination, Controller::LearnedState & state ) const
+{
+  const auto entry = entries_.find( destination );
+  if ( entry == entries_.end()
+       or timestamp_epoch_ns() / 1000000 - entry->second.saved_ms > MAX_AGE_MS ) {
+    return false;
+  }
+
+  state = entry->second.state;
+  return true;
+}
+
+void WarmStartFile::store( const string & destination, const Controller::LearnedState & state )
+{
+  if ( destination.size() > UINT16_MAX ) {
+    throw runtime_error( "destination too long for a warm-start file" );
+  }
+
+  entries_[ destination ] = Entry( timestamp_epoch_ns() / 1000000, state );
+}
+
+void WarmStartFile::save() const
+{
+  const uint64_t now_ms = timestamp_epoch_ns() / 1000000;
+
+  /* every entry has the same number of rates (or isn't written) */
+  uint32_t rates = 0;
+  for ( const auto & entry : entries_ ) {
+    rates = max< uint32_t >( rates, entry.second.state.posterior.size() );
+  }
+
+  string records;
+  uint32_t entry_count = 0;
+  for ( const auto & entry : entries_ ) {
+    const Controller::LearnedState & state = entry.second.state;
+    if ( now_ms - entry.second.saved_ms > MAX_AGE_MS or state.posterior.size() != rates ) {
+      continue;
+    }
+
+    put< uint64_t >( records, entry.second.saved_ms );
+    put< int32_t >( records, state.window_size );
+    put< float >( records, state.rtt_ms );
+    put< uint16_t >( records, entry.first.size() );
+    records += entry.first;
+    for ( const double p : state.posterior ) {
+      put< float >( records, p );
+    }
+    entry_count++;
+  }
+
+  string contents( WARM_START_MAGIC, sizeof( WARM_START_MAGIC ) );
+  put< uint32_t >( contents, entry_count );
+  put< uint32_t >( contents, rates );
+  contents += records;
+
+  /* write a new file and move it into place */
+  const string temporary_path = path_ + ".tmp";
+  {
+    FileDescriptor file( SystemCall( "open " + temporary_path,
+				     open( temporary_path.c_str(),
+					   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) );
+    file.write( contents );
+  }
+  SystemCall( "rename " + temporary_path, rename( temporary_path.c_str(), path_.c_str() ) );
+}
@@ -0,0 +1,50 @@
+#ifndef WARM_START_HH
+#define WARM_START_HH
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "controller.hh"
+
+/* What earlier flows learned about each destination, kept in a small
+   binary file between runs so a new flow can start near the right rate
+   instead of from a uniform posterior. Entries are keyed by destination
+   and dropped once they are MAX_AGE_MS old. */
+class WarmStartFile
+{
+public:
+  static const uint64_t MAX_AGE_MS = 60 * 60 * 1000; /* one hour */
+
+private:
+  struct Entry
+  {
+    uint64_t saved_ms; /* wall clock (ms since the epoch) */
+    Controller::LearnedState state;
+
+    Entry( const uint64_t s_saved_ms = 0,
+	   const Controller::LearnedState & s_state = Controller::LearnedState() )
+      : saved_ms( s_saved_ms ), state( s_state ) {}
+  };
+
+  std::string path_;
+  std::map< std::string, Entry > entries_;
+
+  /* parse the file's contents (throws if they aren't a warm-start file) */
+  void parse( const std::string & contents );
+
+public:
+  /* read the file at path, if there is one (it's fine if there isn't) */
+  WarmStartFile( const std::string & path );
+
+  /* what was learned about destination, if it's recent enough */
+  bool lookup( const std::string & destination, Controller::LearnedState & state ) const;
+
+  /* remember what was learned about destination (written out by save()) */
+  void store( const std::string & destination, const Controller::LearnedState & state );
+
+  /* replace the file with every recent entry (a reader never sees it half-written) */
+  void save() const;
+};
+
+#endif /* WARM_START_HH */
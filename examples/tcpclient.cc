@@ -1,9 +1,13 @@
 #include <iostream>
 #include <thread>
 
+#include <getopt.h>
+
 #include "socket.hh"
 #include "util.hh"
 #include "poller.hh"
+#include "buffered_writer.hh"
+#include "io_uring.hh"
 
 using namespace std;
 using namespace PollerShortNames;
@@ -15,28 +19,108 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  if ( argc != 3 ) {
-    cerr << "Usage: " << argv[ 0 ] << " HOST PORT" << endl;
+  bool use_io_uring = false;
+
+  const option command_line_options[] = {
+    { "io-uring", no_argument, nullptr, 'u' },
+    { nullptr,    0,           nullptr, 0 }
+  };
+
+  while ( true ) {
+    const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+    if ( opt == -1 ) {
+      break;
+    }
+
+    switch ( opt ) {
+    case 'u':
+      use_io_uring = true;
+      break;
+    default:
+      cerr << "Usage: " << argv[ 0 ] << " [--io-uring] HOST PORT" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( optind != argc - 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " [--io-uring] HOST PORT" << endl;
     return EXIT_FAILURE;
   }
 
-  string host { argv[ 1 ] }, port { argv[ 2 ] };
+  string host { argv[ optind ] }, port { argv[ optind + 1 ] };
+
+  /* optionally talk to the server through io_uring (if this kernel can) */
+  if ( use_io_uring and not IOUring::available() ) {
+    cerr << "Warning: io_uring unavailable, falling back to poll" << endl;
+    use_io_uring = false;
+  }
 
   /* Look up the server's address */
   cerr << "Looking up " << host << ":" << port << endl;
   Address server( host, port );
   cerr << "Done. Found " << server.to_string() << endl;
 
-  /* create a TCP socket */
-  TCPSocket socket;
+  /* create a TCP socket (that never makes us wait) */
+  TCPSocket socket( Socket::NonBlocking );
 
-  /* connect to the server */
+  /* read and write from the server using an event-driven "poller"
+     (a slow server just queues up our writes) */
+  Poller poller;
+
+  /* connect to the server (the poller tells us when it's done) */
   cerr << "Connecting...";
-  socket.connect( server );
-  cerr << "done." << endl;
+  bool connected = false;
+  socket.connect( server, poller, [&] ( const int error ) {
+      if ( error ) {
+	throw unix_error( "connect", error );
+      }
+      cerr << "done." << endl;
+      connected = true;
+    } );
 
-  /* now read and write from the server using an event-driven "poller" */
-  Poller poller;
+  while ( not connected ) {
+    poller.poll( -1 );
+  }
+
+  FileDescriptor keyboard( 0 );
+
+  if ( use_io_uring ) {
+    /* the ring does the socket's reads and writes (it waits for the
+       socket itself, so the socket can block again), and the poller
+       just reaps its completions */
+    socket.set_blocking( true );
+    IOUring & ring = IOUring::process_ring();
+    ring.add_to( poller );
+
+    /* first rule: print what arrives from the server, until it closes the connection */
+    bool server_closed = false;
+    ring.recv_stream( socket, [&] ( const string & data ) {
+	if ( data.empty() ) {
+	  server_closed = true;
+	}
+	cout << data << flush;
+      } );
+
+    /* second rule: send what's typed to the server, plus a carriage return and newline */
+    poller.add_action( Action( keyboard, Direction::In,
+			       [&] () {
+				 ring.send( socket, keyboard.read() + "\r\n" );
+				 ring.submit();
+				 return ResultType::Continue;
+			       } ) );
+
+    while ( not server_closed ) {
+      const auto ret = poller.poll( -1 );
+      if ( ret.result == PollResult::Exit ) {
+	return ret.exit_status;
+      }
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  BufferedWriter to_server( socket );
+  to_server.add_to( poller );
 
   /* first rule: if the socket has data ready (in the "In" direction),
      print it to the screen (cout) */
@@ -54,10 +138,9 @@ int main( int argc, char *argv[] )
 
   /* second rule: if the keyboard has data ready (also in the "In" direction),
      write it to the server, plus a carriage return and newline */
-  FileDescriptor keyboard( 0 );
   poller.add_action( Action( keyboard, Direction::In,
 			     [&] () {
-			       socket.write( keyboard.read() + "\r\n" );
+			       to_server.write( keyboard.read() + "\r\n" );
 			       return ResultType::Continue;
 			     } ) );
 
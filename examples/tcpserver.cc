@@ -1,13 +1,117 @@
 /* simple TCP listener/server to demonstrate sourdough starter classes */
 /* Keith Winstein <keithw@cs.stanford.edu>, January 2015 */
 
-#include <thread>
+/* One event loop ("reactor") per core, each with its own listening
+   socket on the same port (SO_REUSEPORT spreads new connections across
+   them) and its own epoll Poller over non-blocking connections.
+
+   With --file, serves that file to every client instead, with sendfile()
+   (so its contents never pass through userspace). */
+
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "socket.hh"
+#include "poller.hh"
+#include "signalfd.hh"
+#include "eventfd.hh"
+#include "buffered_writer.hh"
 #include "util.hh"
 
 using namespace std;
+using namespace PollerShortNames;
+
+/* how long to stop accepting after running out of file descriptors
+   (if no connection closes sooner) */
+static const uint64_t ACCEPT_RETRY_NS = 100 * 1000 * 1000;
+static const uint64_t ACCEPT_RETRY_IDLE_NS = 3600 * ACCEPT_RETRY_NS; /* (when not needed) */
+
+/* one event loop and the connections it serves */
+class Reactor
+{
+private:
+  struct Connection
+  {
+    TCPSocket socket;
+    BufferedWriter writer; /* replies, sent when the socket has room */
+    off_t file_offset; /* how much of the file has been sent (file-server mode) */
+
+    Connection( TCPSocket && s_socket )
+      : socket( move( s_socket ) ), writer( socket ), file_offset( 0 ) {}
+  };
+
+  struct Statistics
+  {
+    uint64_t accepted, closed, accept_failures;
+    uint64_t bytes_received, bytes_sent;
+    size_t peak_open;
+  };
+
+  unsigned int id_;
+  TCPSocket listener_;
+  EventFD stop_event_;
+  Poller poller_;
+  unordered_map< int, unique_ptr< Connection > > connections_; /* by fd number */
+  ReadBuffer read_buffer_; /* shared by every connection, since each read is handled at once */
+
+  /* file-server mode: the file every client gets (shared, since
+     sendfile() takes an explicit offset) */
+  unique_ptr< FileDescriptor > file_;
+  off_t file_size_;
+  Statistics statistics_;
+
+  /* whether the listener is being watched (it isn't while we're out of fds),
+     and the timer that tries again if no connection closes first */
+  bool accepting_;
+  Poller::TimerID accept_retry_timer_;
+
+  void watch_listener();
+  bool accept_connections();
+  void add_connection( TCPSocket && client );
+  void watch_reads( Connection & connection );
+  void send_file( Connection & connection );
+  bool serve( Connection & connection );
+  void close_connection( Connection & connection );
+
+public:
+  Reactor( const unsigned int id, const string & port, const string & file_path );
+
+  const TCPSocket & listener() const { return listener_; }
+
+  /* serve connections until stop() is called */
+  void loop();
+
+  /* ask loop() to return (safe from any thread) */
+  void stop() { stop_event_.signal(); }
+
+  void report() const;
+};
+
+/* allow as many open connections as the hard limit does */
+void raise_fd_limit()
+{
+  rlimit limit;
+  SystemCall( "getrlimit", getrlimit( RLIMIT_NOFILE, &limit ) );
+  limit.rlim_cur = limit.rlim_max;
+  SystemCall( "setrlimit", setrlimit( RLIMIT_NOFILE, &limit ) );
+}
+
+void usage( const char * const argv0 )
+{
+  cerr << "Usage: " << argv0 << " [--threads=N] [--pin] [--file=PATH] PORT" << endl;
+}
 
 int main( int argc, char *argv[] )
 {
@@ -16,54 +120,317 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[ 0 ] << " PORT" << endl;
+  unsigned int threads = max( 1u, thread::hardware_concurrency() );
+  bool pin = false;
+  string file_path;
+
+  const option command_line_options[] = {
+    { "threads", required_argument, nullptr, 't' },
+    { "pin",     no_argument,       nullptr, 'p' },
+    { "file",    required_argument, nullptr, 'f' },
+    { nullptr,   0,                 nullptr, 0 }
+  };
+
+  while ( true ) {
+    const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+    if ( opt == -1 ) {
+      break;
+    }
+
+    switch ( opt ) {
+    case 't':
+      threads = stoul( optarg );
+      break;
+    case 'p':
+      pin = true;
+      break;
+    case 'f':
+      file_path = optarg;
+      break;
+    default:
+      usage( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( optind != argc - 1 or threads == 0 ) {
+    usage( argv[ 0 ] );
     return EXIT_FAILURE;
   }
 
-  /* create a TCP socket */
-  TCPSocket listening_socket;
+  raise_fd_limit();
+
+  /* a peer that goes away mid-write is handled where the write fails */
+  if ( signal( SIGPIPE, SIG_IGN ) == SIG_ERR ) {
+    throw unix_error( "signal" );
+  }
+
+  /* handle SIGINT/SIGTERM as events, so we can report before exiting
+     (blocked before any threads start, so none of them get it) */
+  SignalMask exit_signals( { SIGINT, SIGTERM } );
+  exit_signals.set_as_mask();
+  SignalFD signal_fd( exit_signals );
+
+  /* one listening socket per event loop, all on the same port */
+  vector< unique_ptr< Reactor > > reactors;
+  for ( unsigned int i = 0; i < threads; i++ ) {
+    reactors.emplace_back( new Reactor( i, argv[ optind ], file_path ) );
+  }
+
+  cerr << "Listening on local address: "
+       << reactors.front()->listener().local_address().to_string()
+       << " (" << threads << " event loops)" << endl;
+
+  /* run each event loop on its own thread */
+  vector< thread > workers;
+  for ( unsigned int i = 0; i < threads; i++ ) {
+    workers.emplace_back( [&, i] () {
+	try {
+	  if ( pin ) {
+	    pin_to_core( i );
+	  }
+	  reactors.at( i )->loop();
+	} catch ( const exception & e ) {
+	  print_exception( e );
+	  kill( getpid(), SIGTERM ); /* bring down the other event loops too */
+	}
+      } );
+  }
+
+  /* wait for SIGINT/SIGTERM, then stop every event loop */
+  Poller poller;
+  poller.add_action( Action( signal_fd, Direction::In, [&] () {
+	signal_fd.read_signal();
+	return ResultType::Exit;
+      } ) );
+
+  while ( poller.poll( -1 ).result != PollResult::Exit ) {}
+
+  for ( auto & reactor : reactors ) {
+    reactor->stop();
+  }
+
+  for ( auto & worker : workers ) {
+    worker.join();
+  }
+
+  for ( const auto & reactor : reactors ) {
+    reactor->report();
+  }
+
+  return EXIT_SUCCESS;
+}
+
+Reactor::Reactor( const unsigned int id, const string & port, const string & file_path )
+  : id_( id ),
+    listener_( Socket::NonBlocking ),
+    stop_event_(),
+    poller_( PollerBackend::Epoll ),
+    connections_(),
+    read_buffer_( 65536 ),
+    file_(),
+    file_size_( 0 ),
+    statistics_(),
+    accepting_( false ),
+    accept_retry_timer_( 0 )
+{
+  if ( not file_path.empty() ) {
+    file_.reset( new FileDescriptor( SystemCall( "open " + file_path,
+						 open( file_path.c_str(), O_RDONLY | O_CLOEXEC ) ) ) );
+    struct stat file_info;
+    SystemCall( "fstat", fstat( file_->fd_num(), &file_info ) );
+    file_size_ = file_info.st_size;
+  }
 
   /* it's ok to reuse the server's address as soon as the program quits
      (this helps debugging, at the slight cost to robustness) */
-  listening_socket.set_reuseaddr();
+  listener_.set_reuseaddr();
+
+  /* every event loop listens on the same port */
+  listener_.set_reuseport();
 
   /* "bind" the socket to the user-specified local port number */
-  listening_socket.bind( Address( "::0", argv[ 1 ] ) );
+  listener_.bind( Address( "::0", port ) );
 
   /* mark the socket as listening for incoming connections */
-  listening_socket.listen();
-  cerr << "Listening on local address: " << listening_socket.local_address().to_string() << endl;
+  listener_.listen( 4096 );
+}
 
-  /* Wait for clients to connect */
-  while ( true ) {
+/* accept new connections as they arrive */
+void Reactor::watch_listener()
+{
+  if ( accepting_ ) {
+    return;
+  }
 
-    /* This line does a lot. It waits for a client to connect
-       ("listening_socket.accept()"). When that returns a new socket,
-       it starts a thread to handle that client and passes in the
-       result of accept() as the "client" parameter to the handler. */
-
-    thread client_handler( [] ( TCPSocket client ) {
-	cerr << "New connection from " << client.peer_address().to_string() << endl;
-
-	/* Print every line that the client sends */
-	while ( true ) {
-	  const string chunk = client.read();
-	  if ( client.eof() ) { break; }
-	  cerr << "Got " << chunk.size() << " bytes from "
-	       << client.peer_address().to_string() << ": " << chunk;
-	  client.write( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
+  accepting_ = true;
+  poller_.add_action( Action( listener_, Direction::In, [this] () {
+	if ( accept_connections() ) {
+	  return ResultType::Continue;
 	}
 
-	cerr << client.peer_address().to_string() << " closed the connection." << endl; 
-      }, listening_socket.accept() );
+	/* the listener stays readable until its backlog is taken, so stop
+	   watching it (rather than spin) until a connection closes or, failing
+	   that, a moment has passed */
+	accepting_ = false;
+	poller_.reschedule_timer( accept_retry_timer_, ACCEPT_RETRY_NS );
+	return ResultType::Cancel;
+      } ) );
+}
+
+/* take every new connection waiting on the listening socket;
+   returns false if one couldn't be taken (e.g. out of file descriptors) */
+bool Reactor::accept_connections()
+{
+  try {
+    listener_.accept_all( [this] ( TCPSocket && client ) { add_connection( move( client ) ); } );
+  } catch ( const unix_error & ) {
+    /* leave the rest in the backlog */
+    statistics_.accept_failures++;
+    return false;
+  }
+
+  return true;
+}
+
+void Reactor::add_connection( TCPSocket && client )
+{
+  const int fd_num = client.fd_num();
+  Connection & connection = *connections_.emplace( fd_num, unique_ptr< Connection >(
+    new Connection( move( client ) ) ) ).first->second;
+
+  statistics_.accepted++;
+  statistics_.peak_open = max( statistics_.peak_open, connections_.size() );
 
-    /* Let the client handler continue to run without having
-       to keep track of it. The main thread can go back to accepting
-       new incoming connections. */
+  /* replies go out as the socket has room; a client that doesn't
+     read them gets no more service until it catches up */
+  connection.writer.add_to( poller_ );
+  connection.writer.set_drain_handler( [this, &connection] () { watch_reads( connection ); } );
+  connection.writer.set_error_handler( [this, &connection] ( const unix_error & ) {
+      close_connection( connection ); /* e.g. broken pipe */
+    } );
 
-    client_handler.detach();
+  watch_reads( connection );
+
+  if ( file_ ) {
+    send_file( connection );
   }
+}
 
-  return EXIT_SUCCESS;
+/* reply to everything the client sends (until the replies back up) */
+void Reactor::watch_reads( Connection & connection )
+{
+  poller_.add_action( Action( connection.socket, Direction::In, [this, &connection] () {
+	if ( not serve( connection ) ) {
+	  return ResultType::Continue; /* closed (and this action with it) */
+	}
+
+	return connection.writer.full() ? ResultType::Cancel : ResultType::Continue;
+      } ) );
+}
+
+/* stream the file to the client as the socket has room, then end the connection
+   (the client closes its side once it has everything) */
+void Reactor::send_file( Connection & connection )
+{
+  poller_.add_action( Action( connection.socket, Direction::Out, [this, &connection] () {
+	try {
+	  statistics_.bytes_sent += connection.socket.sendfile( *file_, connection.file_offset,
+								file_size_ - connection.file_offset );
+	  if ( connection.file_offset < file_size_ ) {
+	    return ResultType::Continue;
+	  }
+
+	  connection.socket.shutdown( SHUT_WR );
+	} catch ( const unix_error & ) {
+	  close_connection( connection ); /* e.g. broken pipe */
+	  return ResultType::Continue;
+	}
+
+	return ResultType::Cancel; /* all sent */
+      } ) );
+}
+
+/* read what the client sent and acknowledge it;
+   returns false if the connection closed */
+bool Reactor::serve( Connection & connection )
+{
+  size_t bytes_read;
+  try {
+    read_buffer_.clear();
+    bytes_read = connection.socket.read( read_buffer_, read_buffer_.capacity() );
+  } catch ( const unix_error & ) {
+    close_connection( connection ); /* e.g. reset by peer */
+    return false;
+  }
+
+  if ( connection.socket.eof() ) {
+    close_connection( connection );
+    return false;
+  }
+
+  if ( bytes_read == 0 ) {
+    return true; /* nothing there after all */
+  }
+
+  statistics_.bytes_received += bytes_read;
+
+  if ( file_ ) {
+    return true; /* file-server clients have nothing to say */
+  }
+
+  connection.writer.write( "Received " + to_string( bytes_read ) + " bytes from you.\n" );
+  return true;
+}
+
+void Reactor::close_connection( Connection & connection )
+{
+  const int fd_num = connection.socket.fd_num();
+
+  /* stop watching before the fd is closed (and its number reused) */
+  poller_.remove_actions( connection.socket );
+  statistics_.bytes_sent += connection.writer.bytes_written();
+  connections_.erase( fd_num );
+  statistics_.closed++;
+
+  /* (an fd is free again, so try any connections we couldn't take) */
+  watch_listener();
+}
+
+void Reactor::loop()
+{
+  /* first rule: accept new connections (and, if we run out of fds, try
+     again later; the timer is made now, since it takes an fd of its own,
+     and sits idle until it's needed) */
+  accept_retry_timer_ = poller_.add_timer( ACCEPT_RETRY_IDLE_NS, [this] () {
+      watch_listener();
+      return ResultType::Continue;
+    }, ACCEPT_RETRY_IDLE_NS );
+  watch_listener();
+
+  /* second rule: quit when asked to */
+  poller_.add_action( Action( stop_event_, Direction::In, [this] () {
+	stop_event_.read_event();
+	return ResultType::Exit;
+      } ) );
+
+  /* connections add their own rules as they arrive */
+  while ( poller_.poll( -1 ).result != PollResult::Exit ) {}
+}
+
+void Reactor::report() const
+{
+  uint64_t bytes_sent = statistics_.bytes_sent;
+  for ( const auto & connection : connections_ ) {
+    bytes_sent += connection.second->writer.bytes_written();
+  }
+
+  cerr << "Event loop " << id_ << ": " << statistics_.accepted << " connections accepted ("
+       << connections_.size() << " still open, peak " << statistics_.peak_open << "), "
+       << statistics_.bytes_received << " bytes received, "
+       << bytes_sent << " bytes sent";
+  if ( statistics_.accept_failures ) {
+    cerr << ", " << statistics_.accept_failures << " failed accepts";
+  }
+  cerr << endl;
 }
@@ -140,3 +140,27 @@ bool Address::operator==( const Address & other ) const
 {
   return 0 == memcmp( &addr_, &other.addr_, size_ );
 }
+
+/* FNV-1a over a run of bytes */
+static uint64_t fnv1a( const void * const data, const size_t length,
+		       uint64_t hash = 14695981039346656037ULL )
+{
+  const unsigned char * const bytes = static_cast<const unsigned char *>( data );
+  for ( size_t i = 0; i < length; i++ ) {
+    hash = (hash ^ bytes[ i ]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* hash of the raw sockaddr */
+size_t Address::hash() const
+{
+  /* for IPv6, only the address and port identify the peer (skip flow label and scope) */
+  if ( addr_.as_sockaddr.sa_family == AF_INET6 and size_ >= sizeof( sockaddr_in6 ) ) {
+    const sockaddr_in6 & v6 = reinterpret_cast<const sockaddr_in6 &>( addr_ );
+    return fnv1a( &v6.sin6_port, sizeof( v6.sin6_port ),
+		  fnv1a( &v6.sin6_addr, sizeof( v6.sin6_addr ) ) );
+  }
+
+  return fnv1a( &addr_, size_ );
+}
@@ -47,6 +47,16 @@ public:
 
   /* equality */
   bool operator==( const Address & other ) const;
+
+  /* hash of the raw sockaddr (cheap enough to use per packet, unlike to_string()) */
+  size_t hash() const;
 };
 
+namespace std {
+  template <> struct hash< Address >
+  {
+    size_t operator()( const Address & address ) const { return address.hash(); }
+  };
+}
+
 #endif /* ADDRESS_HH */
@@ -0,0 +1,128 @@
+#include <fcntl.h>
+
+#include "async_file_writer.hh"
+#include "poller.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+AsyncFileWriter::AsyncFileWriter( const string & path )
+  : file_( SystemCall( "open " + path,
+		       open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) ),
+    buffer_(),
+    buffer_records_( 0 ),
+    buffer_start_ns_( 0 ),
+    queue_mutex_(),
+    queue_(),
+    queued_bytes_( 0 ),
+    records_( 0 ),
+    dropped_records_( 0 ),
+    stopping_( false ),
+    ready_event_(),
+    writer_()
+{
+  buffer_.reserve( 2 * CHUNK_SIZE );
+  writer_ = thread( [this] () { write_loop(); } );
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+  try {
+    flush();
+    stopping_ = true;
+    ready_event_.signal();
+    writer_.join();
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+}
+
+void AsyncFileWriter::append( const char * const data, const size_t length )
+{
+  buffer_.append( data, length );
+}
+
+void AsyncFileWriter::end_record( const uint64_t now_ns )
+{
+  if ( buffer_records_ == 0 ) {
+    buffer_start_ns_ = now_ns;
+  }
+
+  buffer_records_++;
+  records_++;
+
+  if ( buffer_.size() >= CHUNK_SIZE or now_ns - buffer_start_ns_ >= CHUNK_AGE_NS ) {
+    flush();
+  }
+}
+
+void AsyncFileWriter::flush()
+{
+  if ( buffer_.empty() ) {
+    return;
+  }
+
+  {
+    unique_lock< mutex > lock( queue_mutex_ );
+    if ( queued_bytes_ + buffer_.size() > MAX_QUEUED_BYTES ) {
+      dropped_records_ += buffer_records_; /* the disk can't keep up */
+      buffer_.clear();
+      buffer_records_ = 0;
+      return;
+    }
+
+    queued_bytes_ += buffer_.size();
+    queue_.emplace_back( move( buffer_ ), buffer_records_ );
+  }
+
+  ready_event_.signal();
+
+  buffer_ = string();
+  buffer_.reserve( 2 * CHUNK_SIZE );
+  buffer_records_ = 0;
+}
+
+uint64_t AsyncFileWriter::dropped_records()
+{
+  unique_lock< mutex > lock( queue_mutex_ );
+  return dropped_records_;
+}
+
+void AsyncFileWriter::write_loop()
+{
+  try {
+    Poller poller;
+
+    /* write out buffers as they're handed off; quit once the last one is */
+    poller.add_action( Action( ready_event_, Direction::In, [&] () {
+	  ready_event_.read_event();
+
+	  /* (checked first: once it's set, every buffer has been handed off) */
+	  const bool stopping = stopping_;
+
+	  while ( true ) {
+	    pair< string, uint64_t > chunk;
+	    {
+	      unique_lock< mutex > lock( queue_mutex_ );
+	      if ( queue_.empty() ) {
+		break;
+	      }
+	      chunk = move( queue_.front() );
+	      queue_.pop_front();
+	    }
+
+	    file_.write( chunk.first );
+
+	    unique_lock< mutex > lock( queue_mutex_ );
+	    queued_bytes_ -= chunk.first.size();
+	  }
+
+	  return stopping ? ResultType::Exit : ResultType::Continue;
+	} ) );
+
+    while ( poller.poll( -1 ).result != PollResult::Exit ) {}
+  } catch ( const exception & e ) {
+    print_exception( e ); /* e.g. disk full: writing stops, the program doesn't */
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef ASYNC_FILE_WRITER_HH
+#define ASYNC_FILE_WRITER_HH
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "eventfd.hh"
+#include "file_descriptor.hh"
+
+/* Writes a stream of records to a file without making the caller wait
+   on the disk: records are appended to a buffer, and full buffers are
+   written out by a background thread. If the disk falls too far behind,
+   whole buffers are dropped (and counted) rather than waited for, so
+   memory stays bounded. Used from one thread at a time. */
+class AsyncFileWriter
+{
+private:
+  /* buffers are handed off once this big (or this old) */
+  static const size_t CHUNK_SIZE = 65536;
+  static const uint64_t CHUNK_AGE_NS = 100000000;
+
+  /* most buffered bytes waiting for the disk before dropping */
+  static const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+  FileDescriptor file_;
+
+  /* filled by the caller */
+  std::string buffer_;
+  uint64_t buffer_records_;
+  uint64_t buffer_start_ns_;
+
+  /* handed off to the writer thread (buffer, and how many records it holds) */
+  std::mutex queue_mutex_;
+  std::deque< std::pair< std::string, uint64_t > > queue_;
+  size_t queued_bytes_;
+
+  uint64_t records_, dropped_records_;
+
+  std::atomic< bool > stopping_;
+  EventFD ready_event_;
+  std::thread writer_;
+
+  void write_loop();
+
+public:
+  /* create (or replace) the file at path */
+  AsyncFileWriter( const std::string & path );
+
+  /* writes out everything appended so far */
+  ~AsyncFileWriter();
+
+  /* add bytes to the current record */
+  void append( const char * const data, const size_t length );
+  void append( const std::string & data ) { append( data.data(), data.size() ); }
+
+  /* finish the current record (now_ns, on any monotonic timeline, ages the buffer) */
+  void end_record( const uint64_t now_ns );
+
+  /* hand what's buffered to the writer thread now */
+  void flush();
+
+  /* accessors */
+  uint64_t records() const { return records_; }
+  uint64_t dropped_records();
+
+  /* forbid copying or assigning */
+  AsyncFileWriter( const AsyncFileWriter & other ) = delete;
+  AsyncFileWriter & operator=( const AsyncFileWriter & other ) = delete;
+};
+
+#endif /* ASYNC_FILE_WRITER_HH */
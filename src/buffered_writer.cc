@@ -0,0 +1,120 @@
+#include <algorithm>
+
+#include <limits.h>
+
+#include "buffered_writer.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+BufferedWriter::BufferedWriter( FileDescriptor & fd,
+				const size_t high_watermark,
+				const size_t low_watermark )
+  : fd_( fd ),
+    queue_(),
+    front_offset_( 0 ),
+    queued_bytes_( 0 ),
+    bytes_written_( 0 ),
+    high_watermark_( high_watermark ),
+    low_watermark_( min( low_watermark, high_watermark ) ),
+    full_( false ),
+    poller_( nullptr ),
+    watching_( false ),
+    drain_handler_(),
+    error_handler_(),
+    iovecs_()
+{}
+
+void BufferedWriter::write( string && data )
+{
+  if ( data.empty() ) {
+    return;
+  }
+
+  queued_bytes_ += data.size();
+  queue_.push_back( move( data ) );
+
+  if ( queued_bytes_ > high_watermark_ ) {
+    full_ = true;
+  }
+
+  watch();
+}
+
+void BufferedWriter::flush()
+{
+  if ( queue_.empty() ) {
+    return;
+  }
+
+  /* gather as much of the queue as one writev() can take */
+  iovecs_.clear();
+  for ( auto it = queue_.begin(); it != queue_.end() and iovecs_.size() < IOV_MAX; ++it ) {
+    const size_t offset = it == queue_.begin() ? front_offset_ : 0;
+    iovecs_.push_back( { const_cast<char *>( it->data() ) + offset, it->size() - offset } );
+  }
+
+  size_t written = fd_.write( iovecs_.data(), iovecs_.size() );
+  bytes_written_ += written;
+  queued_bytes_ -= written;
+
+  /* drop what's been written */
+  while ( written ) {
+    const size_t remaining_in_front = queue_.front().size() - front_offset_;
+    if ( written < remaining_in_front ) {
+      front_offset_ += written;
+      break;
+    }
+
+    written -= remaining_in_front;
+    queue_.pop_front();
+    front_offset_ = 0;
+  }
+
+  if ( full_ and queued_bytes_ <= low_watermark_ ) {
+    full_ = false;
+    if ( drain_handler_ ) {
+      drain_handler_();
+    }
+  }
+}
+
+void BufferedWriter::add_to( Poller & poller )
+{
+  poller_ = &poller;
+  watch();
+}
+
+void BufferedWriter::watch()
+{
+  if ( not poller_ or watching_ or queue_.empty() ) {
+    return;
+  }
+
+  watching_ = true;
+  poller_->add_action( Poller::Action( fd_, Direction::Out, [this] () {
+	try {
+	  flush();
+	} catch ( const unix_error & e ) {
+	  if ( not error_handler_ ) {
+	    throw;
+	  }
+
+	  /* give up on the queue before the handler runs,
+	     since it may well destroy us (so touch nothing after) */
+	  queue_.clear();
+	  queued_bytes_ = front_offset_ = 0;
+	  watching_ = false;
+	  const ErrorHandler handler = error_handler_;
+	  handler( e );
+	  return ResultType::Cancel;
+	}
+
+	if ( queue_.empty() ) {
+	  watching_ = false;
+	  return ResultType::Cancel; /* nothing more to write: stop polling for room */
+	}
+
+	return ResultType::Continue;
+      } ) );
+}
@@ -0,0 +1,82 @@
+#ifndef BUFFERED_WRITER_HH
+#define BUFFERED_WRITER_HH
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "file_descriptor.hh"
+#include "poller.hh"
+#include "util.hh"
+
+/* outbound queue for a (non-blocking) fd: write() never blocks, and the
+   queue is flushed with writev() whenever the fd is writable. Once more
+   than the high watermark is queued, full() stays true until the queue
+   drains to the low watermark, so producers can back off. */
+class BufferedWriter
+{
+public:
+  typedef std::function<void(void)> DrainHandler;
+  typedef std::function<void(const unix_error &)> ErrorHandler;
+
+private:
+  FileDescriptor & fd_;
+
+  std::deque< std::string > queue_;
+  size_t front_offset_; /* bytes of queue_.front() already written */
+  size_t queued_bytes_;
+  uint64_t bytes_written_;
+
+  size_t high_watermark_, low_watermark_;
+  bool full_;
+
+  Poller * poller_; /* null until add_to() */
+  bool watching_; /* is an Out action registered? */
+
+  DrainHandler drain_handler_;
+  ErrorHandler error_handler_;
+
+  std::vector< iovec > iovecs_; /* reused by every flush */
+
+  /* make sure the poller will flush us when the fd is writable */
+  void watch();
+
+public:
+  BufferedWriter( FileDescriptor & fd,
+		  const size_t high_watermark = 1024 * 1024,
+		  const size_t low_watermark = 256 * 1024 );
+
+  /* queue bytes to be written (never blocks) */
+  void write( std::string && data );
+  void write( const std::string & data ) { write( std::string( data ) ); }
+
+  /* write as much of the queue as the kernel will take, with one writev() */
+  void flush();
+
+  /* flush whenever there's something queued and the fd is writable
+     (the Out action is only registered while the queue is non-empty;
+     remove the fd's actions from the poller before destroying the writer) */
+  void add_to( Poller & poller );
+
+  /* called when a full() writer drains to the low watermark */
+  void set_drain_handler( const DrainHandler & handler ) { drain_handler_ = handler; }
+
+  /* called instead of throwing if a flush from the poller fails
+     (e.g. the peer reset the connection); the queue is discarded */
+  void set_error_handler( const ErrorHandler & handler ) { error_handler_ = handler; }
+
+  /* accessors */
+  bool empty() const { return queue_.empty(); }
+  bool full() const { return full_; }
+  size_t queued_bytes() const { return queued_bytes_; }
+  uint64_t bytes_written() const { return bytes_written_; }
+
+  /* the poller's action refers back to the writer */
+  BufferedWriter( const BufferedWriter & other ) = delete;
+  BufferedWriter & operator=( const BufferedWriter & other ) = delete;
+};
+
+#endif /* BUFFERED_WRITER_HH */
@@ -0,0 +1,32 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "eventfd.hh"
+#include "util.hh"
+
+using namespace std;
+
+EventFD::EventFD()
+  : FileDescriptor( SystemCall( "eventfd", eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) )
+{}
+
+/* add to the counter */
+void EventFD::signal( const uint64_t increment )
+{
+  SystemCall( "write (eventfd)", ::write( fd_num(), &increment, sizeof( increment ) ) );
+}
+
+/* read and reset the counter */
+uint64_t EventFD::read_event()
+{
+  uint64_t value = 0;
+
+  const ssize_t bytes_read = ::read( fd_num(), &value, sizeof( value ) );
+  if ( bytes_read < 0 and errno != EAGAIN ) {
+    throw unix_error( "read (eventfd)" );
+  }
+
+  register_read();
+
+  return bytes_read == sizeof( value ) ? value : 0;
+}
@@ -0,0 +1,21 @@
+#ifndef EVENTFD_HH
+#define EVENTFD_HH
+
+#include <cstdint>
+
+#include "file_descriptor.hh"
+
+/* counter that becomes readable when another thread signals it */
+class EventFD : public FileDescriptor
+{
+public:
+  EventFD();
+
+  /* add to the counter, waking anyone polling the fd (safe from any thread) */
+  void signal( const uint64_t increment = 1 );
+
+  /* read and reset the counter (0 if it was already reset; never blocks) */
+  uint64_t read_event();
+};
+
+#endif /* EVENTFD_HH */
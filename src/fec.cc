@@ -0,0 +1,358 @@
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <endian.h>
+
+#include "fec.hh"
+#include "gf256.hh"
+
+using namespace std;
+
+static const char FEC_MAGIC[ 4 ] = { 'D', 'G', 'F', 'E' };
+
+/* The header is the magic, then the block id (network byte order),
+   the payload's index in the block (data first, then parity), and the
+   block's data and parity counts.
+
+   What's coded is each data payload with its length in front (2 bytes,
+   network byte order), zero-padded to the longest in the block, so a
+   recovered payload comes back the right length. */
+
+struct FecHeader
+{
+  uint32_t block_id;
+  uint8_t index, data_count, parity_count;
+};
+
+static string make_header( const FecHeader & header )
+{
+  const uint32_t network_block_id = htobe32( header.block_id );
+
+  string ret( FEC_MAGIC, sizeof( FEC_MAGIC ) );
+  ret.append( reinterpret_cast<const char *>( &network_block_id ), sizeof( network_block_id ) );
+  ret.push_back( header.index );
+  ret.push_back( header.data_count );
+  ret.push_back( header.parity_count );
+  ret.push_back( 0 ); /* reserved */
+  return ret;
+}
+
+static bool parse_header( const string & payload, FecHeader & header )
+{
+  if ( payload.size() < FecEncoder::HEADER_SIZE
+       or memcmp( payload.data(), FEC_MAGIC, sizeof( FEC_MAGIC ) ) ) {
+    return false;
+  }
+
+  uint32_t network_block_id;
+  memcpy( &network_block_id, payload.data() + 4, sizeof( network_block_id ) );
+  header.block_id = be32toh( network_block_id );
+  header.index = payload[ 8 ];
+  header.data_count = payload[ 9 ];
+  header.parity_count = payload[ 10 ];
+
+  return header.data_count > 0 and header.data_count <= FecEncoder::MAX_DATA_COUNT
+    and header.parity_count <= FecEncoder::MAX_PARITY_COUNT
+    and header.index < header.data_count + header.parity_count;
+}
+
+/* what data payload index is multiplied by in parity payload row: row 0
+   is all ones (plain XOR), and together the rows are a Cauchy matrix,
+   1 / (x_row + y_index) with x_row = 128 + row and y_index = index,
+   with each column scaled to make row 0 ones */
+static uint8_t coefficient( const unsigned int row, const unsigned int index )
+{
+  return row == 0 ? 1 : GF256::divide( 128 ^ index, (128 + row) ^ index );
+}
+
+/* a data payload as coded */
+static string data_symbol( const string & payload )
+{
+  if ( payload.size() > UINT16_MAX ) {
+    throw runtime_error( "payload too long for FEC" );
+  }
+
+  const uint16_t network_length = htobe16( payload.size() );
+  return string( reinterpret_cast<const char *>( &network_length ), sizeof( network_length ) )
+    + payload;
+}
+
+/* dst += c * src, growing dst (with zeroes) if src is longer */
+static void multiply_add( string & dst, const string & src, const uint8_t c )
+{
+  if ( dst.size() < src.size() ) {
+    dst.resize( src.size(), 0 );
+  }
+
+  GF256::multiply_add( reinterpret_cast<uint8_t *>( &dst[ 0 ] ),
+		       reinterpret_cast<const uint8_t *>( src.data() ), c, src.size() );
+}
+
+FecEncoder::FecEncoder( const unsigned int data_count, const unsigned int parity_count )
+  : data_count_( data_count ),
+    parity_count_( 0 ),
+    next_parity_count_( 0 ),
+    block_id_( 0 ),
+    index_( 0 ),
+    parity_(),
+    ready_parity_()
+{
+  if ( data_count_ == 0 or data_count_ > MAX_DATA_COUNT ) {
+    throw runtime_error( "FEC block must have 1 to " + to_string( MAX_DATA_COUNT ) + " data payloads" );
+  }
+
+  set_parity_count( parity_count );
+}
+
+void FecEncoder::set_parity_count( const unsigned int parity_count )
+{
+  next_parity_count_ = min( parity_count, MAX_PARITY_COUNT );
+}
+
+string FecEncoder::encode( const string & payload )
+{
+  if ( index_ == 0 ) {
+    parity_count_ = next_parity_count_;
+    parity_.assign( parity_count_, string() );
+  }
+
+  /* add this payload's part of every parity payload */
+  if ( parity_count_ ) {
+    const string symbol = data_symbol( payload );
+    for ( unsigned int row = 0; row < parity_count_; row++ ) {
+      multiply_add( parity_.at( row ), symbol, coefficient( row, index_ ) );
+    }
+  }
+
+  const string ret = make_header( { block_id_, uint8_t( index_ ), uint8_t( data_count_ ),
+				    uint8_t( parity_count_ ) } ) + payload;
+
+  if ( ++index_ == data_count_ ) {
+    /* the block is complete */
+    for ( unsigned int row = 0; row < parity_count_; row++ ) {
+      ready_parity_.push_back( make_header( { block_id_, uint8_t( data_count_ + row ),
+					      uint8_t( data_count_ ), uint8_t( parity_count_ ) } )
+			       + parity_.at( row ) );
+    }
+    parity_.clear();
+    block_id_++;
+    index_ = 0;
+  }
+
+  return ret;
+}
+
+string FecEncoder::next_parity()
+{
+  const string ret = ready_parity_.front();
+  ready_parity_.pop_front();
+  return ret;
+}
+
+unsigned int FecEncoder::parity_for_loss( const unsigned int data_count, const double loss_rate )
+{
+  if ( not (loss_rate > 0) ) {
+    return 0;
+  } else if ( loss_rate >= 1 ) {
+    return MAX_PARITY_COUNT;
+  }
+
+  for ( unsigned int parity_count = 0; parity_count < MAX_PARITY_COUNT; parity_count++ ) {
+    /* chance that at most parity_count of the block's datagrams are lost
+       (binomial, adding up the terms one after the next) */
+    const unsigned int n = data_count + parity_count;
+    double term = pow( 1 - loss_rate, n ), recoverable = term;
+    for ( unsigned int lost = 0; lost < parity_count; lost++ ) {
+      term *= double( n - lost ) / ( lost + 1 ) * loss_rate / ( 1 - loss_rate );
+      recoverable += term;
+    }
+
+    if ( 1 - recoverable <= TARGET_BLOCK_FAILURE ) {
+      return parity_count;
+    }
+  }
+
+  return MAX_PARITY_COUNT;
+}
+
+FecDecoder::Block::Block( const unsigned int s_data_count, const unsigned int s_parity_count )
+  : data_count( s_data_count ),
+    parity_count( s_parity_count ),
+    symbols( s_data_count + s_parity_count ),
+    delivered( s_data_count ),
+    received( 0 ),
+    data_received( 0 ),
+    done( false )
+{}
+
+FecDecoder::FecDecoder()
+  : blocks_(),
+    statistics_()
+{}
+
+bool FecDecoder::receive( const string & payload, const PayloadCallback & deliver )
+{
+  FecHeader header;
+  if ( not parse_header( payload, header ) ) {
+    return false;
+  }
+
+  const bool is_data = header.index < header.data_count;
+  if ( is_data ) {
+    statistics_.data++;
+  } else {
+    statistics_.parity++;
+  }
+
+  /* find the block (unless it's long gone) */
+  auto block_it = blocks_.find( header.block_id );
+  if ( block_it == blocks_.end() ) {
+    if ( not blocks_.empty() and header.block_id < blocks_.begin()->first ) {
+      if ( is_data ) {
+	deliver( payload.substr( FecEncoder::HEADER_SIZE ) ); /* too late to help, but not to use */
+      }
+      return true;
+    }
+
+    block_it = blocks_.emplace( header.block_id,
+				Block( header.data_count, header.parity_count ) ).first;
+    while ( blocks_.size() > MAX_BLOCKS ) {
+      retire_oldest();
+    }
+  }
+
+  Block & block = block_it->second;
+  if ( header.data_count != block.data_count or header.parity_count != block.parity_count ) {
+    return true; /* mismatched */
+  }
+
+  if ( is_data ) {
+    if ( block.delivered.at( header.index ) ) {
+      return true; /* (already recovered, or a duplicate) */
+    }
+    block.delivered.at( header.index ) = true;
+    deliver( payload.substr( FecEncoder::HEADER_SIZE ) );
+  }
+
+  if ( block.done or not block.symbols.at( header.index ).empty() ) {
+    return true; /* nothing left to recover */
+  }
+
+  block.symbols.at( header.index ) = is_data ? data_symbol( payload.substr( FecEncoder::HEADER_SIZE ) )
+                                             : payload.substr( FecEncoder::HEADER_SIZE );
+  block.received++;
+  if ( is_data ) {
+    block.data_received++;
+  }
+
+  if ( block.data_received == block.data_count ) {
+    block.done = true; /* nothing was lost */
+    block.symbols.clear();
+  } else if ( block.received >= block.data_count ) {
+    recover( block, deliver );
+  }
+
+  return true;
+}
+
+void FecDecoder::recover( Block & block, const PayloadCallback & deliver )
+{
+  /* the lost data, and as many parity payloads to solve for it */
+  vector< unsigned int > lost, rows;
+  size_t length = 0;
+  for ( unsigned int i = 0; i < block.data_count + block.parity_count; i++ ) {
+    if ( i < block.data_count and block.symbols.at( i ).empty() ) {
+      lost.push_back( i );
+    } else if ( i >= block.data_count and not block.symbols.at( i ).empty()
+		and rows.size() < block.data_count - block.data_received ) {
+      rows.push_back( i - block.data_count );
+      length = max( length, block.symbols.at( i ).size() );
+    }
+  }
+
+  const size_t n = lost.size();
+
+  /* each parity payload, less the data that did arrive, is a sum of the lost data */
+  vector< string > sums;
+  for ( const unsigned int row : rows ) {
+    string sum = block.symbols.at( block.data_count + row );
+    sum.resize( length, 0 );
+    for ( unsigned int i = 0; i < block.data_count; i++ ) {
+      if ( not block.symbols.at( i ).empty() ) {
+	multiply_add( sum, block.symbols.at( i ), coefficient( row, i ) );
+      }
+    }
+    sums.push_back( sum );
+  }
+
+  /* invert the lost data's coefficients (Gauss-Jordan elimination) */
+  vector< vector< uint8_t > > matrix( n, vector< uint8_t >( n ) ), inverse( n, vector< uint8_t >( n ) );
+  for ( size_t r = 0; r < n; r++ ) {
+    for ( size_t c = 0; c < n; c++ ) {
+      matrix[ r ][ c ] = coefficient( rows[ r ], lost[ c ] );
+    }
+    inverse[ r ][ r ] = 1;
+  }
+
+  for ( size_t c = 0; c < n; c++ ) {
+    size_t pivot = c;
+    while ( pivot < n and matrix[ pivot ][ c ] == 0 ) {
+      pivot++;
+    }
+    if ( pivot == n ) {
+      throw runtime_error( "FEC: singular matrix" ); /* (a Cauchy matrix never is) */
+    }
+    swap( matrix[ c ], matrix[ pivot ] );
+    swap( inverse[ c ], inverse[ pivot ] );
+
+    const uint8_t scale = GF256::inverse( matrix[ c ][ c ] );
+    for ( size_t k = 0; k < n; k++ ) {
+      matrix[ c ][ k ] = GF256::multiply( matrix[ c ][ k ], scale );
+      inverse[ c ][ k ] = GF256::multiply( inverse[ c ][ k ], scale );
+    }
+
+    for ( size_t r = 0; r < n; r++ ) {
+      const uint8_t factor = matrix[ r ][ c ];
+      if ( r == c or factor == 0 ) {
+	continue;
+      }
+      for ( size_t k = 0; k < n; k++ ) {
+	matrix[ r ][ k ] ^= GF256::multiply( factor, matrix[ c ][ k ] );
+	inverse[ r ][ k ] ^= GF256::multiply( factor, inverse[ c ][ k ] );
+      }
+    }
+  }
+
+  /* each lost payload is a combination of the sums */
+  for ( size_t c = 0; c < n; c++ ) {
+    string symbol( length, 0 );
+    for ( size_t r = 0; r < n; r++ ) {
+      multiply_add( symbol, sums[ r ], inverse[ c ][ r ] );
+    }
+
+    uint16_t network_length;
+    memcpy( &network_length, symbol.data(), sizeof( network_length ) );
+    const size_t payload_length = be16toh( network_length );
+    if ( symbol.size() < sizeof( network_length ) + payload_length ) {
+      statistics_.unrecovered++; /* (corrupt) */
+      continue;
+    }
+
+    statistics_.recovered++;
+    block.delivered.at( lost[ c ] ) = true;
+    deliver( symbol.substr( sizeof( network_length ), payload_length ) );
+  }
+
+  block.done = true;
+  block.symbols.clear();
+}
+
+void FecDecoder::retire_oldest()
+{
+  const Block & block = blocks_.begin()->second;
+  if ( not block.done ) {
+    statistics_.unrecovered += block.data_count - block.data_received;
+  }
+  blocks_.erase( blocks_.begin() );
+}
@@ -0,0 +1,113 @@
+#ifndef FEC_HH
+#define FEC_HH
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Forward error correction for datagram payloads: a systematic
+   Reed-Solomon erasure code over blocks of consecutive datagrams. Each
+   block is some data datagrams, sent as they are behind a small header,
+   then some parity datagrams; if any of the data is lost, any data_count
+   of the block's datagrams give it back, without waiting a round trip.
+   The first parity datagram is the XOR of the data, and the rest come
+   from a Cauchy matrix (so that every choice of data_count works). How
+   much parity a block gets can change from one block to the next. */
+
+/* makes each block and its parity */
+class FecEncoder
+{
+public:
+  static const size_t HEADER_SIZE = 12; /* in front of every payload */
+  static const unsigned int MAX_DATA_COUNT = 64, MAX_PARITY_COUNT = 16;
+
+  /* parity_for_loss() aims for at most this chance of a block losing more than it can recover */
+  static constexpr double TARGET_BLOCK_FAILURE = 0.001;
+
+private:
+  unsigned int data_count_;
+  unsigned int parity_count_, next_parity_count_; /* for this block, and from the next on */
+  uint32_t block_id_;
+  unsigned int index_; /* of the next data payload in the block */
+
+  std::vector< std::string > parity_; /* so far, for this block */
+  std::deque< std::string > ready_parity_; /* for blocks already complete */
+
+public:
+  FecEncoder( const unsigned int data_count, const unsigned int parity_count = 0 );
+
+  /* how much parity each block gets, from the next one to start on */
+  void set_parity_count( const unsigned int parity_count );
+
+  unsigned int data_count() const { return data_count_; }
+
+  /* whether the next data payload starts a block */
+  bool at_block_start() const { return index_ == 0; }
+
+  /* wrap a data payload for sending (every data_count of them
+     complete a block, whose parity is then ready to send) */
+  std::string encode( const std::string & payload );
+
+  /* parity payloads ready to send, oldest first */
+  bool has_parity() const { return not ready_parity_.empty(); }
+  std::string next_parity();
+
+  /* the least parity for a block of data_count that keeps the chance of it
+     losing more than it can recover under TARGET_BLOCK_FAILURE, if each
+     datagram is lost independently at loss_rate (at most MAX_PARITY_COUNT) */
+  static unsigned int parity_for_loss( const unsigned int data_count, const double loss_rate );
+};
+
+/* takes back each block's data, recovering what it can */
+class FecDecoder
+{
+public:
+  typedef std::function<void(const std::string & payload)> PayloadCallback;
+
+  struct Statistics
+  {
+    uint64_t data, parity; /* datagrams received */
+    uint64_t recovered; /* data datagrams lost (or late), but recovered */
+    uint64_t unrecovered; /* data datagrams lost for good (in blocks given up on) */
+  };
+
+  /* blocks kept waiting for more of their datagrams */
+  static const unsigned int MAX_BLOCKS = 64;
+
+private:
+  struct Block
+  {
+    unsigned int data_count, parity_count;
+    std::vector< std::string > symbols; /* by index, as coded ("" if not received) */
+    std::vector< bool > delivered; /* by data index (received, or recovered first) */
+    unsigned int received, data_received;
+    bool done; /* all the data is in (and symbols are freed) */
+
+    Block( const unsigned int s_data_count, const unsigned int s_parity_count );
+  };
+
+  std::map< uint32_t, Block > blocks_;
+  Statistics statistics_;
+
+  /* solve for the block's lost data from its parity */
+  void recover( Block & block, const PayloadCallback & deliver );
+
+  /* stop waiting on the oldest block */
+  void retire_oldest();
+
+public:
+  FecDecoder();
+
+  /* take a received payload: if it's FEC-coded, calls deliver with the
+     data it carries (if any) and with any it lets the decoder recover
+     (each data payload once, while its block is kept); returns false,
+     doing nothing, if it isn't */
+  bool receive( const std::string & payload, const PayloadCallback & deliver );
+
+  const Statistics & statistics() const { return statistics_; }
+};
+
+#endif /* FEC_HH */
@@ -2,6 +2,7 @@
 #include "util.hh"
 
 #include <unistd.h>
+#include <fcntl.h>
 
 using namespace std;
 
@@ -46,7 +47,13 @@ string::const_iterator FileDescriptor::write( const string::const_iterator & beg
     throw runtime_error( "nothing to write" );
   }
 
-  ssize_t bytes_written = SystemCall( "write", ::write( fd_, &*begin, end - begin ) );
+  const ssize_t ret = ::write( fd_, &*begin, end - begin );
+  if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    register_write(); /* non-blocking and no room: nothing written */
+    return begin;
+  }
+
+  ssize_t bytes_written = SystemCall( "write", ret );
   if ( bytes_written == 0 ) {
     throw runtime_error( "write returned 0" );
   }
@@ -56,19 +63,60 @@ string::const_iterator FileDescriptor::write( const string::const_iterator & beg
   return begin + bytes_written;
 }
 
-/* read method */
-string FileDescriptor::read( const size_t limit )
+/* gathering write */
+size_t FileDescriptor::write( const iovec * const buffers, const int count )
 {
-  char buffer[ BUFFER_SIZE ];
+  const ssize_t ret = ::writev( fd_, buffers, count );
+  if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    register_write(); /* non-blocking and no room: nothing written */
+    return 0;
+  }
+
+  const ssize_t bytes_written = SystemCall( "writev", ret );
+  register_write();
 
-  ssize_t bytes_read = SystemCall( "read", ::read( fd_, buffer, min( BUFFER_SIZE, limit ) ) );
+  return bytes_written;
+}
+
+/* read into caller-owned memory */
+size_t FileDescriptor::read( char * const data, const size_t length )
+{
+  const ssize_t ret = ::read( fd_, data, length );
+  if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    register_read(); /* non-blocking and nothing waiting */
+    return 0;
+  }
+
+  ssize_t bytes_read = SystemCall( "read", ret );
   if ( bytes_read == 0 ) {
     set_eof();
   }
 
   register_read();
 
-  return string( buffer, bytes_read );
+  return bytes_read;
+}
+
+/* read into a reusable buffer */
+size_t FileDescriptor::read( ReadBuffer & buffer, const size_t limit )
+{
+  const size_t length = min( limit, max( buffer.writable(), MIN_READ_SIZE ) );
+  const size_t bytes_read = read( buffer.prepare( length ), length );
+  buffer.commit( bytes_read );
+  return bytes_read;
+}
+
+/* read method */
+string FileDescriptor::read( const size_t limit )
+{
+  /* scratch space, reused by every read on this thread
+     (so a read doesn't put BUFFER_SIZE on the stack) */
+  static thread_local ReadBuffer scratch( 0 );
+  scratch.clear();
+
+  const size_t length = min( BUFFER_SIZE, limit );
+  char * const data = scratch.prepare( length );
+  return string( data, read( data, length ) );
 }
 
 /* write method */
@@ -82,3 +130,16 @@ string::const_iterator FileDescriptor::write( const std::string & buffer, const
 
   return it;
 }
+
+/* make reads and writes return instead of waiting (or go back to waiting) */
+void FileDescriptor::set_blocking( const bool blocking )
+{
+  int flags = SystemCall( "fcntl", fcntl( fd_, F_GETFL ) );
+  if ( blocking ) {
+    flags &= ~O_NONBLOCK;
+  } else {
+    flags |= O_NONBLOCK;
+  }
+
+  SystemCall( "fcntl", fcntl( fd_, F_SETFL, flags ) );
+}
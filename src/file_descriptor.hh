@@ -3,6 +3,10 @@
 
 #include <string>
 
+#include <sys/uio.h>
+
+#include "read_buffer.hh"
+
 /* Unix file descriptors (sockets, files, etc.) */
 class FileDescriptor
 {
@@ -16,9 +20,12 @@ private:
   std::string::const_iterator write( const std::string::const_iterator & begin,
 				     const std::string::const_iterator & end );
 
-  /* maximum size of a read */
+  /* maximum size of a read into a string */
   const static size_t BUFFER_SIZE = 1024 * 1024;
 
+  /* least room to offer the kernel when reading into a ReadBuffer */
+  const static size_t MIN_READ_SIZE = 4096;
+
 protected:
   void register_read() { read_count_++; }
   void register_write() { write_count_++; }
@@ -40,10 +47,27 @@ public:
   unsigned int read_count() const { return read_count_; }
   unsigned int write_count() const { return write_count_; }
 
-  /* read and write methods */
+  /* read and write methods
+     (on a non-blocking fd, read() returns "" without EOF and write() may stop short
+     if the kernel has nothing to give or no room; use write_all = false there) */
   std::string read( const size_t limit = BUFFER_SIZE );
   std::string::const_iterator write( const std::string & buffer, const bool write_all = true );
 
+  /* read into caller-owned memory, returning the number of bytes read
+     (0 at EOF, or if a non-blocking fd had nothing waiting) */
+  size_t read( char * const data, const size_t length );
+
+  /* append up to limit bytes to buffer (reusing its memory, growing it only
+     when it's full), returning the number of bytes read as above */
+  size_t read( ReadBuffer & buffer, const size_t limit = BUFFER_SIZE );
+
+  /* write from several buffers with one system call, returning the number
+     of bytes written (may be short, or 0 if a non-blocking fd had no room) */
+  size_t write( const iovec * const buffers, const int count );
+
+  /* make reads and writes return instead of waiting (or go back to waiting) */
+  void set_blocking( const bool blocking );
+
   /* forbid copying FileDescriptor objects or assigning them */
   FileDescriptor( const FileDescriptor & other ) = delete;
   const FileDescriptor & operator=( const FileDescriptor & other ) = delete;
@@ -0,0 +1,223 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "gf256.hh"
+
+using namespace std;
+
+/* log and exp tables, with 2 as the generator (the field is built
+   on the polynomial x^8 + x^4 + x^3 + x^2 + 1) */
+struct GF256Tables
+{
+  uint8_t exp[ 510 ]; /* twice over, so exp[ log a + log b ] needs no reduction */
+  uint8_t log[ 256 ];
+
+  GF256Tables()
+    : exp(), log()
+  {
+    unsigned int x = 1;
+    for ( unsigned int i = 0; i < 255; i++ ) {
+      exp[ i ] = exp[ i + 255 ] = x;
+      log[ x ] = i;
+      x <<= 1;
+      if ( x & 0x100 ) {
+	x ^= 0x11d;
+      }
+    }
+  }
+};
+
+static const GF256Tables tables;
+
+uint8_t GF256::multiply( const uint8_t a, const uint8_t b )
+{
+  if ( a == 0 or b == 0 ) {
+    return 0;
+  }
+  return tables.exp[ tables.log[ a ] + tables.log[ b ] ];
+}
+
+uint8_t GF256::divide( const uint8_t a, const uint8_t b )
+{
+  if ( a == 0 ) {
+    return 0;
+  }
+  return tables.exp[ tables.log[ a ] + 255 - tables.log[ b ] ];
+}
+
+uint8_t GF256::inverse( const uint8_t a )
+{
+  return tables.exp[ 255 - tables.log[ a ] ];
+}
+
+/* c times every possible low 4 bits, and every possible high 4 bits
+   (c * x is the XOR of c times x's two halves) */
+static void nibble_products( const uint8_t c, uint8_t * const low, uint8_t * const high )
+{
+  for ( unsigned int x = 0; x < 16; x++ ) {
+    low[ x ] = GF256::multiply( c, x );
+    high[ x ] = GF256::multiply( c, x << 4 );
+  }
+}
+
+static void multiply_add_scalar( uint8_t * const dst, const uint8_t * const src,
+				 const uint8_t c, const size_t length )
+{
+  uint8_t products[ 256 ];
+  for ( unsigned int x = 0; x < 256; x++ ) {
+    products[ x ] = GF256::multiply( c, x );
+  }
+
+  for ( size_t i = 0; i < length; i++ ) {
+    dst[ i ] ^= products[ src[ i ] ];
+  }
+}
+
+static void add_scalar( uint8_t * const dst, const uint8_t * const src, const size_t length )
+{
+  /* a word at a time */
+  size_t i = 0;
+  for ( ; i + sizeof( uint64_t ) <= length; i += sizeof( uint64_t ) ) {
+    uint64_t a, b;
+    memcpy( &a, dst + i, sizeof( a ) );
+    memcpy( &b, src + i, sizeof( b ) );
+    a ^= b;
+    memcpy( dst + i, &a, sizeof( a ) );
+  }
+
+  for ( ; i < length; i++ ) {
+    dst[ i ] ^= src[ i ];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* (each looks up both halves of 16 or 32 bytes at once with a byte shuffle,
+   and leaves the last few bytes to the scalar version) */
+
+__attribute__(( target( "ssse3" ) ))
+static void multiply_add_ssse3( uint8_t * const dst, const uint8_t * const src,
+				const uint8_t c, const size_t length )
+{
+  uint8_t low[ 16 ], high[ 16 ];
+  nibble_products( c, low, high );
+  const __m128i low_table = _mm_loadu_si128( reinterpret_cast< const __m128i * >( low ) );
+  const __m128i high_table = _mm_loadu_si128( reinterpret_cast< const __m128i * >( high ) );
+  const __m128i mask = _mm_set1_epi8( 0x0f );
+
+  size_t i = 0;
+  for ( ; i + 16 <= length; i += 16 ) {
+    const __m128i s = _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) );
+    const __m128i product
+      = _mm_xor_si128( _mm_shuffle_epi8( low_table, _mm_and_si128( s, mask ) ),
+		       _mm_shuffle_epi8( high_table, _mm_and_si128( _mm_srli_epi64( s, 4 ), mask ) ) );
+    __m128i * const d = reinterpret_cast< __m128i * >( dst + i );
+    _mm_storeu_si128( d, _mm_xor_si128( _mm_loadu_si128( d ), product ) );
+  }
+
+  multiply_add_scalar( dst + i, src + i, c, length - i );
+}
+
+__attribute__(( target( "ssse3" ) ))
+static void add_ssse3( uint8_t * const dst, const uint8_t * const src, const size_t length )
+{
+  size_t i = 0;
+  for ( ; i + 16 <= length; i += 16 ) {
+    __m128i * const d = reinterpret_cast< __m128i * >( dst + i );
+    _mm_storeu_si128( d, _mm_xor_si128( _mm_loadu_si128( d ),
+					 _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) ) ) );
+  }
+
+  add_scalar( dst + i, src + i, length - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void multiply_add_avx2( uint8_t * const dst, const uint8_t * const src,
+			       const uint8_t c, const size_t length )
+{
+  uint8_t low[ 16 ], high[ 16 ];
+  nibble_products( c, low, high );
+  /* (the shuffle works within each 128-bit lane, so each lane gets the tables) */
+  const __m256i low_table = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128( reinterpret_cast< const __m128i * >( low ) ) );
+  const __m256i high_table = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128( reinterpret_cast< const __m128i * >( high ) ) );
+  const __m256i mask = _mm256_set1_epi8( 0x0f );
+
+  size_t i = 0;
+  for ( ; i + 32 <= length; i += 32 ) {
+    const __m256i s = _mm256_loadu_si256( reinterpret_cast< const __m256i * >( src + i ) );
+    const __m256i product
+      = _mm256_xor_si256( _mm256_shuffle_epi8( low_table, _mm256_and_si256( s, mask ) ),
+			  _mm256_shuffle_epi8( high_table,
+					       _mm256_and_si256( _mm256_srli_epi64( s, 4 ), mask ) ) );
+    __m256i * const d = reinterpret_cast< __m256i * >( dst + i );
+    _mm256_storeu_si256( d, _mm256_xor_si256( _mm256_loadu_si256( d ), product ) );
+  }
+
+  multiply_add_scalar( dst + i, src + i, c, length - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void add_avx2( uint8_t * const dst, const uint8_t * const src, const size_t length )
+{
+  size_t i = 0;
+  for ( ; i + 32 <= length; i += 32 ) {
+    __m256i * const d = reinterpret_cast< __m256i * >( dst + i );
+    _mm256_storeu_si256( d, _mm256_xor_si256( _mm256_loadu_si256( d ),
+					       _mm256_loadu_si256( reinterpret_cast< const __m256i * >( src + i ) ) ) );
+  }
+
+  add_scalar( dst + i, src + i, length - i );
+}
+
+#endif
+
+/* the region operations this CPU can run fastest */
+struct GF256Implementation
+{
+  const char * name;
+  void (*multiply_add)( uint8_t * const, const uint8_t * const, const uint8_t, const size_t );
+  void (*add)( uint8_t * const, const uint8_t * const, const size_t );
+};
+
+static GF256Implementation choose_implementation()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init(); /* (this runs before main) */
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    return { "avx2", multiply_add_avx2, add_avx2 };
+  }
+  if ( __builtin_cpu_supports( "ssse3" ) ) {
+    return { "ssse3", multiply_add_ssse3, add_ssse3 };
+  }
+#endif
+  return { "scalar", multiply_add_scalar, add_scalar };
+}
+
+static const GF256Implementation region_operations = choose_implementation();
+
+void GF256::multiply_add( uint8_t * const dst, const uint8_t * const src,
+			  const uint8_t c, const size_t length )
+{
+  if ( c == 0 ) {
+    return;
+  } else if ( c == 1 ) {
+    region_operations.add( dst, src, length );
+  } else {
+    region_operations.multiply_add( dst, src, c, length );
+  }
+}
+
+void GF256::add( uint8_t * const dst, const uint8_t * const src, const size_t length )
+{
+  region_operations.add( dst, src, length );
+}
+
+const char * GF256::implementation()
+{
+  return region_operations.name;
+}
@@ -0,0 +1,30 @@
+#ifndef GF256_HH
+#define GF256_HH
+
+#include <cstddef>
+#include <cstdint>
+
+/* Arithmetic in GF(2^8), the field Reed-Solomon codes work in: addition
+   is XOR, and multiplication goes through log/exp tables. The region
+   operations do a whole buffer at a time, with SIMD (AVX2 or SSSE3
+   shuffles over 4-bit halves of each byte) when the CPU has it; which
+   one is picked once, at startup. */
+class GF256
+{
+public:
+  static uint8_t multiply( const uint8_t a, const uint8_t b );
+  static uint8_t divide( const uint8_t a, const uint8_t b ); /* b must not be 0 */
+  static uint8_t inverse( const uint8_t a ); /* a must not be 0 */
+
+  /* dst[ i ] ^= c * src[ i ], for each of length bytes */
+  static void multiply_add( uint8_t * const dst, const uint8_t * const src,
+			    const uint8_t c, const size_t length );
+
+  /* dst[ i ] ^= src[ i ] (multiply_add with c = 1) */
+  static void add( uint8_t * const dst, const uint8_t * const src, const size_t length );
+
+  /* which region implementation this CPU gets ("avx2", "ssse3" or "scalar") */
+  static const char * implementation();
+};
+
+#endif /* GF256_HH */
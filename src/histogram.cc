@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <limits>
+
+#include "histogram.hh"
+
+using namespace std;
+
+Histogram::Histogram()
+  : counts_(),
+    total_count_( 0 ),
+    min_( numeric_limits< uint64_t >::max() ),
+    max_( 0 )
+{}
+
+size_t Histogram::index_of( const uint64_t value )
+{
+  if ( value < 2 * SUB_BUCKETS ) {
+    return value; /* exact */
+  }
+
+  /* position of the highest set bit, and the PRECISION_BITS + 1 bits from there down */
+  const unsigned int magnitude = 63 - __builtin_clzll( value );
+  if ( magnitude >= MAX_BITS ) {
+    return BUCKET_COUNT - 1;
+  }
+
+  const unsigned int shift = magnitude - PRECISION_BITS;
+  return shift * SUB_BUCKETS + (value >> shift);
+}
+
+uint64_t Histogram::value_at( const size_t index )
+{
+  if ( index < 2 * SUB_BUCKETS ) {
+    return index;
+  }
+
+  const unsigned int shift = index / SUB_BUCKETS - 1;
+  const uint64_t sub_bucket = index - shift * SUB_BUCKETS;
+  return (sub_bucket << shift) + ((uint64_t( 1 ) << shift) >> 1);
+}
+
+void Histogram::record( const uint64_t value, const uint32_t count )
+{
+  if ( count == 0 ) {
+    return;
+  }
+
+  counts_[ index_of( value ) ] += count;
+  total_count_ += count;
+  min_ = std::min( min_, value );
+  max_ = std::max( max_, value );
+}
+
+void Histogram::merge( const Histogram & other )
+{
+  if ( other.total_count_ == 0 ) {
+    return;
+  }
+
+  for ( size_t i = 0; i < BUCKET_COUNT; i++ ) {
+    counts_[ i ] += other.counts_[ i ];
+  }
+
+  total_count_ += other.total_count_;
+  min_ = std::min( min_, other.min_ );
+  max_ = std::max( max_, other.max_ );
+}
+
+void Histogram::clear()
+{
+  *this = Histogram();
+}
+
+uint64_t Histogram::percentile( const double percent ) const
+{
+  if ( total_count_ == 0 ) {
+    return 0;
+  }
+
+  /* how many values must be at or below the answer */
+  const uint64_t rank = std::max( uint64_t( 1 ), uint64_t( percent / 100.0 * total_count_ + 0.5 ) );
+
+  uint64_t seen = 0;
+  for ( size_t i = 0; i < BUCKET_COUNT; i++ ) {
+    seen += counts_[ i ];
+    if ( seen >= rank ) {
+      /* (never report beyond what was actually recorded) */
+      return std::min( std::max( value_at( i ), min() ), max_ );
+    }
+  }
+
+  return max_;
+}
+
+string Histogram::summary() const
+{
+  return "p50 " + to_string( percentile( 50 ) )
+    + " p95 " + to_string( percentile( 95 ) )
+    + " p99 " + to_string( percentile( 99 ) )
+    + " max " + to_string( max() );
+}
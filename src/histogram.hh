@@ -0,0 +1,56 @@
+#ifndef HISTOGRAM_HH
+#define HISTOGRAM_HH
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+/* Constant-memory histogram of non-negative integers, HDR-style: values
+   below 2^PRECISION_BITS are counted exactly, and above that each power
+   of two is split into 2^PRECISION_BITS buckets, so any value is known to
+   within about 1.6% of its size. Recording is O(1) (a bit scan and an
+   increment); percentiles walk the buckets, so they're for reports. */
+class Histogram
+{
+public:
+  static const unsigned int PRECISION_BITS = 6;
+  static const unsigned int MAX_BITS = 32; /* larger values are counted as the largest */
+
+private:
+  static const size_t SUB_BUCKETS = size_t( 1 ) << PRECISION_BITS;
+  static const size_t BUCKET_COUNT = (MAX_BITS - PRECISION_BITS + 1) * SUB_BUCKETS;
+
+  std::array< uint32_t, BUCKET_COUNT > counts_;
+  uint64_t total_count_;
+  uint64_t min_, max_;
+
+  static size_t index_of( const uint64_t value );
+
+  /* a value that falls in bucket index (its midpoint) */
+  static uint64_t value_at( const size_t index );
+
+public:
+  Histogram();
+
+  /* count value (count times) */
+  void record( const uint64_t value, const uint32_t count = 1 );
+
+  /* add in everything other has counted */
+  void merge( const Histogram & other );
+
+  /* forget everything counted so far */
+  void clear();
+
+  /* smallest recorded value that percent% of the values are at or below */
+  uint64_t percentile( const double percent ) const;
+
+  /* accessors */
+  uint64_t count() const { return total_count_; }
+  uint64_t min() const { return total_count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+
+  /* e.g. "p50 12 p95 40 p99 85 max 102" */
+  std::string summary() const;
+};
+
+#endif /* HISTOGRAM_HH */
@@ -0,0 +1,513 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "io_uring.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* glibc has no wrappers for the io_uring system calls */
+static int io_uring_setup( const unsigned int entries, io_uring_params & params )
+{
+  return syscall( __NR_io_uring_setup, entries, &params );
+}
+
+static int io_uring_enter( const int fd, const unsigned int to_submit, const unsigned int flags = 0 )
+{
+  return syscall( __NR_io_uring_enter, fd, to_submit, 0, flags, nullptr, 0 );
+}
+
+static int io_uring_register( const int fd, const unsigned int opcode,
+			      void * const arg, const unsigned int nr_args )
+{
+  return syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+/* provided buffer group used by every multishot receive */
+static const uint16_t BUFFER_GROUP = 0;
+
+/* room reserved in each datagram buffer for the source address and control data */
+static const socklen_t RESERVED_NAME_LENGTH = sizeof( sockaddr_storage );
+static const socklen_t RESERVED_CONTROL_LENGTH = 128;
+
+static_assert( sizeof( io_uring_recvmsg_out ) + RESERVED_NAME_LENGTH + RESERVED_CONTROL_LENGTH
+	       <= IOUring::BUFFER_SIZE - 65536, "no room for a 64 KiB datagram" );
+
+IOUring::Mapping::Mapping( const int fd, const off_t offset, const size_t length )
+  : addr_( mmap( nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset ) ),
+    length_( length )
+{
+  if ( addr_ == MAP_FAILED ) {
+    throw unix_error( "mmap (io_uring)" );
+  }
+}
+
+IOUring::Mapping::Mapping( const size_t length )
+  : addr_( mmap( nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) ),
+    length_( length )
+{
+  if ( addr_ == MAP_FAILED ) {
+    throw unix_error( "mmap (io_uring buffers)" );
+  }
+}
+
+IOUring::Mapping::~Mapping()
+{
+  try {
+    SystemCall( "munmap", munmap( addr_, length_ ) );
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+}
+
+IOUring::Operation::Operation( const Type s_type, const int s_fd_num )
+  : type( s_type ), fd_num( s_fd_num ),
+    datagram_handler(), data_handler(),
+    header(), payload_iovec(), destination(), payload(), payload_offset( 0 )
+{}
+
+/* set up the rings (and their shared memory) */
+static int setup_ring( const unsigned int entries, io_uring_params & params )
+{
+  zero( params );
+  return SystemCall( "io_uring_setup", io_uring_setup( entries, params ) );
+}
+
+IOUring::IOUring( const unsigned int entries )
+  : IOUring( entries, io_uring_params() )
+{}
+
+IOUring::IOUring( const unsigned int entries, io_uring_params params )
+  : FileDescriptor( setup_ring( entries, params ) ),
+    params_( params ),
+    sq_ring_(), cq_ring_(), sqes_(),
+    buffer_ring_(), buffers_(),
+    sq_mask_(), cq_mask_(),
+    sq_tail_(), unsubmitted_( 0 ),
+    buffer_ring_tail_( 0 ),
+    operations_(),
+    next_user_data_( 0 ),
+    queued_stream_sends_(),
+    oversized_datagrams_( 0 ),
+    failed_sends_( 0 ),
+    last_send_error_( 0 )
+{
+  /* map the submission and completion rings, and the submission entries */
+  sq_ring_.reset( new Mapping( fd_num(), IORING_OFF_SQ_RING,
+			       params_.sq_off.array + params_.sq_entries * sizeof( unsigned int ) ) );
+  cq_ring_.reset( new Mapping( fd_num(), IORING_OFF_CQ_RING,
+			       params_.cq_off.cqes + params_.cq_entries * sizeof( io_uring_cqe ) ) );
+  sqes_.reset( new Mapping( fd_num(), IORING_OFF_SQES,
+			    params_.sq_entries * sizeof( io_uring_sqe ) ) );
+
+  sq_mask_ = *sq_ring_->at<unsigned int>( params_.sq_off.ring_mask );
+  cq_mask_ = *cq_ring_->at<unsigned int>( params_.cq_off.ring_mask );
+  sq_tail_ = *sq_ring_->at<unsigned int>( params_.sq_off.tail );
+
+  /* register the ring of provided receive buffers, then fill it */
+  buffer_ring_.reset( new Mapping( BUFFER_COUNT * sizeof( io_uring_buf ) ) );
+  buffers_.reset( new Mapping( BUFFER_COUNT * BUFFER_SIZE ) );
+
+  io_uring_buf_reg registration;
+  zero( registration );
+  registration.ring_addr = reinterpret_cast<uint64_t>( buffer_ring_->addr() );
+  registration.ring_entries = BUFFER_COUNT;
+  registration.bgid = BUFFER_GROUP;
+  SystemCall( "io_uring_register (PBUF_RING)",
+	      io_uring_register( fd_num(), IORING_REGISTER_PBUF_RING, &registration, 1 ) );
+
+  for ( unsigned int i = 0; i < BUFFER_COUNT; i++ ) {
+    recycle_buffer( i );
+  }
+}
+
+/* can this kernel run a ring the way we use it? */
+bool IOUring::available()
+{
+  static const bool is_available = [] () {
+    /* multishot recvmsg arrived in Linux 6.0 */
+    utsname name;
+    if ( uname( &name ) != 0 ) {
+      return false;
+    }
+    unsigned int major = 0, minor = 0;
+    if ( sscanf( name.release, "%u.%u", &major, &minor ) != 2 or major < 6 ) {
+      return false;
+    }
+
+    try {
+      IOUring ring( 8 );
+
+      /* check for the opcodes we use */
+      const unsigned int op_count = 256;
+      vector<char> probe_storage( sizeof( io_uring_probe ) + op_count * sizeof( io_uring_probe_op ) );
+      io_uring_probe * const probe = reinterpret_cast<io_uring_probe *>( probe_storage.data() );
+      SystemCall( "io_uring_register (PROBE)",
+		  io_uring_register( ring.fd_num(), IORING_REGISTER_PROBE, probe, op_count ) );
+
+      for ( const unsigned int op : { IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_RECV, IORING_OP_SEND } ) {
+	if ( op > probe->last_op or not ( probe->ops[ op ].flags & IO_URING_OP_SUPPORTED ) ) {
+	  return false;
+	}
+      }
+    } catch ( const exception & e ) {
+      return false;
+    }
+
+    return true;
+  } ();
+
+  return is_available;
+}
+
+/* the process-wide ring */
+IOUring & IOUring::process_ring()
+{
+  static IOUring ring( 256 );
+  return ring;
+}
+
+/* next free submission queue entry */
+io_uring_sqe & IOUring::next_sqe()
+{
+  const unsigned int * const sq_head = sq_ring_->at<unsigned int>( params_.sq_off.head );
+
+  if ( sq_tail_ - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) >= params_.sq_entries ) {
+    submit();
+    if ( sq_tail_ - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) >= params_.sq_entries ) {
+      throw runtime_error( "io_uring submission queue full" );
+    }
+  }
+
+  const unsigned int index = sq_tail_ & sq_mask_;
+  sq_ring_->at<unsigned int>( params_.sq_off.array )[ index ] = index;
+  sq_tail_++;
+  unsubmitted_++;
+
+  io_uring_sqe & sqe = sqes_->at<io_uring_sqe>( 0 )[ index ];
+  zero( sqe );
+  return sqe;
+}
+
+uint64_t IOUring::add_operation( unique_ptr<Operation> && operation )
+{
+  const uint64_t user_data = next_user_data_++;
+  operations_.emplace( user_data, move( operation ) );
+  return user_data;
+}
+
+/* hand queued requests to the kernel */
+void IOUring::submit()
+{
+  if ( not unsubmitted_ ) {
+    return;
+  }
+
+  __atomic_store_n( sq_ring_->at<unsigned int>( params_.sq_off.tail ), sq_tail_, __ATOMIC_RELEASE );
+
+  const int submitted = SystemCall( "io_uring_enter", io_uring_enter( fd_num(), unsubmitted_ ) );
+  unsubmitted_ -= min( unsigned( submitted ), unsubmitted_ );
+}
+
+/* give a provided buffer back to the kernel */
+void IOUring::recycle_buffer( const uint16_t buffer_id )
+{
+  io_uring_buf_ring * const ring = buffer_ring_->at<io_uring_buf_ring>( 0 );
+  io_uring_buf & buffer = buffer_ring_->at<io_uring_buf>( 0 )[ buffer_ring_tail_ & (BUFFER_COUNT - 1) ];
+
+  buffer.addr = reinterpret_cast<uint64_t>( buffers_->addr() + buffer_id * BUFFER_SIZE );
+  buffer.len = BUFFER_SIZE;
+  buffer.bid = buffer_id;
+
+  buffer_ring_tail_++;
+  __atomic_store_n( &ring->tail, buffer_ring_tail_, __ATOMIC_RELEASE );
+}
+
+/* (re)start a multishot receive */
+void IOUring::arm_recv( const uint64_t user_data )
+{
+  Operation & operation = *operations_.at( user_data );
+  io_uring_sqe & sqe = next_sqe();
+
+  if ( operation.type == Operation::Type::RecvDatagrams ) {
+    /* the message header only says how much room to leave for the address
+       and control data at the start of each buffer */
+    sqe.opcode = IORING_OP_RECVMSG;
+    sqe.addr = reinterpret_cast<uint64_t>( &operation.header );
+    sqe.len = 1;
+  } else {
+    sqe.opcode = IORING_OP_RECV;
+  }
+
+  sqe.fd = operation.fd_num;
+  sqe.ioprio = IORING_RECV_MULTISHOT;
+  sqe.flags = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = BUFFER_GROUP;
+  sqe.user_data = user_data;
+}
+
+/* start sending a stream operation's payload from its current offset */
+void IOUring::arm_stream_send( const uint64_t user_data )
+{
+  Operation & operation = *operations_.at( user_data );
+  io_uring_sqe & sqe = next_sqe();
+
+  sqe.opcode = IORING_OP_SEND;
+  sqe.fd = operation.fd_num;
+  sqe.addr = reinterpret_cast<uint64_t>( operation.payload.data() + operation.payload_offset );
+  sqe.len = operation.payload.size() - operation.payload_offset;
+  sqe.msg_flags = MSG_NOSIGNAL;
+  sqe.user_data = user_data;
+}
+
+/* call handler with every datagram that arrives on socket */
+void IOUring::recv_datagrams( UDPSocket & socket, const DatagramHandler & handler )
+{
+  unique_ptr<Operation> operation( new Operation( Operation::Type::RecvDatagrams, socket.fd_num() ) );
+  operation->datagram_handler = handler;
+  operation->header.msg_namelen = RESERVED_NAME_LENGTH;
+  operation->header.msg_controllen = RESERVED_CONTROL_LENGTH;
+
+  arm_recv( add_operation( move( operation ) ) );
+  submit();
+}
+
+/* call handler with the bytes that arrive on a stream */
+void IOUring::recv_stream( FileDescriptor & fd, const DataHandler & handler )
+{
+  unique_ptr<Operation> operation( new Operation( Operation::Type::RecvStream, fd.fd_num() ) );
+  operation->data_handler = handler;
+
+  arm_recv( add_operation( move( operation ) ) );
+  submit();
+}
+
+/* queue a datagram to be sent */
+void IOUring::sendto( UDPSocket & socket, const Address & destination, const string & payload )
+{
+  unique_ptr<Operation> operation( new Operation( Operation::Type::SendDatagram, socket.fd_num() ) );
+  operation->destination = destination;
+  operation->payload = payload;
+  operation->payload_iovec.iov_base = const_cast<char *>( operation->payload.data() );
+  operation->payload_iovec.iov_len = operation->payload.size();
+  operation->header.msg_name = const_cast<sockaddr *>( &operation->destination.to_sockaddr() );
+  operation->header.msg_namelen = operation->destination.size();
+  operation->header.msg_iov = &operation->payload_iovec;
+  operation->header.msg_iovlen = 1;
+
+  const int fd_num = operation->fd_num;
+  const uint64_t user_data = add_operation( move( operation ) );
+
+  io_uring_sqe & sqe = next_sqe();
+  sqe.opcode = IORING_OP_SENDMSG;
+  sqe.fd = fd_num;
+  sqe.addr = reinterpret_cast<uint64_t>( &operations_.at( user_data )->header );
+  sqe.len = 1;
+  sqe.user_data = user_data;
+}
+
+/* queue bytes to be written to a stream, in order */
+void IOUring::send( FileDescriptor & fd, const string & payload )
+{
+  if ( payload.empty() ) {
+    return;
+  }
+
+  /* only one send in flight per fd, so bytes can't be reordered */
+  auto queued = queued_stream_sends_.find( fd.fd_num() );
+  if ( queued != queued_stream_sends_.end() ) {
+    queued->second.push_back( payload );
+    return;
+  }
+  queued_stream_sends_[ fd.fd_num() ];
+
+  unique_ptr<Operation> operation( new Operation( Operation::Type::SendStream, fd.fd_num() ) );
+  operation->payload = payload;
+  arm_stream_send( add_operation( move( operation ) ) );
+}
+
+/* handle every waiting completion, then submit what that produced */
+void IOUring::reap_completions()
+{
+  register_read();
+
+  unsigned int * const cq_head = cq_ring_->at<unsigned int>( params_.cq_off.head );
+  const unsigned int * const cq_tail = cq_ring_->at<unsigned int>( params_.cq_off.tail );
+  const io_uring_cqe * const cqes = cq_ring_->at<io_uring_cqe>( params_.cq_off.cqes );
+
+  const unsigned int * const sq_flags = sq_ring_->at<unsigned int>( params_.sq_off.flags );
+
+  while ( true ) {
+    unsigned int head = *cq_head;
+    while ( head != __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE ) ) {
+      const io_uring_cqe cqe = cqes[ head & cq_mask_ ];
+
+      /* free the slot before running handlers (which may queue more work) */
+      head++;
+      __atomic_store_n( cq_head, head, __ATOMIC_RELEASE );
+
+      complete( cqe );
+    }
+
+    /* completions that didn't fit (e.g. a fast stream filling every buffer)
+       wait in the kernel until asked for, and a multishot receive that
+       overflowed has ended: fetch them, so it gets re-armed */
+    if ( not ( __atomic_load_n( sq_flags, __ATOMIC_ACQUIRE ) & IORING_SQ_CQ_OVERFLOW ) ) {
+      break;
+    }
+    SystemCall( "io_uring_enter (GETEVENTS)", io_uring_enter( fd_num(), 0, IORING_ENTER_GETEVENTS ) );
+  }
+
+  submit();
+}
+
+void IOUring::complete( const io_uring_cqe & cqe )
+{
+  const auto found = operations_.find( cqe.user_data );
+  if ( found == operations_.end() ) {
+    return;
+  }
+
+  Operation & operation = *found->second;
+  const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  switch ( operation.type ) {
+  case Operation::Type::RecvDatagrams:
+  case Operation::Type::RecvStream:
+    {
+      if ( cqe.res < 0 ) {
+	if ( -cqe.res == ENOBUFS ) { /* ran out of buffers; they're back now */
+	  arm_recv( cqe.user_data );
+	  return;
+	}
+	throw unix_error( "io_uring receive", -cqe.res );
+      }
+
+      if ( not ( cqe.flags & IORING_CQE_F_BUFFER ) ) {
+	/* multishot stream receive ended at EOF */
+	if ( operation.type == Operation::Type::RecvStream ) {
+	  const DataHandler handler = operation.data_handler;
+	  operations_.erase( found );
+	  handler( string() );
+	  return;
+	}
+	throw runtime_error( "io_uring receive completed without a buffer" );
+      }
+
+      const uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      char * const buffer = buffers_->addr() + buffer_id * BUFFER_SIZE;
+
+      if ( operation.type == Operation::Type::RecvStream ) {
+	const string data( buffer, cqe.res );
+	recycle_buffer( buffer_id );
+	if ( not more ) {
+	  arm_recv( cqe.user_data );
+	}
+	operation.data_handler( data );
+	return;
+      }
+
+      /* buffer layout: io_uring_recvmsg_out, then address, control data and payload */
+      const io_uring_recvmsg_out * const out = reinterpret_cast<io_uring_recvmsg_out *>( buffer );
+      char * const name = buffer + sizeof( io_uring_recvmsg_out );
+      char * const control = name + operation.header.msg_namelen;
+      const char * const payload = control + operation.header.msg_controllen;
+
+      if ( out->flags & MSG_TRUNC ) { /* (drop it, as it can't be delivered whole) */
+	oversized_datagrams_++;
+	recycle_buffer( buffer_id );
+	if ( not more ) {
+	  arm_recv( cqe.user_data );
+	}
+	return;
+      }
+
+      UDPSocket::received_datagram datagram = { Address( *reinterpret_cast<sockaddr *>( name ),
+							  min( out->namelen, operation.header.msg_namelen ) ),
+						uint64_t( -1 ), uint64_t( -1 ),
+						string( payload, out->payloadlen ),
+						UDPSocket::NotECT };
+
+      msghdr control_header;
+      zero( control_header );
+      control_header.msg_control = control;
+      control_header.msg_controllen = min( out->controllen, socklen_t( operation.header.msg_controllen ) );
+      UDPSocket::decode_control( control_header, datagram );
+
+      recycle_buffer( buffer_id );
+      if ( not more ) {
+	arm_recv( cqe.user_data );
+      }
+      operation.datagram_handler( datagram );
+      return;
+    }
+
+  case Operation::Type::SendDatagram:
+    if ( cqe.res < 0 ) {
+      send_failed( operation, -cqe.res );
+    } else if ( size_t( cqe.res ) != operation.payload.size() ) {
+      send_failed( operation, EMSGSIZE );
+    }
+    operations_.erase( found );
+    return;
+
+  case Operation::Type::SendStream:
+    {
+      if ( cqe.res < 0 ) {
+	send_failed( operation, -cqe.res );
+	operations_.erase( found );
+	return;
+      }
+
+      operation.payload_offset += cqe.res;
+      if ( operation.payload_offset < operation.payload.size() ) {
+	arm_stream_send( cqe.user_data ); /* short write */
+	return;
+      }
+
+      /* done: start the next queued send on this fd, if any */
+      const int fd_num = operation.fd_num;
+      operations_.erase( found );
+
+      auto queued = queued_stream_sends_.find( fd_num );
+      if ( queued->second.empty() ) {
+	queued_stream_sends_.erase( queued );
+	return;
+      }
+
+      unique_ptr<Operation> next( new Operation( Operation::Type::SendStream, fd_num ) );
+      next->payload = move( queued->second.front() );
+      queued->second.pop_front();
+      arm_stream_send( add_operation( move( next ) ) );
+      return;
+    }
+  }
+}
+
+/* a send failed: count it, and forget the rest of its stream
+   (later bytes can't follow ones that were never sent) */
+void IOUring::send_failed( const Operation & operation, const int error )
+{
+  failed_sends_++;
+  last_send_error_ = error;
+
+  if ( operation.type == Operation::Type::SendStream ) {
+    queued_stream_sends_.erase( operation.fd_num );
+  }
+}
+
+/* reap completions whenever the ring's fd is readable in this poller */
+void IOUring::add_to( Poller & poller )
+{
+  poller.add_action( Action( *this, Direction::In, [this] () {
+	reap_completions();
+	return ResultType::Continue;
+      } ) );
+}
@@ -0,0 +1,157 @@
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <linux/io_uring.h>
+
+#include "file_descriptor.hh"
+#include "socket.hh"
+#include "poller.hh"
+
+/* io_uring submission and completion rings: an alternative I/O engine
+   for FileDescriptor, UDPSocket and TCPSocket.
+
+   Receives are multishot (one request keeps delivering data into buffers
+   the kernel picks from a provided-buffer ring). Sends are queued and
+   submitted in a batch, with one io_uring_enter() after each round of
+   completions. Completions are reaped when the ring's fd becomes readable
+   in a Poller. Not thread-safe: use from one event loop. */
+class IOUring : public FileDescriptor
+{
+public:
+  typedef std::function<void(const UDPSocket::received_datagram &)> DatagramHandler;
+  typedef std::function<void(const std::string &)> DataHandler; /* empty string means EOF */
+
+private:
+  /* a region of memory shared with the kernel */
+  class Mapping
+  {
+  private:
+    void * addr_;
+    size_t length_;
+
+  public:
+    Mapping( const int fd, const off_t offset, const size_t length );
+    Mapping( const size_t length ); /* anonymous */
+    ~Mapping();
+
+    char * addr() const { return static_cast<char *>( addr_ ); }
+    template <typename T> T * at( const size_t offset ) const
+    {
+      return reinterpret_cast<T *>( addr() + offset );
+    }
+
+    Mapping( const Mapping & other ) = delete;
+    Mapping & operator=( const Mapping & other ) = delete;
+  };
+
+  /* an outstanding request, found again by its user_data */
+  struct Operation
+  {
+    enum class Type { RecvDatagrams, RecvStream, SendDatagram, SendStream } type;
+    int fd_num;
+    DatagramHandler datagram_handler;
+    DataHandler data_handler;
+
+    /* kept alive until the kernel is done with them */
+    msghdr header;
+    iovec payload_iovec;
+    Address destination;
+    std::string payload;
+    size_t payload_offset;
+
+    Operation( const Type s_type, const int s_fd_num );
+  };
+
+  io_uring_params params_;
+
+  std::unique_ptr<Mapping> sq_ring_, cq_ring_, sqes_;
+  std::unique_ptr<Mapping> buffer_ring_, buffers_;
+
+  unsigned int sq_mask_, cq_mask_;
+  unsigned int sq_tail_; /* local copy, published on submit */
+  unsigned int unsubmitted_;
+  uint16_t buffer_ring_tail_;
+
+  std::unordered_map< uint64_t, std::unique_ptr<Operation> > operations_;
+  uint64_t next_user_data_;
+
+  /* stream sends waiting for the one in flight on their fd (to keep them in order) */
+  std::unordered_map< int, std::deque< std::string > > queued_stream_sends_;
+
+  uint64_t oversized_datagrams_, failed_sends_;
+  int last_send_error_;
+
+  /* a send failed: count it, and forget the rest of its stream */
+  void send_failed( const Operation & operation, const int error );
+
+  IOUring( const unsigned int entries );
+  IOUring( const unsigned int entries, io_uring_params params );
+
+  /* next free submission queue entry (submitting first if the queue is full) */
+  io_uring_sqe & next_sqe();
+
+  uint64_t add_operation( std::unique_ptr<Operation> && operation );
+
+  /* (re)start a multishot receive */
+  void arm_recv( const uint64_t user_data );
+
+  /* start sending a stream operation's payload from its current offset */
+  void arm_stream_send( const uint64_t user_data );
+
+  /* give a provided buffer back to the kernel */
+  void recycle_buffer( const uint16_t buffer_id );
+
+  void complete( const io_uring_cqe & cqe );
+
+public:
+  /* can this kernel run a ring the way we use it
+     (multishot recvmsg, provided buffer rings)? */
+  static bool available();
+
+  /* the process-wide ring, shared by every socket */
+  static IOUring & process_ring();
+
+  /* call handler with every datagram that arrives on socket */
+  void recv_datagrams( UDPSocket & socket, const DatagramHandler & handler );
+
+  /* call handler with the bytes that arrive on a stream (e.g. TCPSocket) */
+  void recv_stream( FileDescriptor & fd, const DataHandler & handler );
+
+  /* queue a datagram to be sent */
+  void sendto( UDPSocket & socket, const Address & destination, const std::string & payload );
+
+  /* queue bytes to be written to a stream, in order */
+  void send( FileDescriptor & fd, const std::string & payload );
+
+  /* hand queued requests to the kernel */
+  void submit();
+
+  /* handle every waiting completion, then submit what that produced */
+  void reap_completions();
+
+  /* reap completions whenever the ring's fd is readable in this poller */
+  void add_to( Poller & poller );
+
+  /* datagrams dropped because they didn't fit in a receive buffer */
+  uint64_t oversized_datagrams() const { return oversized_datagrams_; }
+
+  /* sends the kernel refused (each is dropped, and the program carries on),
+     and the error of the last one */
+  uint64_t failed_sends() const { return failed_sends_; }
+  int last_send_error() const { return last_send_error_; }
+
+  /* room for the largest datagram UDPSocket::recv() takes (64 KiB),
+     after the address and control data that recvmsg puts first */
+  static const size_t BUFFER_SIZE = 65536 + 4096;
+
+  /* number of provided receive buffers */
+  static const unsigned int BUFFER_COUNT = 1024;
+};
+
+#endif /* IO_URING_HH */
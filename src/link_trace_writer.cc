@@ -0,0 +1,37 @@
+#include <algorithm>
+
+#include "link_trace_writer.hh"
+
+using namespace std;
+
+LinkTraceWriter::LinkTraceWriter( const string & path )
+  : file_( path ),
+    started_( false ),
+    start_ns_( 0 ),
+    last_ms_( 0 ),
+    credit_bytes_( 0 )
+{}
+
+void LinkTraceWriter::record_delivery( const size_t bytes, const uint64_t arrival_ns )
+{
+  if ( not started_ ) {
+    started_ = true;
+    start_ns_ = arrival_ns;
+  }
+
+  /* (mahimahi needs the times in order) */
+  const uint64_t ms = max( last_ms_, arrival_ns > start_ns_ ? (arrival_ns - start_ns_) / 1000000 : 0 );
+  last_ms_ = ms;
+
+  credit_bytes_ += bytes;
+  if ( credit_bytes_ < MTU ) {
+    return;
+  }
+
+  const string line = to_string( ms ) + "\n";
+  while ( credit_bytes_ >= MTU ) {
+    file_.append( line );
+    file_.end_record( arrival_ns );
+    credit_bytes_ -= MTU;
+  }
+}
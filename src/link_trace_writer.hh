@@ -0,0 +1,41 @@
+#ifndef LINK_TRACE_WRITER_HH
+#define LINK_TRACE_WRITER_HH
+
+#include <cstdint>
+#include <string>
+
+#include "async_file_writer.hh"
+
+/* Records the deliveries seen on a link as a mahimahi trace, for mm-link
+   to replay: one line per MTU-sized delivery opportunity, giving its time
+   in milliseconds since the first delivery. (A link only shows all its
+   opportunities when the sender keeps it busy.) Streams through an
+   AsyncFileWriter, so memory stays bounded however long the run. */
+class LinkTraceWriter
+{
+public:
+  /* bytes per delivery opportunity, as in mahimahi */
+  static const size_t MTU = 1500;
+
+private:
+  AsyncFileWriter file_;
+  bool started_;
+  uint64_t start_ns_;
+  uint64_t last_ms_;
+  size_t credit_bytes_; /* delivered but not yet a whole opportunity */
+
+public:
+  LinkTraceWriter( const std::string & path );
+
+  /* a packet of bytes (including its IP header) was delivered at arrival_ns */
+  void record_delivery( const size_t bytes, const uint64_t arrival_ns );
+
+  /* hand what's buffered to the writer thread now */
+  void flush() { file_.flush(); }
+
+  /* accessors */
+  uint64_t opportunities() const { return file_.records(); }
+  uint64_t dropped_opportunities() { return file_.dropped_records(); }
+};
+
+#endif /* LINK_TRACE_WRITER_HH */
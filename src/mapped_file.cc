@@ -0,0 +1,45 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapped_file.hh"
+#include "util.hh"
+
+using namespace std;
+
+MappedFile::MappedFile( const string & path )
+  : file_( SystemCall( "open " + path, open( path.c_str(), O_RDONLY | O_CLOEXEC ) ) ),
+    data_( nullptr ),
+    size_( 0 )
+{
+  struct stat file_info;
+  SystemCall( "fstat", fstat( file_.fd_num(), &file_info ) );
+  size_ = file_info.st_size;
+
+  /* (mmap() refuses a length of 0) */
+  if ( size_ == 0 ) {
+    return;
+  }
+
+  void * const addr = mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, file_.fd_num(), 0 );
+  if ( addr == MAP_FAILED ) {
+    throw unix_error( "mmap " + path );
+  }
+  data_ = static_cast< const char * >( addr );
+
+  /* it will be read front to back, once: read ahead aggressively */
+  SystemCall( "madvise", madvise( addr, size_, MADV_SEQUENTIAL ) );
+}
+
+MappedFile::~MappedFile()
+{
+  if ( not data_ ) {
+    return;
+  }
+
+  try {
+    SystemCall( "munmap", munmap( const_cast< char * >( data_ ), size_ ) );
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_HH
+#define MAPPED_FILE_HH
+
+#include <string>
+
+#include "file_descriptor.hh"
+
+/* a whole file mapped read-only into memory, so its contents can be
+   sent straight from the page cache without being read into a buffer */
+class MappedFile
+{
+private:
+  FileDescriptor file_;
+  const char * data_; /* nullptr if the file is empty */
+  size_t size_;
+
+public:
+  MappedFile( const std::string & path );
+  ~MappedFile();
+
+  /* accessors */
+  const char * data() const { return data_; }
+  size_t size() const { return size_; }
+
+  /* forbid copying (the mapping belongs to one object) */
+  MappedFile( const MappedFile & other ) = delete;
+  MappedFile & operator=( const MappedFile & other ) = delete;
+};
+
+#endif /* MAPPED_FILE_HH */
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cstring>
+
+#include <stdexcept>
+
+#include <arpa/inet.h>
+
+#include "pcap_writer.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+/* pcap file format, with nanosecond timestamps */
+static const uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+static const uint32_t LINKTYPE_RAW = 101; /* packets start with an IPv4 or IPv6 header */
+
+struct PcapFileHeader
+{
+  uint32_t magic;
+  uint16_t version_major, version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+};
+
+struct PcapRecordHeader
+{
+  uint32_t ts_sec, ts_nsec;
+  uint32_t incl_len, orig_len;
+};
+
+/* an address as an IPv4 or IPv6 address */
+struct IPAddress
+{
+  bool v4; /* (or an IPv4-mapped IPv6 address) */
+  bool any; /* the wildcard address, which is either */
+  uint8_t bytes[ 16 ]; /* first 4 used if v4 */
+  uint16_t port; /* network byte order */
+};
+
+static IPAddress ip_address( const Address & address )
+{
+  IPAddress ret = IPAddress();
+
+  const sockaddr & addr = address.to_sockaddr();
+  if ( addr.sa_family == AF_INET ) {
+    const sockaddr_in & v4 = reinterpret_cast< const sockaddr_in & >( addr );
+    ret.v4 = true;
+    memcpy( ret.bytes, &v4.sin_addr, 4 );
+    ret.port = v4.sin_port;
+  } else if ( addr.sa_family == AF_INET6 ) {
+    const sockaddr_in6 & v6 = reinterpret_cast< const sockaddr_in6 & >( addr );
+    ret.port = v6.sin6_port;
+    if ( IN6_IS_ADDR_V4MAPPED( &v6.sin6_addr ) ) {
+      ret.v4 = true;
+      memcpy( ret.bytes, v6.sin6_addr.s6_addr + 12, 4 );
+    } else {
+      ret.any = IN6_IS_ADDR_UNSPECIFIED( &v6.sin6_addr );
+      memcpy( ret.bytes, v6.sin6_addr.s6_addr, 16 );
+    }
+  } else {
+    throw runtime_error( "pcap: address is neither IPv4 nor IPv6" );
+  }
+
+  return ret;
+}
+
+/* Internet checksum of an IPv4 header */
+static uint16_t ipv4_checksum( const uint8_t * header, const size_t length )
+{
+  uint32_t sum = 0;
+  for ( size_t i = 0; i < length; i += 2 ) {
+    sum += (header[ i ] << 8) | header[ i + 1 ];
+  }
+  while ( sum >> 16 ) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+/* IPv4 or IPv6 header, then UDP header, for a datagram of payload_length */
+static string ip_udp_headers( const Address & source, const Address & destination,
+			      const size_t payload_length, const uint8_t ecn )
+{
+  IPAddress src = ip_address( source ), dst = ip_address( destination );
+
+  /* the wildcard address (e.g. a socket bound to ::) takes the other side's family */
+  if ( src.any and dst.v4 ) {
+    src.v4 = true;
+  }
+  if ( dst.any and src.v4 ) {
+    dst.v4 = true;
+  }
+
+  const bool v4 = src.v4 and dst.v4;
+  if ( src.v4 != dst.v4 and not v4 ) {
+    throw runtime_error( "pcap: datagram between IPv4 and IPv6 addresses" );
+  }
+
+  const uint16_t udp_length = min( size_t( 0xffff ), payload_length + 8 );
+  uint8_t header[ 48 ] = {};
+  size_t ip_length;
+
+  if ( v4 ) {
+    ip_length = 20;
+    header[ 0 ] = 0x45; /* version 4, 5-word header */
+    header[ 1 ] = ecn; /* TOS (of which ECN is the low two bits) */
+    const uint16_t total_length = htons( min( 0xffff, udp_length + 20 ) );
+    memcpy( header + 2, &total_length, 2 );
+    header[ 8 ] = 64; /* TTL */
+    header[ 9 ] = IPPROTO_UDP;
+    memcpy( header + 12, src.bytes, 4 );
+    memcpy( header + 16, dst.bytes, 4 );
+    const uint16_t checksum = htons( ipv4_checksum( header, 20 ) );
+    memcpy( header + 10, &checksum, 2 );
+  } else {
+    ip_length = 40;
+    header[ 0 ] = 0x60; /* version 6 */
+    header[ 1 ] = ecn << 4; /* traffic class straddles the first two bytes; ECN is its low two bits */
+    const uint16_t payload = htons( udp_length );
+    memcpy( header + 4, &payload, 2 );
+    header[ 6 ] = IPPROTO_UDP;
+    header[ 7 ] = 64; /* hop limit */
+    memcpy( header + 8, src.bytes, 16 );
+    memcpy( header + 24, dst.bytes, 16 );
+  }
+
+  /* UDP (with no checksum) */
+  uint8_t * const udp = header + ip_length;
+  memcpy( udp, &src.port, 2 );
+  memcpy( udp + 2, &dst.port, 2 );
+  const uint16_t length = htons( udp_length );
+  memcpy( udp + 4, &length, 2 );
+
+  return string( reinterpret_cast< const char * >( header ), ip_length + 8 );
+}
+
+PcapWriter::PcapWriter( const string & path, const uint32_t snaplen )
+  : file_( path ),
+    snaplen_( snaplen ? snaplen : 0xffff )
+{
+  const PcapFileHeader header = { PCAP_MAGIC_NS, 2, 4, 0, 0, snaplen_, LINKTYPE_RAW };
+  file_.append( reinterpret_cast< const char * >( &header ), sizeof( header ) );
+  file_.flush();
+}
+
+void PcapWriter::write( const Address & source, const Address & destination,
+			const string & payload, const uint64_t timestamp_ns,
+			const uint8_t ecn )
+{
+  const string headers = ip_udp_headers( source, destination, payload.size(), ecn );
+  const size_t length = headers.size() + payload.size();
+  const size_t captured = min( length, size_t( snaplen_ ) );
+
+  const uint64_t wall_ns = timestamp_epoch_ns() + timestamp_ns;
+  const PcapRecordHeader record = { uint32_t( wall_ns / 1000000000 ), uint32_t( wall_ns % 1000000000 ),
+				    uint32_t( captured ), uint32_t( length ) };
+
+  file_.append( reinterpret_cast< const char * >( &record ), sizeof( record ) );
+  file_.append( headers.data(), min( captured, headers.size() ) );
+  if ( captured > headers.size() ) {
+    file_.append( payload.data(), captured - headers.size() );
+  }
+  file_.end_record( timestamp_ns );
+}
@@ -0,0 +1,42 @@
+#ifndef PCAP_WRITER_HH
+#define PCAP_WRITER_HH
+
+#include <cstdint>
+#include <string>
+
+#include "address.hh"
+#include "async_file_writer.hh"
+
+/* Writes datagrams to a pcap file (readable by tcpdump, Wireshark, etc.),
+   each behind made-up IPv4 or IPv6 and UDP headers built from its
+   addresses. Written through an AsyncFileWriter, so capturing never
+   makes the packet loop wait on the disk. */
+class PcapWriter
+{
+public:
+  /* default snaplen: enough for the IP and UDP headers and a ContestMessage header */
+  static const uint32_t HEADERS_ONLY = 104;
+
+private:
+  AsyncFileWriter file_;
+  uint32_t snaplen_;
+
+public:
+  /* snaplen 0 means whole datagrams */
+  PcapWriter( const std::string & path, const uint32_t snaplen = HEADERS_ONLY );
+
+  /* record a datagram (timestamp_ns is on the timestamp_ns() timeline,
+     and ecn the codepoint it was sent or received with) */
+  void write( const Address & source, const Address & destination,
+	      const std::string & payload, const uint64_t timestamp_ns,
+	      const uint8_t ecn = 0 );
+
+  /* hand what's buffered to the writer thread now */
+  void flush() { file_.flush(); }
+
+  /* accessors */
+  uint64_t packets() const { return file_.records(); }
+  uint64_t dropped_packets() { return file_.dropped_records(); }
+};
+
+#endif /* PCAP_WRITER_HH */
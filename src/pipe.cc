@@ -0,0 +1,31 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pipe.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* make a pipe and return its read end (storing the write end) */
+static int make_pipe( int & write_end )
+{
+  int fds[ 2 ];
+  SystemCall( "pipe2", pipe2( fds, O_NONBLOCK | O_CLOEXEC ) );
+  write_end = fds[ 1 ];
+  return fds[ 0 ];
+}
+
+Pipe::Pipe()
+  : Pipe( 0 )
+{}
+
+Pipe::Pipe( int write_end )
+  : read_end_( make_pipe( write_end ) ),
+    write_end_( write_end ),
+    buffered_( 0 )
+{}
+
+void Pipe::set_capacity( const size_t bytes )
+{
+  SystemCall( "fcntl", fcntl( write_end_.fd_num(), F_SETPIPE_SZ, int( bytes ) ) );
+}
@@ -0,0 +1,31 @@
+#ifndef PIPE_HH
+#define PIPE_HH
+
+#include "file_descriptor.hh"
+
+/* non-blocking pipe, used as the kernel-side buffer when splicing
+   between two sockets (see TCPSocket::splice_to/splice_from) */
+class Pipe
+{
+private:
+  FileDescriptor read_end_, write_end_;
+  size_t buffered_; /* bytes spliced in and not yet out */
+
+  /* opens the pipe (write_end is filled in while read_end_ is constructed) */
+  Pipe( int write_end );
+
+  friend class TCPSocket;
+
+public:
+  Pipe();
+
+  /* ask for a bigger kernel buffer (e.g. to splice more per call) */
+  void set_capacity( const size_t bytes );
+
+  /* accessors */
+  FileDescriptor & read_end() { return read_end_; }
+  FileDescriptor & write_end() { return write_end_; }
+  size_t buffered() const { return buffered_; }
+};
+
+#endif /* PIPE_HH */
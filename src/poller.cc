@@ -4,79 +4,589 @@
 
 #include "poller.hh"
 #include "util.hh"
+#include "timestamp.hh"
+#include "profiler.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
+/* most events collected from one epoll_wait() */
+static const size_t MAX_EPOLL_EVENTS = 1024;
+
+/* the directions that keep the poller going (an action that only
+   services errors has nothing to wait for on its own) */
+static const short READ_WRITE = POLLIN | POLLOUT;
+
+/* phases of poll() that the profiler times */
+static const Profiler::PhaseID INTEREST_PHASE = Profiler::phase( "poller.interest" );
+static const Profiler::PhaseID WAIT_PHASE = Profiler::phase( "poller.wait" );
+static const Profiler::PhaseID ACTION_PHASE = Profiler::phase( "poller.action" );
+static const Profiler::PhaseID TIMER_PHASE = Profiler::phase( "poller.timer" );
+
+Poller::Poller( const Backend s_backend )
+  : backend_( s_backend ),
+    actions_(),
+    free_slots_(),
+    retired_(),
+    pollfds_(),
+    epoll_fd_( s_backend == Backend::Epoll
+	       ? SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) )
+	       : -1 ),
+    registrations_(),
+    dynamic_interest_(),
+    interest_(),
+    ready_events_(),
+    interested_fds_( 0 ),
+    timers_(),
+    timer_queue_(),
+    timerfd_(),
+    next_timer_id_( 0 ),
+    armed_deadline_ns_( 0 ),
+    busy_poll_budget_ns_( 0 ),
+    busy_poll_stats_(),
+    wakeup_stats_()
+{}
+
 void Poller::add_action( Poller::Action action )
 {
-  actions_.push_back( action );
-  pollfds_.push_back( { action.fd.fd_num(), 0, 0 } );
+  const int fd_num = action.fd.fd_num();
+
+  /* reuse a free slot if there is one */
+  size_t index;
+  if ( free_slots_.empty() ) {
+    index = actions_.size();
+    actions_.emplace_back();
+    pollfds_.push_back( { -1, 0, 0 } );
+    interest_.push_back( false );
+  } else {
+    index = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  actions_.at( index ).reset( new Action( action ) );
+
+  if ( backend_ == Backend::Poll ) {
+    pollfds_.at( index ) = { fd_num, 0, 0 };
+    return;
+  }
+
+  interest_.at( index ) = action.interested();
+  if ( action.when_interested ) {
+    dynamic_interest_.push_back( index );
+  }
+
+  auto registration = registrations_.find( fd_num );
+  if ( registration == registrations_.end() ) {
+    epoll_event event;
+    zero( event );
+    event.data.fd = fd_num;
+    SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_ADD, fd_num, &event ) );
+    registration = registrations_.emplace( fd_num, Registration { {}, 0 } ).first;
+  }
+
+  registration->second.actions.push_back( index );
+  update_registration( fd_num );
 }
 
 unsigned int Poller::Action::service_count() const
 {
-  return direction == Direction::In ? fd.read_count() : fd.write_count();
+  return direction == Direction::Out ? fd.write_count() : fd.read_count();
 }
 
-Poller::Result Poller::poll( const int & timeout_ms )
+bool Poller::Action::interested() const
 {
-  assert( pollfds_.size() == actions_.size() );
+  /* don't poll in on fds that have had EOF */
+  if ( direction == Direction::In and fd.eof() ) {
+    return false;
+  }
 
-  /* tell poll whether we care about each fd */
-  for ( unsigned int i = 0; i < actions_.size(); i++ ) {
-    assert( pollfds_.at( i ).fd == actions_.at( i ).fd.fd_num() );
-    pollfds_.at( i ).events = (actions_.at( i ).active and actions_.at( i ).when_interested())
-      ? actions_.at( i ).direction : 0;
+  return active and ( not when_interested or when_interested() );
+}
+
+void Poller::remove_actions( const FileDescriptor & fd )
+{
+  for ( const auto & index : actions_on( fd.fd_num() ) ) {
+    remove_action( index );
+  }
+}
 
-    /* don't poll in on fds that have had EOF */
-    if ( actions_.at( i ).direction == Direction::In
-	 and actions_.at( i ).fd.eof() ) {
-      pollfds_.at( i ).events = 0;
+void Poller::remove_action( const size_t index )
+{
+  const int fd_num = actions_.at( index )->fd.fd_num();
+  const bool dynamic = static_cast<bool>( actions_.at( index )->when_interested );
+
+  retired_.push_back( move( actions_.at( index ) ) );
+  free_slots_.push_back( index );
+
+  if ( backend_ == Backend::Poll ) {
+    pollfds_.at( index ) = { -1, 0, 0 };
+    return;
+  }
+
+  interest_.at( index ) = false;
+  if ( dynamic ) {
+    dynamic_interest_.erase( find( dynamic_interest_.begin(), dynamic_interest_.end(), index ) );
+  }
+
+  Registration & registration = registrations_.at( fd_num );
+  registration.actions.erase( find( registration.actions.begin(),
+				    registration.actions.end(), index ) );
+
+  if ( not registration.actions.empty() ) {
+    update_registration( fd_num );
+    return;
+  }
+
+  /* last action on this fd: stop watching it */
+  if ( registration.events & READ_WRITE ) {
+    interested_fds_--;
+  }
+  registrations_.erase( fd_num );
+  SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_DEL, fd_num, nullptr ) );
+}
+
+vector< size_t > Poller::actions_on( const int fd_num ) const
+{
+  if ( backend_ == Backend::Epoll ) {
+    const auto registration = registrations_.find( fd_num );
+    return registration == registrations_.end() ? vector< size_t >() : registration->second.actions;
+  }
+
+  vector< size_t > ret;
+  for ( size_t i = 0; i < actions_.size(); i++ ) {
+    if ( actions_[ i ] and actions_[ i ]->fd.fd_num() == fd_num ) {
+      ret.push_back( i );
     }
   }
+  return ret;
+}
+
+bool Poller::handles_errors( const int fd_num ) const
+{
+  const auto fd_actions = actions_on( fd_num );
+  return any_of( fd_actions.begin(), fd_actions.end(),
+		 [&] ( const size_t index ) { return actions_[ index ]->direction == Direction::Error; } );
+}
+
+bool Poller::handles_hangups( const int fd_num ) const
+{
+  if ( backend_ == Backend::Epoll ) {
+    return registrations_.at( fd_num ).events & READ_WRITE;
+  }
 
-  /* Quit if no member in pollfds_ has a non-zero direction */
-  if ( not accumulate( pollfds_.begin(), pollfds_.end(), false,
-		       [] ( bool acc, pollfd x ) { return acc or x.events; } ) ) {
+  return any_of( pollfds_.begin(), pollfds_.end(),
+		 [&] ( const pollfd & x ) { return x.fd == fd_num and (x.events & READ_WRITE); } );
+}
+
+/* run an action's callback; returns false if the poller should return */
+bool Poller::run_action( const size_t index, Result & result )
+{
+  Action * const action = actions_.at( index ).get();
+
+  /* an earlier callback this round (e.g. a timer) may have
+     taken away the interest this action was polled with */
+  if ( action->when_interested and not action->interested() ) {
+    return true;
+  }
+
+  const auto count_before = action->service_count();
+  wakeup_stats_.actions_run++;
+  auto action_result = [&] () {
+    ProfileScope profile( ACTION_PHASE );
+    return action->callback();
+  } ();
+
+  /* the callback may have removed its own action (and closed the fd) */
+  const bool removed = actions_.at( index ).get() != action;
+
+  if ( not removed and count_before == action->service_count() ) {
+    throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+  }
+
+  switch ( action_result.result ) {
+  case ResultType::Exit:
+    result = Result( Result::Type::Exit, action_result.exit_status );
+    return false;
+  case ResultType::Cancel:
+    if ( not removed ) {
+      remove_action( index );
+    }
+    break;
+  case ResultType::Continue:
+    break;
+  }
+
+  return true;
+}
+
+/* bring the kernel's interest set for an fd up to date */
+void Poller::update_registration( const int fd_num )
+{
+  Registration & registration = registrations_.at( fd_num );
+
+  uint32_t events = 0;
+  for ( const auto & index : registration.actions ) {
+    if ( interest_.at( index ) ) {
+      events |= actions_.at( index )->direction;
+    }
+  }
+
+  if ( events == registration.events ) {
+    return;
+  }
+
+  epoll_event event;
+  zero( event );
+  event.events = events;
+  event.data.fd = fd_num;
+  SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_MOD, fd_num, &event ) );
+
+  const bool was_interested = registration.events & READ_WRITE;
+  const bool now_interested = events & READ_WRITE;
+  if ( was_interested and not now_interested ) {
+    interested_fds_--;
+  } else if ( now_interested and not was_interested ) {
+    interested_fds_++;
+  }
+
+  registration.events = events;
+}
+
+Poller::Result Poller::poll( const int & timeout_ms )
+{
+  /* work out what we're interested in, and quit if it's nothing */
+  bool interested;
+  {
+    ProfileScope profile( INTEREST_PHASE );
+    interested = backend_ == Backend::Epoll ? prepare_epoll() : prepare_poll();
+  }
+  if ( not interested ) {
+    return Result::Type::Exit;
+  }
+
+  int ready_count;
+  {
+    ProfileScope profile( WAIT_PHASE );
+    ready_count = wait( timeout_ms );
+  }
+  if ( ready_count < 0 ) { /* interrupted by a signal */
     return Result::Type::Exit;
+  } else if ( ready_count == 0 ) {
+    wakeup_stats_.timeouts++;
+    return Result::Type::Timeout;
   }
 
-  try {
-    if ( 0 == SystemCall( "poll", ::poll( &pollfds_[ 0 ], pollfds_.size(), timeout_ms ) ) ) {
-      return Result::Type::Timeout;
+  wakeup_stats_.wakeups++;
+
+  const Result result = backend_ == Backend::Epoll ? dispatch_epoll( ready_count ) : dispatch_poll();
+
+  /* no callback is running now, so removed actions can go */
+  retired_.clear();
+
+  return result;
+}
+
+/* wait for events, spinning first if busy polling; returns the number of ready fds */
+int Poller::wait( const int timeout_ms )
+{
+  if ( busy_poll_budget_ns_ and timeout_ms != 0 ) {
+    const uint64_t spin_start = fast_monotonic_ns();
+    uint64_t spun;
+
+    do {
+      const int ready_count = wait_once( 0 );
+      spun = fast_monotonic_ns() - spin_start;
+      if ( ready_count != 0 ) {
+	busy_poll_stats_.spin_ns += spun;
+	busy_poll_stats_.spin_wakeups++;
+	return ready_count;
+      }
+    } while ( spun < busy_poll_budget_ns_ );
+
+    busy_poll_stats_.spin_ns += spun;
+
+    /* nothing arrived while spinning: fall back to sleeping for the rest */
+    if ( timeout_ms > 0 ) {
+      const uint64_t timeout_ns = uint64_t( timeout_ms ) * 1000000;
+      if ( spun >= timeout_ns ) {
+	return 0;
+      }
+      return sleep( (timeout_ns - spun + 999999) / 1000000 );
     }
-  } catch ( unix_error const& e ) {
-    if ( e.code().value() == EINTR ) {
-      return Result::Type::Exit;
+  }
+
+  return sleep( timeout_ms );
+}
+
+/* block in the kernel, accounting for the time spent idle */
+int Poller::sleep( const int timeout_ms )
+{
+  if ( not busy_poll_budget_ns_ ) {
+    return wait_once( timeout_ms );
+  }
+
+  const uint64_t sleep_start = fast_monotonic_ns();
+  const int ready_count = wait_once( timeout_ms );
+  busy_poll_stats_.idle_ns += fast_monotonic_ns() - sleep_start;
+  busy_poll_stats_.idle_wakeups++;
+
+  return ready_count;
+}
+
+/* one poll()/epoll_wait() call; returns -1 if interrupted by a signal */
+int Poller::wait_once( const int timeout_ms )
+{
+  const int ret = backend_ == Backend::Epoll
+    ? epoll_wait( epoll_fd_.fd_num(), &ready_events_[ 0 ], ready_events_.size(), timeout_ms )
+    : ::poll( &pollfds_[ 0 ], pollfds_.size(), timeout_ms );
+
+  if ( ret < 0 and errno == EINTR ) {
+    return -1;
+  }
+
+  return SystemCall( backend_ == Backend::Epoll ? "epoll_wait" : "poll", ret );
+}
+
+bool Poller::prepare_poll()
+{
+  assert( pollfds_.size() == actions_.size() );
+
+  /* tell poll whether we care about each fd */
+  for ( unsigned int i = 0; i < actions_.size(); i++ ) {
+    if ( not actions_[ i ] ) {
+      continue; /* free slot (poll ignores its fd of -1) */
     }
+    assert( pollfds_.at( i ).fd == actions_.at( i )->fd.fd_num() );
+    pollfds_.at( i ).events = actions_.at( i )->interested() ? actions_.at( i )->direction : 0;
   }
 
+  /* is any member of pollfds_ reading or writing? */
+  return accumulate( pollfds_.begin(), pollfds_.end(), false,
+		     [] ( bool acc, pollfd x ) { return acc or (x.events & READ_WRITE); } );
+}
+
+Poller::Result Poller::dispatch_poll()
+{
   for ( unsigned int i = 0; i < pollfds_.size(); i++ ) {
-    if ( pollfds_[ i ].revents & (POLLERR | POLLHUP | POLLNVAL) ) {
+    short revents = pollfds_[ i ].revents;
+
+    if ( revents & POLLNVAL ) {
       return Result::Type::Exit;
     }
 
-    if ( pollfds_[ i ].revents & pollfds_[ i ].events ) {
+    /* POLLERR can also mean the socket's error queue has data (e.g. send timestamps) */
+    if ( (revents & POLLHUP)
+	 or ( (revents & POLLERR) and not handles_errors( pollfds_[ i ].fd ) ) ) {
+      if ( not handles_hangups( pollfds_[ i ].fd ) ) {
+	return Result::Type::Exit;
+      }
+
+      /* let the reader (or writer) find the EOF or error */
+      revents |= POLLIN | POLLOUT;
+    }
+
+    if ( revents & pollfds_[ i ].events ) {
       /* we only want to call callback if revents includes
 	 the event we asked for */
-      const auto count_before = actions_.at( i ).service_count();
-      auto result = actions_.at( i ).callback();
+      Result result = Result::Type::Success;
+      if ( not run_action( i, result ) ) {
+	return result;
+      }
+    }
+  }
+
+  return Result::Type::Success;
+}
+
+bool Poller::prepare_epoll()
+{
+  /* only actions with a predicate can change interest on their own */
+  for ( const auto & index : dynamic_interest_ ) {
+    const bool interested = actions_.at( index )->interested();
+    if ( interested != interest_.at( index ) ) {
+      interest_.at( index ) = interested;
+      update_registration( actions_.at( index )->fd.fd_num() );
+    }
+  }
+
+  ready_events_.resize( min( registrations_.size(), MAX_EPOLL_EVENTS ) );
+
+  /* does any fd have any interest? */
+  return interested_fds_;
+}
+
+Poller::Result Poller::dispatch_epoll( const int ready_count )
+{
+  for ( int i = 0; i < ready_count; i++ ) {
+    const int fd_num = ready_events_[ i ].data.fd;
+    uint32_t revents = ready_events_[ i ].events;
 
-      if ( count_before == actions_.at( i ).service_count() ) {
-	throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+    /* an earlier callback this round may have removed the fd */
+    const auto registration = registrations_.find( fd_num );
+    if ( registration == registrations_.end() ) {
+      continue;
+    }
+
+    if ( (revents & EPOLLHUP)
+	 or ( (revents & EPOLLERR) and not handles_errors( fd_num ) ) ) {
+      if ( not handles_hangups( fd_num ) ) {
+	return Result::Type::Exit;
       }
 
-      switch ( result.result ) {
-      case ResultType::Exit:
-	return Result( Result::Type::Exit, result.exit_status );
-      case ResultType::Cancel:
-	actions_.at( i ).active = false;
-      case ResultType::Continue:
-	break;
+      /* let the reader (or writer) find the EOF or error */
+      revents |= EPOLLIN | EPOLLOUT;
+    }
+
+    /* copy: callbacks may add and remove actions for this fd */
+    const vector< size_t > fd_actions = registration->second.actions;
+    for ( const auto & index : fd_actions ) {
+      const Action * const action = actions_.at( index ).get();
+      if ( not action or action->fd.fd_num() != fd_num
+	   or not interest_.at( index ) or not ( revents & action->direction ) ) {
+	continue;
+      }
+
+      Result result = Result::Type::Success;
+      const bool keep_going = run_action( index, result );
+
+      /* the callback may have hit EOF (unless it removed itself) */
+      if ( actions_.at( index ).get() == action ) {
+	interest_.at( index ) = action->interested();
+	update_registration( fd_num );
+      }
+
+      if ( not keep_going ) {
+	return result;
       }
     }
   }
 
   return Result::Type::Success;
 }
+
+Poller::TimerID Poller::add_timer( const uint64_t delay_ns,
+				   const Action::CallbackType & callback,
+				   const uint64_t interval_ns )
+{
+  /* first timer: start watching the timerfd */
+  if ( not timerfd_ ) {
+    timerfd_.reset( new TimerFD );
+    add_action( Action( *timerfd_, Direction::In,
+			[this] () { return fire_timers(); },
+			[this] () { return not timers_.empty(); } ) );
+  }
+
+  const TimerID id = next_timer_id_++;
+  const uint64_t deadline = monotonic_ns() + delay_ns;
+
+  timers_.emplace( id, Timer { deadline, interval_ns, callback, 0 } );
+  timer_queue_.push( { deadline, id, 0 } );
+  arm_timerfd();
+
+  return id;
+}
+
+void Poller::reschedule_timer( const TimerID id, const uint64_t delay_ns )
+{
+  auto timer = timers_.find( id );
+  if ( timer == timers_.end() ) {
+    throw runtime_error( "Poller: reschedule of unknown timer" );
+  }
+
+  timer->second.deadline_ns = monotonic_ns() + delay_ns;
+  timer->second.generation++;
+  timer_queue_.push( { timer->second.deadline_ns, id, timer->second.generation } );
+  arm_timerfd();
+}
+
+void Poller::cancel_timer( const TimerID id )
+{
+  timers_.erase( id );
+  arm_timerfd();
+}
+
+/* drop stale entries and arm the timerfd for the earliest timer */
+void Poller::arm_timerfd()
+{
+  while ( not timer_queue_.empty() ) {
+    const TimerEntry & next = timer_queue_.top();
+    const auto timer = timers_.find( next.id );
+    if ( timer != timers_.end() and timer->second.generation == next.generation ) {
+      break;
+    }
+    timer_queue_.pop();
+  }
+
+  if ( timer_queue_.empty() ) {
+    if ( armed_deadline_ns_ ) {
+      timerfd_->disarm();
+      armed_deadline_ns_ = 0;
+    }
+    return;
+  }
+
+  const uint64_t deadline = timer_queue_.top().deadline_ns;
+  if ( deadline == armed_deadline_ns_ ) {
+    return;
+  }
+
+  const uint64_t now = monotonic_ns();
+  timerfd_->arm( deadline > now ? deadline - now : 0 );
+  armed_deadline_ns_ = deadline;
+}
+
+/* run every timer whose deadline has passed */
+Poller::Action::Result Poller::fire_timers()
+{
+  timerfd_->read_expirations();
+  armed_deadline_ns_ = 0;
+
+  const uint64_t now = monotonic_ns();
+
+  while ( not timer_queue_.empty() ) {
+    const TimerEntry next = timer_queue_.top();
+    auto timer = timers_.find( next.id );
+
+    if ( timer == timers_.end() or timer->second.generation != next.generation ) {
+      timer_queue_.pop(); /* cancelled or rescheduled */
+      continue;
+    }
+
+    if ( next.deadline_ns > now ) {
+      break;
+    }
+
+    timer_queue_.pop();
+
+    /* callbacks may add, reschedule or cancel timers, so don't keep references */
+    Action::CallbackType callback;
+    if ( timer->second.interval_ns ) {
+      /* periodic: schedule the next expiration, skipping any we've fallen behind on */
+      Timer & periodic = timer->second;
+      periodic.deadline_ns += periodic.interval_ns;
+      if ( periodic.deadline_ns <= now ) {
+	periodic.deadline_ns = now + periodic.interval_ns;
+      }
+      timer_queue_.push( { periodic.deadline_ns, next.id, periodic.generation } );
+      callback = periodic.callback;
+    } else {
+      callback = move( timer->second.callback );
+      timers_.erase( timer );
+    }
+
+    const auto result = [&] () {
+      ProfileScope profile( TIMER_PHASE );
+      return callback();
+    } ();
+
+    if ( result.result == ResultType::Cancel ) {
+      timers_.erase( next.id );
+    } else if ( result.result == ResultType::Exit ) {
+      arm_timerfd();
+      return result;
+    }
+  }
+
+  arm_timerfd();
+  return ResultType::Continue;
+}
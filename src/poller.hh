@@ -3,10 +3,15 @@
 
 #include <functional>
 #include <vector>
+#include <queue>
+#include <memory>
+#include <unordered_map>
 
 #include <poll.h>
+#include <sys/epoll.h>
 
 #include "file_descriptor.hh"
+#include "timerfd.hh"
 
 class Poller
 {
@@ -24,26 +29,31 @@ public:
     typedef std::function<Result(void)> CallbackType;
 
     FileDescriptor & fd;
-    enum PollDirection : short { In = POLLIN, Out = POLLOUT } direction;
+    enum PollDirection : short { In = POLLIN, Out = POLLOUT, Error = POLLERR } direction;
     CallbackType callback;
-    std::function<bool(void)> when_interested;
+    std::function<bool(void)> when_interested; /* empty means "always" */
     bool active;
 
     Action( FileDescriptor & s_fd,
 	    const PollDirection & s_direction,
 	    const CallbackType & s_callback,
-	    const std::function<bool(void)> & s_when_interested = [] () { return true; } )
+	    const std::function<bool(void)> & s_when_interested = std::function<bool(void)>() )
       : fd( s_fd ), direction( s_direction ), callback( s_callback ),
 	when_interested( s_when_interested ), active( true ) {}
 
     unsigned int service_count() const;
+
+    /* should the poller wait for this action's direction right now? */
+    bool interested() const;
   };
 
-private:
-  std::vector< Action > actions_;
-  std::vector< pollfd > pollfds_;
+  /* how the poller waits for events */
+  enum class Backend {
+    Poll,  /* poll(2): re-examines every action on every call (O(registered)) */
+    Epoll  /* epoll(7): interest kept in the kernel, only ready fds dispatched (O(ready));
+	      can't watch regular files */
+  };
 
-public:
   struct Result
   {
     enum class Type { Success, Timeout, Exit } result;
@@ -52,9 +62,152 @@ public:
       : result( s_result ), exit_status( s_status ) {}
   };
 
-  Poller() : actions_(), pollfds_() {}
+  typedef uint64_t TimerID;
+
+private:
+  Backend backend_;
+
+  /* one slot per action (null once removed, until reused);
+     pointers, so callbacks may add and remove actions */
+  std::vector< std::unique_ptr< Action > > actions_;
+  std::vector< size_t > free_slots_;
+
+  /* removed actions, kept alive until the end of poll() (one may still be running) */
+  std::vector< std::unique_ptr< Action > > retired_;
+
+  /* poll backend: one pollfd per slot (fd -1 if the slot is free) */
+  std::vector< pollfd > pollfds_;
+
+  /* epoll backend: one registration per fd, covering all its actions */
+  struct Registration
+  {
+    std::vector< size_t > actions;
+    uint32_t events;
+  };
+
+  FileDescriptor epoll_fd_;
+  std::unordered_map< int, Registration > registrations_;
+  std::vector< size_t > dynamic_interest_; /* actions with a when_interested predicate */
+  std::vector< bool > interest_; /* last known interest of each action */
+  std::vector< epoll_event > ready_events_;
+  size_t interested_fds_; /* fds some action is reading or writing right now */
+
+  /* timers: a min-heap of deadlines (on the monotonic_ns() timeline),
+     with one timerfd armed for the earliest */
+  struct Timer
+  {
+    uint64_t deadline_ns;
+    uint64_t interval_ns; /* 0 for one-shot */
+    Action::CallbackType callback;
+    uint64_t generation; /* bumped on reschedule, to invalidate old heap entries */
+  };
+
+  struct TimerEntry
+  {
+    uint64_t deadline_ns;
+    TimerID id;
+    uint64_t generation;
+
+    bool operator>( const TimerEntry & other ) const { return deadline_ns > other.deadline_ns; }
+  };
+
+  std::unordered_map< TimerID, Timer > timers_;
+  std::priority_queue< TimerEntry, std::vector< TimerEntry >, std::greater< TimerEntry > > timer_queue_;
+  std::unique_ptr< TimerFD > timerfd_;
+  TimerID next_timer_id_;
+  uint64_t armed_deadline_ns_;
+
+  /* drop cancelled/rescheduled entries and arm the timerfd for the earliest timer */
+  void arm_timerfd();
+
+  /* run every timer whose deadline has passed */
+  Action::Result fire_timers();
+
+  /* does some action take care of POLLERR on this fd (instead of exiting)? */
+  bool handles_errors( const int fd_num ) const;
+
+  /* is some action reading or writing this fd right now
+     (so it will find out about a hangup or error by itself)? */
+  bool handles_hangups( const int fd_num ) const;
+
+  /* the actions registered on an fd */
+  std::vector< size_t > actions_on( const int fd_num ) const;
+
+  /* take an action out of its slot */
+  void remove_action( const size_t index );
+
+  /* run an action's callback and apply its result */
+  bool run_action( const size_t index, Result & result );
+
+  /* epoll backend: bring the kernel's interest set for an fd up to date */
+  void update_registration( const int fd_num );
+
+  /* busy polling: how long to spin before sleeping (0 = never spin) */
+  uint64_t busy_poll_budget_ns_;
+
+public:
+  struct BusyPollStats
+  {
+    uint64_t spin_ns, idle_ns; /* time spent spinning vs. asleep in the kernel */
+    uint64_t spin_wakeups, idle_wakeups; /* events found by each */
+    BusyPollStats() : spin_ns( 0 ), idle_ns( 0 ), spin_wakeups( 0 ), idle_wakeups( 0 ) {}
+  };
+
+  struct WakeupStats
+  {
+    uint64_t wakeups; /* polls that found something to do */
+    uint64_t timeouts; /* polls that waited out their timeout */
+    uint64_t actions_run; /* callbacks run (including timers) */
+    WakeupStats() : wakeups( 0 ), timeouts( 0 ), actions_run( 0 ) {}
+  };
+
+private:
+  BusyPollStats busy_poll_stats_;
+  WakeupStats wakeup_stats_;
+
+  /* wait for events, spinning first if busy polling; returns the number of ready fds */
+  int wait( const int timeout_ms );
+  int sleep( const int timeout_ms );
+  int wait_once( const int timeout_ms );
+
+  /* per-backend halves of poll(): compute interest, then run callbacks */
+  bool prepare_poll();
+  Result dispatch_poll();
+  bool prepare_epoll();
+  Result dispatch_epoll( const int ready_count );
+
+public:
+  Poller( const Backend s_backend = Backend::Poll );
   void add_action( Action action );
   Result poll( const int & timeout_ms );
+
+  /* remove every action on fd (e.g. before closing a connection);
+     safe to call from a callback, including one of the fd's own */
+  void remove_actions( const FileDescriptor & fd );
+
+  /* run callback once, delay_ns from now, then every interval_ns if nonzero
+     (a callback returning Cancel stops a periodic timer; Exit stops the poller) */
+  TimerID add_timer( const uint64_t delay_ns,
+		     const Action::CallbackType & callback,
+		     const uint64_t interval_ns = 0 );
+
+  /* move a timer's next deadline to delay_ns from now */
+  void reschedule_timer( const TimerID id, const uint64_t delay_ns );
+
+  /* stop a timer (no effect if it already finished) */
+  void cancel_timer( const TimerID id );
+
+  Backend backend() const { return backend_; }
+
+  /* spin (checking for events without sleeping) for up to budget_ns
+     before each blocking wait; 0 turns busy polling off */
+  void set_busy_poll( const uint64_t budget_ns ) { busy_poll_budget_ns_ = budget_ns; }
+  const BusyPollStats & busy_poll_stats() const { return busy_poll_stats_; }
+  const WakeupStats & wakeup_stats() const { return wakeup_stats_; }
+
+  /* actions and timers refer back to the poller */
+  Poller( const Poller & other ) = delete;
+  Poller & operator=( const Poller & other ) = delete;
 };
 
 namespace PollerShortNames {
@@ -63,6 +216,7 @@ namespace PollerShortNames {
   typedef Poller::Action::PollDirection Direction;
   typedef Poller::Action Action;
   typedef Poller::Result::Type PollResult;
+  typedef Poller::Backend PollerBackend;
 }
 
 #endif /* POLLER_HH */
@@ -0,0 +1,167 @@
+#include <iomanip>
+
+#include "profiler.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+atomic< bool > Profiler::enabled_( false );
+
+mutex & Profiler::registry_mutex()
+{
+  static mutex the_mutex;
+  return the_mutex;
+}
+
+vector< unique_ptr< Profiler::ThreadProfile > > & Profiler::thread_profiles()
+{
+  static vector< unique_ptr< ThreadProfile > > profiles;
+  return profiles;
+}
+
+Profiler::Node::Node( const PhaseID s_phase, const size_t s_parent )
+  : phase( s_phase ), parent( s_parent ), children(), cycles(), total_cycles( 0 ), child_cycles( 0 )
+{}
+
+Profiler::ThreadProfile::ThreadProfile()
+  : nodes(), current( 0 )
+{
+  nodes.emplace_back( 0, 0 ); /* root */
+}
+
+Profiler::ThreadProfile & Profiler::thread_profile()
+{
+  static thread_local ThreadProfile * profile = nullptr;
+
+  if ( not profile ) {
+    unique_lock< mutex > lock( registry_mutex() );
+    thread_profiles().emplace_back( new ThreadProfile );
+    profile = thread_profiles().back().get();
+  }
+
+  return *profile;
+}
+
+vector< string > & Profiler::phase_names()
+{
+  static vector< string > names;
+  return names;
+}
+
+Profiler::PhaseID Profiler::phase( const string & name )
+{
+  unique_lock< mutex > lock( registry_mutex() );
+
+  auto & names = phase_names();
+  for ( size_t i = 0; i < names.size(); i++ ) {
+    if ( names[ i ] == name ) {
+      return i;
+    }
+  }
+
+  names.push_back( name );
+  return names.size() - 1;
+}
+
+void ProfileScope::begin( const Profiler::PhaseID phase )
+{
+  Profiler::ThreadProfile & profile = Profiler::thread_profile();
+
+  /* find (or add) this phase under the current one */
+  size_t node = 0;
+  for ( const size_t child : profile.nodes[ profile.current ].children ) {
+    if ( profile.nodes[ child ].phase == phase ) {
+      node = child;
+      break;
+    }
+  }
+
+  if ( node == 0 ) {
+    node = profile.nodes.size();
+    profile.nodes.emplace_back( phase, profile.current );
+    profile.nodes[ profile.current ].children.push_back( node );
+  }
+
+  profile.current = node;
+  start_ = cycle_count();
+}
+
+void ProfileScope::end()
+{
+  const uint64_t elapsed = cycle_count() - start_;
+
+  Profiler::ThreadProfile & profile = Profiler::thread_profile();
+  Profiler::Node & node = profile.nodes[ profile.current ];
+  node.cycles.record( elapsed );
+  node.total_cycles += elapsed;
+
+  profile.current = node.parent;
+  profile.nodes[ profile.current ].child_cycles += elapsed;
+}
+
+string Profiler::path( const ThreadProfile & profile, const size_t node )
+{
+  if ( node == 0 ) {
+    return "";
+  }
+
+  const string parent_path = path( profile, profile.nodes[ node ].parent );
+  return (parent_path.empty() ? "" : parent_path + ";") + phase_names()[ profile.nodes[ node ].phase ];
+}
+
+void Profiler::report( ostream & out )
+{
+  unique_lock< mutex > lock( registry_mutex() );
+
+  /* each phase's samples, wherever it ran */
+  const auto & names = phase_names();
+  vector< Histogram > cycles( names.size() );
+  vector< uint64_t > total_cycles( names.size() );
+  for ( const auto & profile : thread_profiles() ) {
+    for ( size_t i = 1; i < profile->nodes.size(); i++ ) {
+      const Node & node = profile->nodes[ i ];
+      cycles[ node.phase ].merge( node.cycles );
+      total_cycles[ node.phase ] += node.total_cycles;
+    }
+  }
+
+  const double ns_per = ns_per_cycle();
+  const auto old_flags = out.flags();
+  const auto old_precision = out.precision();
+
+  out << left << setw( 24 ) << "phase" << right << setw( 12 ) << "samples" << setw( 12 ) << "total ms"
+      << setw( 10 ) << "p50 ns" << setw( 10 ) << "p99 ns" << setw( 12 ) << "max ns" << endl;
+  out << fixed << setprecision( 1 );
+
+  for ( size_t phase = 0; phase < names.size(); phase++ ) {
+    if ( cycles[ phase ].count() == 0 ) {
+      continue;
+    }
+
+    out << left << setw( 24 ) << names[ phase ] << right
+	<< setw( 12 ) << cycles[ phase ].count()
+	<< setw( 12 ) << total_cycles[ phase ] * ns_per / 1e6
+	<< setw( 10 ) << uint64_t( cycles[ phase ].percentile( 50 ) * ns_per )
+	<< setw( 10 ) << uint64_t( cycles[ phase ].percentile( 99 ) * ns_per )
+	<< setw( 12 ) << uint64_t( cycles[ phase ].max() * ns_per ) << endl;
+  }
+
+  out.flags( old_flags );
+  out.precision( old_precision );
+}
+
+void Profiler::write_collapsed( ostream & out )
+{
+  unique_lock< mutex > lock( registry_mutex() );
+
+  const double ns_per = ns_per_cycle();
+  for ( const auto & profile : thread_profiles() ) {
+    for ( size_t i = 1; i < profile->nodes.size(); i++ ) {
+      const Node & node = profile->nodes[ i ];
+      const uint64_t self_cycles = node.total_cycles > node.child_cycles
+	? node.total_cycles - node.child_cycles : 0;
+      out << path( *profile, i ) << " " << uint64_t( self_cycles * ns_per ) << "\n";
+    }
+  }
+  out << flush;
+}
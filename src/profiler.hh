@@ -0,0 +1,112 @@
+#ifndef PROFILER_HH
+#define PROFILER_HH
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "histogram.hh"
+
+/* Opt-in profiler that times named phases of the program in CPU cycles.
+   Time a phase with a ProfileScope; scopes nest, and every sample is
+   filed under its whole path of phases (e.g. poller.action;controller.tick).
+   Each thread keeps its own samples, so timing takes no locks. When
+   not enabled, a ProfileScope costs one well-predicted branch. */
+class Profiler
+{
+public:
+  typedef uint16_t PhaseID;
+
+private:
+  /* one place in a thread's tree of nested phases */
+  struct Node
+  {
+    PhaseID phase;
+    size_t parent;
+    std::vector< size_t > children;
+    Histogram cycles; /* per sample */
+    uint64_t total_cycles, child_cycles;
+
+    Node( const PhaseID s_phase, const size_t s_parent );
+  };
+
+  /* one thread's samples (node 0 is the root, outside any phase) */
+  struct ThreadProfile
+  {
+    std::vector< Node > nodes;
+    size_t current; /* the innermost phase running now */
+
+    ThreadProfile();
+  };
+
+  static std::atomic< bool > enabled_;
+
+  /* the calling thread's profile */
+  static ThreadProfile & thread_profile();
+
+  /* guards phase names and the list of threads' profiles */
+  static std::mutex & registry_mutex();
+
+  /* every thread's profile (kept after the thread exits, for the report) */
+  static std::vector< std::unique_ptr< ThreadProfile > > & thread_profiles();
+
+  /* names of phases so far (index is the PhaseID) */
+  static std::vector< std::string > & phase_names();
+
+  /* path of phases from the root to node, separated by semicolons */
+  static std::string path( const ThreadProfile & profile, const size_t node );
+
+  friend class ProfileScope;
+
+public:
+  /* the id for phase name (the same each time, so call it once and keep it) */
+  static PhaseID phase( const std::string & name );
+
+  /* start timing phases */
+  static void enable() { enabled_.store( true, std::memory_order_relaxed ); }
+  static bool enabled() { return enabled_.load( std::memory_order_relaxed ); }
+
+  /* table of every phase (over every path and thread): samples, total, and
+     nanoseconds per sample at p50/p99/max; call once the threads are done */
+  static void report( std::ostream & out );
+
+  /* "collapsed stack" lines (path, then self time in ns) as read by flamegraph.pl */
+  static void write_collapsed( std::ostream & out );
+};
+
+/* times phase from construction until destruction (if profiling is enabled) */
+class ProfileScope
+{
+private:
+  bool active_;
+  uint64_t start_;
+
+  void begin( const Profiler::PhaseID phase );
+  void end();
+
+public:
+  ProfileScope( const Profiler::PhaseID phase )
+    : active_( Profiler::enabled() ), start_( 0 )
+  {
+    if ( active_ ) {
+      begin( phase );
+    }
+  }
+
+  ~ProfileScope()
+  {
+    if ( active_ ) {
+      end();
+    }
+  }
+
+  /* forbid copying or assigning */
+  ProfileScope( const ProfileScope & other ) = delete;
+  ProfileScope & operator=( const ProfileScope & other ) = delete;
+};
+
+#endif /* PROFILER_HH */
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "read_buffer.hh"
+
+using namespace std;
+
+ReadBuffer::ReadBuffer( const size_t initial_capacity )
+  : storage_( initial_capacity ),
+    begin_( 0 ),
+    end_( 0 )
+{}
+
+void ReadBuffer::consume( const size_t length )
+{
+  if ( length > size() ) {
+    throw out_of_range( "ReadBuffer: consumed more than was read" );
+  }
+
+  begin_ += length;
+
+  /* everything consumed: start over at the front for free */
+  if ( begin_ == end_ ) {
+    clear();
+  }
+}
+
+char * ReadBuffer::prepare( const size_t length )
+{
+  if ( writable() < length ) {
+    /* first try moving the unread bytes to the front */
+    if ( begin_ ) {
+      memmove( storage_.data(), data(), size() );
+      end_ -= begin_;
+      begin_ = 0;
+    }
+
+    /* then grow (geometrically, so appends stay amortized O(1)) */
+    if ( writable() < length ) {
+      storage_.resize( max( end_ + length, 2 * storage_.size() ) );
+    }
+  }
+
+  return storage_.data() + end_;
+}
+
+void ReadBuffer::commit( const size_t length )
+{
+  if ( length > writable() ) {
+    throw out_of_range( "ReadBuffer: committed more than was prepared" );
+  }
+
+  end_ += length;
+}
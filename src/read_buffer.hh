@@ -0,0 +1,44 @@
+#ifndef READ_BUFFER_HH
+#define READ_BUFFER_HH
+
+#include <string>
+#include <vector>
+
+/* growable byte buffer that a FileDescriptor reads into and a parser
+   consumes from in place: bytes are appended at the back and consumed
+   from the front, and the memory is kept and reused from read to read.
+   Unread bytes are always contiguous (they're moved to the front,
+   rather than wrapping around, when the back runs out of room). */
+class ReadBuffer
+{
+private:
+  std::vector< char > storage_;
+  size_t begin_, end_; /* unread bytes are storage_[ begin_, end_ ) */
+
+public:
+  ReadBuffer( const size_t initial_capacity = 4096 );
+
+  /* the unread bytes */
+  const char * data() const { return storage_.data() + begin_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+  std::string str() const { return std::string( data(), size() ); }
+
+  /* done with the first length unread bytes */
+  void consume( const size_t length );
+  void clear() { begin_ = end_ = 0; }
+
+  /* make room for at least length more bytes after the unread ones,
+     and return where they go (commit() them once written) */
+  char * prepare( const size_t length );
+
+  /* room after the unread bytes, without moving or growing */
+  size_t writable() const { return storage_.size() - end_; }
+
+  /* the next length bytes after the unread ones have been filled in */
+  void commit( const size_t length );
+
+  size_t capacity() const { return storage_.size(); }
+};
+
+#endif /* READ_BUFFER_HH */
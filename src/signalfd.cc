@@ -0,0 +1,46 @@
+#include <unistd.h>
+
+#include "signalfd.hh"
+#include "util.hh"
+
+using namespace std;
+
+SignalMask::SignalMask( const initializer_list< int > signals )
+  : mask_()
+{
+  SystemCall( "sigemptyset", sigemptyset( &mask_ ) );
+
+  for ( const auto & signal : signals ) {
+    SystemCall( "sigaddset", sigaddset( &mask_, signal ) );
+  }
+}
+
+/* block these signals for the calling thread */
+void SignalMask::set_as_mask() const
+{
+  const int ret = pthread_sigmask( SIG_BLOCK, &mask_, nullptr );
+  if ( ret ) {
+    throw unix_error( "pthread_sigmask", ret );
+  }
+}
+
+SignalFD::SignalFD( const SignalMask & signals )
+  : FileDescriptor( SystemCall( "signalfd",
+				signalfd( -1, &signals.mask(), SFD_NONBLOCK | SFD_CLOEXEC ) ) )
+{}
+
+/* read one pending signal */
+signalfd_siginfo SignalFD::read_signal()
+{
+  signalfd_siginfo info;
+  zero( info );
+
+  const ssize_t bytes_read = SystemCall( "read (signalfd)", ::read( fd_num(), &info, sizeof( info ) ) );
+  if ( bytes_read != sizeof( info ) ) {
+    throw runtime_error( "signalfd read size mismatch" );
+  }
+
+  register_read();
+
+  return info;
+}
@@ -0,0 +1,36 @@
+#ifndef SIGNALFD_HH
+#define SIGNALFD_HH
+
+#include <initializer_list>
+
+#include <signal.h>
+#include <sys/signalfd.h>
+
+#include "file_descriptor.hh"
+
+/* wrapper class for Unix signal masks */
+class SignalMask
+{
+private:
+  sigset_t mask_;
+
+public:
+  SignalMask( const std::initializer_list< int > signals );
+
+  const sigset_t & mask() const { return mask_; }
+
+  /* block these signals for the calling thread (and threads it creates later) */
+  void set_as_mask() const;
+};
+
+/* wrapper class for signal file descriptors: signals become readable events */
+class SignalFD : public FileDescriptor
+{
+public:
+  SignalFD( const SignalMask & signals );
+
+  /* read one pending signal */
+  signalfd_siginfo read_signal();
+};
+
+#endif /* SIGNALFD_HH */
@@ -1,4 +1,11 @@
+#include <cstring>
+
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include "socket.hh"
 #include "util.hh"
@@ -7,8 +14,10 @@
 using namespace std;
 
 /* default constructor for socket of (subclassed) domain and type */
-Socket::Socket( const int domain, const int type )
-  : FileDescriptor( SystemCall( "socket", socket( domain, type, 0 ) ) )
+Socket::Socket( const int domain, const int type, const BlockingMode mode )
+  : FileDescriptor( SystemCall( "socket", socket( domain,
+						  type | (mode == NonBlocking ? SOCK_NONBLOCK : 0),
+						  0 ) ) )
 {}
 
 /* construct from file descriptor */
@@ -59,6 +68,12 @@ Address Socket::peer_address() const
   return get_address( "getpeername", getpeername );
 }
 
+/* shut down one or both directions of the socket */
+void Socket::shutdown( const int how )
+{
+  SystemCall( "shutdown", ::shutdown( fd_num(), how ) );
+}
+
 /* bind socket to a specified local address (usually to listen/accept) */
 void Socket::bind( const Address & address )
 {
@@ -75,8 +90,46 @@ void Socket::connect( const Address & address )
 				    address.size() ) );
 }
 
+/* connect without waiting, finishing from the poller */
+void Socket::connect( const Address & address, Poller & poller, const ConnectHandler & handler )
+{
+  const int ret = ::connect( fd_num(), &address.to_sockaddr(), address.size() );
+  if ( ret < 0 and errno != EINPROGRESS ) {
+    throw unix_error( "connect" );
+  }
+
+  /* writable means the handshake finished, one way or the other
+     (even if it already has, the handler still runs from the poller) */
+  poller.add_action( Poller::Action( *this, Poller::Action::Out, [this, &poller, handler] () {
+	int error;
+	socklen_t len = sizeof( error );
+	SystemCall( "getsockopt", getsockopt( fd_num(), SOL_SOCKET, SO_ERROR, &error, &len ) );
+	register_write();
+
+	/* done with this action (and the handler may destroy us) */
+	poller.remove_actions( *this );
+	const ConnectHandler completion = handler;
+	completion( error );
+	return Poller::Action::Result();
+      } ) );
+}
+
 /* receive datagram and where it came from */
 UDPSocket::received_datagram UDPSocket::recv()
+{
+  received_datagram ret = { Address(), uint64_t( -1 ), uint64_t( -1 ), string(), NotECT };
+  recv( ret, 0 );
+  return ret;
+}
+
+/* receive a datagram if one is already waiting */
+bool UDPSocket::try_recv( received_datagram & datagram )
+{
+  return recv( datagram, MSG_DONTWAIT );
+}
+
+/* receive with recvmsg() flags */
+bool UDPSocket::recv( received_datagram & datagram, const int flags )
 {
   static const ssize_t RECEIVE_MTU = 65536;
 
@@ -103,8 +156,11 @@ UDPSocket::received_datagram UDPSocket::recv()
   header.msg_controllen = sizeof( msg_control );
 
   /* call recvmsg */
-  ssize_t recv_len = SystemCall( "recvmsg",
-				 recvmsg( fd_num(), &header, 0 ) );
+  const ssize_t recv_len = recvmsg( fd_num(), &header, flags );
+  if ( recv_len < 0 and (flags & MSG_DONTWAIT) and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return false;
+  }
+  SystemCall( "recvmsg", recv_len );
 
   register_read();
 
@@ -115,25 +171,40 @@ UDPSocket::received_datagram UDPSocket::recv()
     throw runtime_error( "recvfrom (unhandled flag)" );
   }
 
-  uint64_t timestamp = -1;
+  datagram.source_address = Address( datagram_source_address, header.msg_namelen );
+  datagram.payload.assign( msg_payload, recv_len );
+  decode_control( header, datagram );
+
+  return true;
+}
 
-  /* find the timestamp header (if there is one) */
+/* fill in a received datagram's timestamps and ECN codepoint from the message's control data */
+void UDPSocket::decode_control( msghdr & header, received_datagram & datagram )
+{
+  datagram.timestamp = datagram.timestamp_ns = -1;
+  datagram.ecn = NotECT;
+
+  /* find the timestamp and TOS/traffic class headers (if there are any) */
   cmsghdr *ts_hdr = CMSG_FIRSTHDR( &header );
   while ( ts_hdr ) {
     if ( ts_hdr->cmsg_level == SOL_SOCKET
 	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
       const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( ts_hdr ) );
-      timestamp = timestamp_ms( *kernel_time );
+      datagram.timestamp = timestamp_ms( *kernel_time );
+      datagram.timestamp_ns = timestamp_ns( *kernel_time );
+    } else if ( ts_hdr->cmsg_level == IPPROTO_IP
+		and ts_hdr->cmsg_type == IP_TOS ) {
+      /* (IPv4, including IPv4-mapped on our IPv6 sockets: one byte) */
+      datagram.ecn = ECN( *CMSG_DATA( ts_hdr ) & 3 );
+    } else if ( ts_hdr->cmsg_level == IPPROTO_IPV6
+		and ts_hdr->cmsg_type == IPV6_TCLASS ) {
+      /* (IPv6: an int) */
+      int traffic_class;
+      memcpy( &traffic_class, CMSG_DATA( ts_hdr ), sizeof( traffic_class ) );
+      datagram.ecn = ECN( traffic_class & 3 );
     }
     ts_hdr = CMSG_NXTHDR( &header, ts_hdr );
   }
-
-  received_datagram ret = { Address( datagram_source_address,
-				     header.msg_namelen ),
-			    timestamp,
-			    string( msg_payload, recv_len ) };
-
-  return ret;
 }
 
 /* send datagram to specified address */
@@ -147,7 +218,7 @@ void UDPSocket::sendto( const Address & destination, const string & payload )
 				    &destination.to_sockaddr(),
 				    destination.size() ) );
 
-  register_write();
+  register_send();
 
   if ( size_t( bytes_sent ) != payload.size() ) {
     throw runtime_error( "datagram payload too big for sendto()" );
@@ -163,13 +234,103 @@ void UDPSocket::send( const string & payload )
 				payload.size(),
 				0 ) );
 
-  register_write();
+  register_send();
 
   if ( size_t( bytes_sent ) != payload.size() ) {
     throw runtime_error( "datagram payload too big for send()" );
   }
 }
 
+/* send one datagram gathered from several pieces of memory */
+void UDPSocket::send( const iovec * const pieces, const size_t count )
+{
+  msghdr header;
+  zero( header );
+  header.msg_iov = const_cast<iovec *>( pieces );
+  header.msg_iovlen = count;
+
+  const ssize_t bytes_sent = SystemCall( "sendmsg", ::sendmsg( fd_num(), &header, 0 ) );
+
+  register_send();
+
+  size_t length = 0;
+  for ( size_t i = 0; i < count; i++ ) {
+    length += pieces[ i ].iov_len;
+  }
+
+  if ( size_t( bytes_sent ) != length ) {
+    throw runtime_error( "datagram payload too big for sendmsg()" );
+  }
+}
+
+/* account for a datagram handed to the kernel */
+void UDPSocket::register_send()
+{
+  register_write();
+
+  if ( send_timestamps_enabled_ ) {
+    next_send_id_++;
+  }
+}
+
+/* collect send timestamps waiting on the error queue */
+vector<UDPSocket::send_completion> UDPSocket::recv_send_completions()
+{
+  vector<send_completion> ret;
+
+  while ( true ) {
+    msghdr header; zero( header );
+    char msg_control[ 512 ];
+    header.msg_control = msg_control;
+    header.msg_controllen = sizeof( msg_control );
+
+    const ssize_t recv_len = recvmsg( fd_num(), &header, MSG_ERRQUEUE | MSG_DONTWAIT );
+    if ( recv_len < 0 ) {
+      if ( errno != EAGAIN and errno != EWOULDBLOCK ) {
+	throw unix_error( "recvmsg (MSG_ERRQUEUE)" );
+      }
+
+      /* POLLERR with an empty error queue means a pending socket error */
+      if ( ret.empty() ) {
+	int socket_error = 0;
+	socklen_t len = sizeof( socket_error );
+	SystemCall( "getsockopt", getsockopt( fd_num(), SOL_SOCKET, SO_ERROR, &socket_error, &len ) );
+	if ( socket_error ) {
+	  throw unix_error( "socket error", socket_error );
+	}
+      }
+      break;
+    }
+
+    register_read();
+
+    const timespec * kernel_time = nullptr;
+    const sock_extended_err * error = nullptr;
+
+    for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &header ); cmsg; cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+      if ( cmsg->cmsg_level == SOL_SOCKET
+	   and cmsg->cmsg_type == SCM_TIMESTAMPING ) {
+	/* software timestamp is in the first slot */
+	kernel_time = &reinterpret_cast<const scm_timestamping *>( CMSG_DATA( cmsg ) )->ts[ 0 ];
+      } else if ( (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_RECVERR)
+		  or (cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_RECVERR) ) {
+	error = reinterpret_cast<const sock_extended_err *>( CMSG_DATA( cmsg ) );
+      }
+    }
+
+    /* skip anything on the error queue that isn't a send timestamp */
+    if ( not kernel_time or not error
+	 or error->ee_errno != ENOMSG
+	 or error->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
+      continue;
+    }
+
+    ret.push_back( { error->ee_data, timestamp_ms( *kernel_time ), timestamp_ns( *kernel_time ) } );
+  }
+
+  return ret;
+}
+
 /* mark the socket as listening for incoming connections */
 void TCPSocket::listen( const int backlog )
 {
@@ -177,10 +338,87 @@ void TCPSocket::listen( const int backlog )
 }
 
 /* accept a new incoming connection */
-TCPSocket TCPSocket::accept()
+TCPSocket TCPSocket::accept( const BlockingMode mode )
 {
   register_read();
-  return TCPSocket( FileDescriptor( SystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) ) );
+  return TCPSocket( FileDescriptor( SystemCall( "accept4",
+						::accept4( fd_num(), nullptr, nullptr,
+							   mode == NonBlocking ? SOCK_NONBLOCK : 0 ) ) ) );
+}
+
+/* drain the backlog of a non-blocking listener */
+size_t TCPSocket::accept_all( const function<void(TCPSocket &&)> & handler,
+			      const BlockingMode mode )
+{
+  register_read();
+
+  size_t count = 0;
+  while ( true ) {
+    const int ret = ::accept4( fd_num(), nullptr, nullptr,
+			       mode == NonBlocking ? SOCK_NONBLOCK : 0 );
+    if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+      return count; /* backlog is empty */
+    }
+    if ( ret < 0 and errno == ECONNABORTED ) {
+      continue; /* gone before we got to it */
+    }
+
+    handler( TCPSocket( FileDescriptor( SystemCall( "accept4", ret ) ) ) );
+    count++;
+  }
+}
+
+/* send part of a file without copying it through userspace */
+size_t TCPSocket::sendfile( FileDescriptor & file, off_t & offset, const size_t count )
+{
+  const ssize_t ret = ::sendfile( fd_num(), file.fd_num(), &offset, count );
+  register_write();
+
+  if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return 0; /* non-blocking and no room */
+  }
+
+  return SystemCall( "sendfile", ret );
+}
+
+/* move received bytes into a pipe without copying them through userspace */
+size_t TCPSocket::splice_to( Pipe & pipe, const size_t count )
+{
+  const ssize_t ret = ::splice( fd_num(), nullptr, pipe.write_end().fd_num(), nullptr,
+				count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+  register_read();
+
+  if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return 0; /* nothing waiting (or the pipe is full) */
+  }
+
+  const size_t bytes_moved = SystemCall( "splice", ret );
+  if ( bytes_moved == 0 ) {
+    set_eof();
+  }
+
+  pipe.buffered_ += bytes_moved;
+  return bytes_moved;
+}
+
+/* send bytes waiting in a pipe without copying them through userspace */
+size_t TCPSocket::splice_from( Pipe & pipe, const size_t count )
+{
+  if ( pipe.buffered() == 0 ) {
+    return 0;
+  }
+
+  const ssize_t ret = ::splice( pipe.read_end().fd_num(), nullptr, fd_num(), nullptr,
+				min( count, pipe.buffered() ), SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+  register_write();
+
+  if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return 0; /* non-blocking and no room */
+  }
+
+  const size_t bytes_moved = SystemCall( "splice", ret );
+  pipe.buffered_ -= bytes_moved;
+  return bytes_moved;
 }
 
 /* set socket option */
@@ -197,8 +435,70 @@ void Socket::set_reuseaddr()
   setsockopt( SOL_SOCKET, SO_REUSEADDR, int( true ) );
 }
 
+/* allow several sockets to bind the same address and port */
+void Socket::set_reuseport()
+{
+  setsockopt( SOL_SOCKET, SO_REUSEPORT, int( true ) );
+}
+
+/* choose which socket of this one's SO_REUSEPORT group gets each packet */
+void Socket::attach_reuseport_cbpf( const vector< sock_filter > & program )
+{
+  sock_fprog fprog;
+  fprog.len = program.size();
+  fprog.filter = const_cast< sock_filter * >( program.data() );
+
+  setsockopt( SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, fprog );
+}
+
+/* send and receive only through one network interface */
+void Socket::set_bindtodevice( const string & interface )
+{
+  SystemCall( "setsockopt SO_BINDTODEVICE " + interface,
+	      ::setsockopt( fd_num(), SOL_SOCKET, SO_BINDTODEVICE,
+			    interface.c_str(), interface.size() ) );
+}
+
+/* spin on the device queue in blocking receives before sleeping */
+void Socket::set_busy_poll( const unsigned int usec )
+{
+  setsockopt( SOL_SOCKET, SO_BUSY_POLL, int( usec ) );
+#ifdef SO_PREFER_BUSY_POLL
+  setsockopt( SOL_SOCKET, SO_PREFER_BUSY_POLL, int( true ) );
+#endif
+}
+
 /* turn on timestamps on receipt */
 void UDPSocket::set_timestamps()
 {
   setsockopt( SOL_SOCKET, SO_TIMESTAMPNS, int( true ) );
 }
+
+/* send every datagram with an ECN codepoint */
+void UDPSocket::set_ecn( const ECN codepoint )
+{
+  /* (the socket is IPv6, but may also carry IPv4-mapped traffic, which takes the TOS) */
+  setsockopt( IPPROTO_IPV6, IPV6_TCLASS, int( codepoint ) );
+  setsockopt( IPPROTO_IP, IP_TOS, int( codepoint ) );
+}
+
+/* report each received datagram's ECN codepoint */
+void UDPSocket::set_recv_ecn()
+{
+  setsockopt( IPPROTO_IPV6, IPV6_RECVTCLASS, int( true ) );
+  setsockopt( IPPROTO_IP, IP_RECVTOS, int( true ) );
+}
+
+/* turn on kernel timestamps of when each sent datagram left the host */
+void UDPSocket::set_send_timestamps()
+{
+  const unsigned int flags = SOF_TIMESTAMPING_TX_SOFTWARE  /* generate on send */
+    | SOF_TIMESTAMPING_SOFTWARE                             /* report software timestamps */
+    | SOF_TIMESTAMPING_OPT_ID                               /* tag each with a counter */
+    | SOF_TIMESTAMPING_OPT_TSONLY;                          /* don't loop back the payload */
+
+  setsockopt( SOL_SOCKET, SO_TIMESTAMPING, flags );
+
+  send_timestamps_enabled_ = true;
+  next_send_id_ = 0;
+}
@@ -2,13 +2,25 @@
 #define SOCKET_HH
 
 #include <functional>
+#include <vector>
+
+#include <linux/filter.h>
 
 #include "address.hh"
 #include "file_descriptor.hh"
+#include "pipe.hh"
+#include "poller.hh"
 
 /* class for network sockets (UDP, TCP, etc.) */
 class Socket : public FileDescriptor
 {
+public:
+  /* whether calls on the socket wait (the default) or return at once */
+  enum BlockingMode { Blocking, NonBlocking };
+
+  /* learns how an asynchronous connect() ended (0, or an errno value) */
+  typedef std::function<void(const int error)> ConnectHandler;
+
 private:
   /* get the local or peer address the socket is connected to */
   Address get_address( const std::string & name_of_function,
@@ -16,7 +28,7 @@ private:
 
 protected:
   /* default constructor */
-  Socket( const int domain, const int type );
+  Socket( const int domain, const int type, const BlockingMode mode = Blocking );
 
   /* construct from file descriptor */
   Socket( FileDescriptor && s_fd, const int domain, const int type );
@@ -32,37 +44,114 @@ public:
   /* connect socket to a specified peer address */
   void connect( const Address & address );
 
+  /* connect a NonBlocking socket without waiting: handler runs from poller
+     once the connection is up or has failed. Any actions on the socket are
+     removed just before, so add the connected socket's actions (or destroy
+     the socket) from the handler. */
+  void connect( const Address & address, Poller & poller, const ConnectHandler & handler );
+
+  /* shut down reading (SHUT_RD), writing (SHUT_WR) or both (SHUT_RDWR) */
+  void shutdown( const int how );
+
   /* accessors */
   Address local_address() const;
   Address peer_address() const;
 
   /* allow local address to be reused sooner, at the cost of some robustness */
   void set_reuseaddr();
+
+  /* allow several sockets (e.g. one per thread) to bind the same address and port,
+     with the kernel spreading incoming flows across them */
+  void set_reuseport();
+
+  /* choose which socket of this one's SO_REUSEPORT group gets each packet
+     (the classic BPF program returns an index in bind order) */
+  void attach_reuseport_cbpf( const std::vector< sock_filter > & program );
+
+  /* send and receive only through the named network interface (e.g. "wlan0"),
+     whatever the routing table says */
+  void set_bindtodevice( const std::string & interface );
+
+  /* have blocking receives spin on the device queue for up to usec
+     before sleeping (raising it above the sysctl default needs CAP_NET_ADMIN) */
+  void set_busy_poll( const unsigned int usec );
 };
 
 /* UDP socket */
 class UDPSocket : public Socket
 {
 public:
-  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ) {}
+  /* ECN codepoints (the low two bits of the IPv4 TOS or IPv6 traffic class) */
+  enum ECN : uint8_t { NotECT = 0, ECT1 = 1, ECT0 = 2, CE = 3 };
 
   struct received_datagram {
     Address source_address;
-    uint64_t timestamp;
+    uint64_t timestamp; /* milliseconds, as from timestamp_ms() */
+    uint64_t timestamp_ns; /* same, at the kernel's full precision */
     std::string payload;
+    ECN ecn; /* as it arrived (NotECT unless set_recv_ecn() was called) */
   };
 
+private:
+  bool send_timestamps_enabled_;
+
+  /* id the kernel will give the next sent datagram's send timestamp */
+  uint32_t next_send_id_;
+
+  /* account for a datagram handed to the kernel */
+  void register_send();
+
+  /* receive with recvmsg() flags; returns false if nothing was waiting */
+  bool recv( received_datagram & datagram, const int flags );
+
+public:
+  UDPSocket( const BlockingMode mode = Blocking )
+    : Socket( AF_INET6, SOCK_DGRAM, mode ), send_timestamps_enabled_( false ), next_send_id_( 0 ) {}
+
   /* receive datagram, timestamp, and where it came from */
   received_datagram recv();
 
+  /* receive a datagram if one is already waiting (never blocks) */
+  bool try_recv( received_datagram & datagram );
+
+  /* fill in a received datagram's timestamps and ECN codepoint from the
+     message's control data (for datagrams received by other means, e.g. IOUring) */
+  static void decode_control( msghdr & header, received_datagram & datagram );
+
   /* send datagram to specified address */
   void sendto( const Address & peer, const std::string & payload );
 
   /* send datagram to connected address */
   void send( const std::string & payload );
 
+  /* send one datagram gathered from count pieces of memory (to connected address) */
+  void send( const iovec * const pieces, const size_t count );
+
   /* turn on timestamps on receipt */
   void set_timestamps();
+
+  /* send every datagram with this ECN codepoint (ECT0 or ECT1 says the
+     transport will react to CE marks, so routers may mark instead of dropping) */
+  void set_ecn( const ECN codepoint );
+
+  /* turn on reporting of each received datagram's ECN codepoint */
+  void set_recv_ecn();
+
+  /* turn on kernel (software) timestamps of when each sent datagram
+     actually left the host; these arrive later on the error queue */
+  void set_send_timestamps();
+
+  struct send_completion {
+    uint32_t send_id; /* matches send_id() at the time of the send */
+    uint64_t timestamp; /* milliseconds, as from timestamp_ms() */
+    uint64_t timestamp_ns; /* same, at the kernel's full precision */
+  };
+
+  /* id that the next send()/sendto() will be reported with */
+  uint32_t send_id() const { return next_send_id_; }
+
+  /* collect send timestamps waiting on the error queue (never blocks) */
+  std::vector<send_completion> recv_send_completions();
 };
 
 /* TCP socket */
@@ -73,13 +162,32 @@ private:
   TCPSocket( FileDescriptor && fd ) : Socket( std::move( fd ), AF_INET6, SOCK_STREAM ) {}
 
 public:
-  TCPSocket() : Socket( AF_INET6, SOCK_STREAM ) {}
+  TCPSocket( const BlockingMode mode = Blocking ) : Socket( AF_INET6, SOCK_STREAM, mode ) {}
 
   /* mark the socket as listening for incoming connections */
   void listen( const int backlog = 16 );
 
-  /* accept a new incoming connection */
-  TCPSocket accept();
+  /* accept a new incoming connection (which blocks, or not, as mode says) */
+  TCPSocket accept( const BlockingMode mode = Blocking );
+
+  /* accept every connection waiting on a NonBlocking listener, handing each
+     to handler; returns how many there were */
+  size_t accept_all( const std::function<void(TCPSocket &&)> & handler,
+		     const BlockingMode mode = NonBlocking );
+
+  /* The zero-copy methods below move bytes inside the kernel, never
+     through userspace. Each returns the number of bytes moved, which is
+     0 if a non-blocking socket had no room (or, for splice_to(), no data;
+     eof() tells these apart). */
+
+  /* send up to count bytes of file from offset, advancing offset past what was sent */
+  size_t sendfile( FileDescriptor & file, off_t & offset, const size_t count );
+
+  /* move up to count bytes received on this socket into pipe */
+  size_t splice_to( Pipe & pipe, const size_t count );
+
+  /* send up to count of the bytes waiting in pipe */
+  size_t splice_from( Pipe & pipe, const size_t count );
 };
 
 #endif /* SOCKET_HH */
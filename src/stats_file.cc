@@ -0,0 +1,131 @@
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats_file.hh"
+#include "util.hh"
+
+using namespace std;
+
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2,
+	       "the sequence count must be lock-free to be shared between processes" );
+
+static const char STATS_MAGIC[ 8 ] = { 'D', 'G', 'S', 'T', 'A', 'T', 'S', '1' };
+
+/* map the whole file */
+static void * map_file( const FileDescriptor & file, const size_t length, const bool writable )
+{
+  void * const addr = mmap( nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			    MAP_SHARED, file.fd_num(), 0 );
+  if ( addr == MAP_FAILED ) {
+    throw unix_error( "mmap (stats file)" );
+  }
+  return addr;
+}
+
+StatsFile::StatsFile( const string & path, const vector< string > & names )
+  : file_( SystemCall( "open " + path,
+		       open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) ),
+    layout_( nullptr ),
+    writable_( true )
+{
+  if ( names.size() > MAX_METRICS ) {
+    throw runtime_error( "too many metrics for a stats file" );
+  }
+
+  SystemCall( "ftruncate", ftruncate( file_.fd_num(), sizeof( Layout ) ) );
+  layout_ = static_cast< Layout * >( map_file( file_, sizeof( Layout ), true ) );
+
+  /* (the new file is all zeroes, so the sequence count already reads 0) */
+  layout_->metric_count = names.size();
+  for ( size_t i = 0; i < names.size(); i++ ) {
+    strncpy( layout_->names[ i ], names[ i ].c_str(), NAME_LENGTH - 1 );
+  }
+
+  /* the magic goes last, so a reader never sees it before the names */
+  atomic_thread_fence( memory_order_release );
+  memcpy( layout_->magic, STATS_MAGIC, sizeof( STATS_MAGIC ) );
+}
+
+StatsFile::StatsFile( const string & path )
+  : file_( SystemCall( "open " + path, open( path.c_str(), O_RDONLY | O_CLOEXEC ) ) ),
+    layout_( nullptr ),
+    writable_( false )
+{
+  struct stat file_info;
+  SystemCall( "fstat", fstat( file_.fd_num(), &file_info ) );
+  if ( file_info.st_size < off_t( sizeof( Layout ) ) ) {
+    throw runtime_error( path + ": not a stats file" );
+  }
+
+  layout_ = static_cast< Layout * >( map_file( file_, sizeof( Layout ), false ) );
+
+  if ( memcmp( layout_->magic, STATS_MAGIC, sizeof( STATS_MAGIC ) )
+       or layout_->metric_count > MAX_METRICS ) {
+    SystemCall( "munmap", munmap( layout_, sizeof( Layout ) ) );
+    throw runtime_error( path + ": not a stats file" );
+  }
+}
+
+StatsFile::~StatsFile()
+{
+  try {
+    SystemCall( "munmap", munmap( layout_, sizeof( Layout ) ) );
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+}
+
+void StatsFile::publish( const vector< double > & values )
+{
+  if ( not writable_ ) {
+    throw runtime_error( "stats file opened for reading" );
+  }
+
+  if ( values.size() != layout_->metric_count ) {
+    throw runtime_error( "wrong number of values for stats file" );
+  }
+
+  const uint64_t sequence = layout_->sequence.load( memory_order_relaxed );
+  layout_->sequence.store( sequence + 1, memory_order_relaxed ); /* odd: update in progress */
+  atomic_thread_fence( memory_order_release );
+
+  timespec now;
+  SystemCall( "clock_gettime", clock_gettime( CLOCK_REALTIME, &now ) );
+  layout_->publish_time_ms = uint64_t( now.tv_sec ) * 1000 + now.tv_nsec / 1000000;
+  copy( values.begin(), values.end(), layout_->values );
+
+  layout_->sequence.store( sequence + 2, memory_order_release );
+}
+
+StatsFile::Snapshot StatsFile::read() const
+{
+  Snapshot snapshot = { 0, 0, {}, {} };
+
+  const size_t count = layout_->metric_count;
+  for ( size_t i = 0; i < count; i++ ) {
+    snapshot.names.emplace_back( layout_->names[ i ], strnlen( layout_->names[ i ], NAME_LENGTH ) );
+  }
+  snapshot.values.resize( count );
+
+  while ( true ) {
+    const uint64_t before = layout_->sequence.load( memory_order_acquire );
+    if ( before % 2 ) {
+      this_thread::yield(); /* the publisher is mid-update */
+      continue;
+    }
+
+    snapshot.publish_time_ms = layout_->publish_time_ms;
+    copy( layout_->values, layout_->values + count, snapshot.values.begin() );
+
+    atomic_thread_fence( memory_order_acquire );
+    if ( layout_->sequence.load( memory_order_relaxed ) == before ) {
+      snapshot.sequence = before;
+      return snapshot;
+    }
+  }
+}
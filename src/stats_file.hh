@@ -0,0 +1,69 @@
+#ifndef STATS_FILE_HH
+#define STATS_FILE_HH
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "file_descriptor.hh"
+
+/* A set of named numbers that one process publishes through a
+   memory-mapped file and any other can watch (e.g. with statstail).
+   Publishing is a handful of stores: no system calls and no locks.
+   A sequence count guards each update (a "seqlock"): it's odd while
+   the values are being written, so a reader that sees it odd, or
+   changed by the time it's done copying, just tries again. */
+class StatsFile
+{
+public:
+  static const size_t MAX_METRICS = 32;
+  static const size_t NAME_LENGTH = 32; /* including the terminating NUL */
+
+  /* what a reader sees */
+  struct Snapshot
+  {
+    uint64_t sequence; /* goes up by 2 with each update */
+    uint64_t publish_time_ms; /* wall clock (ms since the epoch) */
+    std::vector< std::string > names;
+    std::vector< double > values;
+  };
+
+private:
+  /* the file's contents */
+  struct Layout
+  {
+    char magic[ 8 ];
+    uint32_t metric_count;
+    uint32_t reserved;
+    std::atomic< uint64_t > sequence;
+    uint64_t publish_time_ms;
+    char names[ MAX_METRICS ][ NAME_LENGTH ];
+    double values[ MAX_METRICS ];
+  };
+
+  FileDescriptor file_;
+  Layout * layout_;
+  bool writable_;
+
+public:
+  /* create (or replace) the file at path, to publish the named metrics */
+  StatsFile( const std::string & path, const std::vector< std::string > & names );
+
+  /* open an existing stats file to read */
+  StatsFile( const std::string & path );
+
+  ~StatsFile();
+
+  /* replace the values (one per name, in the same order) */
+  void publish( const std::vector< double > & values );
+
+  /* a consistent copy of the latest values */
+  Snapshot read() const;
+
+  /* forbid copying or assigning */
+  StatsFile( const StatsFile & other ) = delete;
+  StatsFile & operator=( const StatsFile & other ) = delete;
+};
+
+#endif /* STATS_FILE_HH */
@@ -0,0 +1,51 @@
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "timerfd.hh"
+#include "util.hh"
+
+using namespace std;
+
+TimerFD::TimerFD()
+  : FileDescriptor( SystemCall( "timerfd_create",
+				timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) )
+{}
+
+/* expire once, delay_ns from now */
+void TimerFD::arm( const uint64_t delay_ns )
+{
+  itimerspec spec;
+  zero( spec );
+  spec.it_value.tv_sec = delay_ns / 1000000000;
+  spec.it_value.tv_nsec = delay_ns % 1000000000;
+
+  if ( delay_ns == 0 ) {
+    spec.it_value.tv_nsec = 1;
+  }
+
+  SystemCall( "timerfd_settime", timerfd_settime( fd_num(), 0, &spec, nullptr ) );
+}
+
+/* stop the timer */
+void TimerFD::disarm()
+{
+  itimerspec spec;
+  zero( spec );
+  SystemCall( "timerfd_settime", timerfd_settime( fd_num(), 0, &spec, nullptr ) );
+}
+
+/* number of expirations since the last read */
+uint64_t TimerFD::read_expirations()
+{
+  uint64_t expirations = 0;
+
+  /* re-arming resets the count, so a readable timer can turn out empty */
+  const ssize_t bytes_read = ::read( fd_num(), &expirations, sizeof( expirations ) );
+  if ( bytes_read < 0 and errno != EAGAIN ) {
+    throw unix_error( "read (timerfd)" );
+  }
+
+  register_read();
+
+  return bytes_read == sizeof( expirations ) ? expirations : 0;
+}
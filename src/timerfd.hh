@@ -0,0 +1,24 @@
+#ifndef TIMERFD_HH
+#define TIMERFD_HH
+
+#include <cstdint>
+
+#include "file_descriptor.hh"
+
+/* timer that becomes readable when it expires (CLOCK_MONOTONIC) */
+class TimerFD : public FileDescriptor
+{
+public:
+  TimerFD();
+
+  /* expire once, delay_ns from now (0 disarms, so the minimum is 1 ns) */
+  void arm( const uint64_t delay_ns );
+
+  /* stop the timer */
+  void disarm();
+
+  /* number of expirations since the last read (0 if none; never blocks) */
+  uint64_t read_expirations();
+};
+
+#endif /* TIMERFD_HH */
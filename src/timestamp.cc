@@ -1,5 +1,10 @@
 #include <ctime>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 #include "timestamp.hh"
 #include "util.hh"
 
@@ -9,18 +14,32 @@ static const uint64_t MILLION = 1000000;
 /* nanoseconds per second */
 static const uint64_t BILLION = 1000 * MILLION;
 
+/* how long to spin when calibrating the TSC against CLOCK_MONOTONIC */
+static const uint64_t TSC_CALIBRATION_NS = 10 * MILLION;
+
 /* helper functions */
-static timespec current_time()
+static timespec current_time( const clockid_t clock = CLOCK_REALTIME )
 {
   timespec ret;
-  SystemCall( "clock_gettime", clock_gettime( CLOCK_REALTIME, &ret ) );
+  SystemCall( "clock_gettime", clock_gettime( clock, &ret ) );
   return ret;
 }
 
-static uint64_t timestamp_ms_raw( const timespec & ts )
+static uint64_t timestamp_ns_raw( const timespec & ts )
+{
+  return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+static uint64_t realtime_epoch_ns()
+{
+  const static uint64_t EPOCH = timestamp_ns_raw( current_time() );
+  return EPOCH;
+}
+
+static uint64_t monotonic_epoch_ns()
 {
-  const uint64_t nanos = ts.tv_sec * BILLION + ts.tv_nsec;
-  return nanos / MILLION;
+  const static uint64_t EPOCH = timestamp_ns_raw( current_time( CLOCK_MONOTONIC ) );
+  return EPOCH;
 }
 
 /* Current time in milliseconds since the start of the program */
@@ -31,6 +50,164 @@ uint64_t timestamp_ms()
 
 uint64_t timestamp_ms( const timespec & ts )
 {
-  const static uint64_t EPOCH = timestamp_ms_raw( current_time() );
-  return timestamp_ms_raw( ts ) - EPOCH;
+  return timestamp_ns( ts ) / MILLION;
+}
+
+/* Same timeline as timestamp_ms(), at full precision
+   (times from before the first call, when the epoch is taken, are 0) */
+uint64_t timestamp_ns()
+{
+  realtime_epoch_ns(); /* (taken first, so now isn't before it) */
+  return timestamp_ns( current_time() );
+}
+
+uint64_t timestamp_ns( const timespec & ts )
+{
+  const uint64_t epoch = realtime_epoch_ns();
+  const uint64_t raw = timestamp_ns_raw( ts );
+  return raw > epoch ? raw - epoch : 0;
+}
+
+uint64_t timestamp_epoch_ns()
+{
+  return realtime_epoch_ns();
+}
+
+/* Monotonic time since the start of the program */
+uint64_t monotonic_ns()
+{
+  const uint64_t epoch = monotonic_epoch_ns();
+  return timestamp_ns_raw( current_time( CLOCK_MONOTONIC ) ) - epoch;
+}
+
+uint64_t monotonic_us()
+{
+  return monotonic_ns() / 1000;
+}
+
+uint64_t monotonic_ms()
+{
+  return monotonic_ns() / MILLION;
+}
+
+/* Map a CLOCK_REALTIME timespec onto the monotonic timeline
+   (by measuring how far in the past it was on the wall clock) */
+uint64_t monotonic_ns( const timespec & realtime_ts )
+{
+  const uint64_t now_monotonic = monotonic_ns();
+  const uint64_t now_realtime = timestamp_ns_raw( current_time() );
+  const uint64_t then_realtime = timestamp_ns_raw( realtime_ts );
+
+  if ( then_realtime >= now_realtime ) {
+    return now_monotonic;
+  }
+
+  const uint64_t age = now_realtime - then_realtime;
+  return age > now_monotonic ? 0 : now_monotonic - age;
+}
+
+/* rate at which the TSC ticks, calibrated against CLOCK_MONOTONIC */
+class TSCCalibration
+{
+private:
+  bool usable_;
+  uint64_t base_tsc_;
+  uint64_t base_ns_;
+  double ns_per_tick_;
+
+  static bool has_invariant_tsc()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if ( not __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) ) {
+      return false;
+    }
+    return edx & (1 << 8);
+#else
+    return false;
+#endif
+  }
+
+public:
+  TSCCalibration()
+    : usable_( has_invariant_tsc() ),
+      base_tsc_( 0 ),
+      base_ns_( 0 ),
+      ns_per_tick_( 0 )
+  {
+    if ( not usable_ ) {
+      return;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    const uint64_t start_ns = monotonic_ns();
+    const uint64_t start_tsc = __rdtsc();
+
+    uint64_t end_ns;
+    do {
+      end_ns = monotonic_ns();
+    } while ( end_ns - start_ns < TSC_CALIBRATION_NS );
+    const uint64_t end_tsc = __rdtsc();
+
+    if ( end_tsc <= start_tsc ) {
+      usable_ = false;
+      return;
+    }
+
+    base_tsc_ = end_tsc;
+    base_ns_ = end_ns;
+    ns_per_tick_ = double( end_ns - start_ns ) / double( end_tsc - start_tsc );
+#endif
+  }
+
+  bool usable() const { return usable_; }
+  double ns_per_tick() const { return ns_per_tick_; }
+
+  uint64_t now_ns() const
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    const uint64_t tsc = __rdtsc();
+    if ( tsc <= base_tsc_ ) {
+      return base_ns_;
+    }
+    return base_ns_ + uint64_t( double( tsc - base_tsc_ ) * ns_per_tick_ );
+#else
+    return monotonic_ns();
+#endif
+  }
+};
+
+static const TSCCalibration & tsc_calibration()
+{
+  const static TSCCalibration calibration;
+  return calibration;
+}
+
+/* Cheap monotonic clock for hot loops */
+uint64_t fast_monotonic_ns()
+{
+  const TSCCalibration & calibration = tsc_calibration();
+
+  if ( calibration.usable() ) {
+    return calibration.now_ns();
+  }
+
+  return monotonic_ns();
+}
+
+/* Raw cycle counter */
+uint64_t cycle_count()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if ( tsc_calibration().usable() ) {
+    return __rdtsc();
+  }
+#endif
+
+  return monotonic_ns();
+}
+
+double ns_per_cycle()
+{
+  return tsc_calibration().usable() ? tsc_calibration().ns_per_tick() : 1.0;
 }
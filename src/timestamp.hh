@@ -8,4 +8,51 @@
 uint64_t timestamp_ms();
 uint64_t timestamp_ms( const timespec & ts );
 
+/* Same timeline as timestamp_ms(), but keeping the full nanosecond
+   precision of the timespec (e.g. kernel SO_TIMESTAMPNS receive times) */
+uint64_t timestamp_ns();
+uint64_t timestamp_ns( const timespec & ts );
+
+/* Wall-clock time (ns since 1970) at which that timeline starts */
+uint64_t timestamp_epoch_ns();
+
+/* Monotonic time since the start of the program
+   (unlike timestamp_ms(), never steps when NTP adjusts the wall clock) */
+uint64_t monotonic_ns();
+uint64_t monotonic_us();
+uint64_t monotonic_ms();
+
+/* Map a CLOCK_REALTIME timespec (e.g. from the kernel) onto the monotonic timeline */
+uint64_t monotonic_ns( const timespec & realtime_ts );
+
+/* Cheap monotonic clock for hot loops: reads the TSC and converts with a
+   calibrated rate when the CPU has an invariant TSC, otherwise falls back
+   to monotonic_ns(). Shares monotonic_ns()'s timeline. */
+uint64_t fast_monotonic_ns();
+
+/* Raw cycle counter (the TSC) for timing short stretches of code, and
+   how many nanoseconds each count is. Without an invariant TSC this is
+   just monotonic_ns() (and a count is 1 ns). */
+uint64_t cycle_count();
+double ns_per_cycle();
+
+/* Clock that is sampled once (e.g. per event-loop iteration) and then read
+   for free by everything that runs during that iteration */
+class CachedClock
+{
+private:
+  uint64_t now_ns_;
+
+public:
+  CachedClock() : now_ns_( fast_monotonic_ns() ) {}
+
+  /* take a new sample of the clock */
+  uint64_t refresh() { return now_ns_ = fast_monotonic_ns(); }
+
+  /* accessors */
+  uint64_t now_ns() const { return now_ns_; }
+  uint64_t now_us() const { return now_ns_ / 1000; }
+  uint64_t now_ms() const { return now_ns_ / 1000000; }
+};
+
 #endif /* TIMESTAMP_HH */
@@ -0,0 +1,188 @@
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "tracer.hh"
+#include "poller.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+TraceRing::TraceRing( const size_t capacity )
+  : records_(),
+    mask_( 0 ),
+    head_( 0 ),
+    head_padding_(),
+    tail_( 0 ),
+    dropped_( 0 )
+{
+  uint64_t rounded = 1;
+  while ( rounded < capacity ) {
+    rounded <<= 1;
+  }
+
+  records_.reset( new TraceRecord[ rounded ] );
+  mask_ = rounded - 1;
+}
+
+bool TraceRing::push( const TraceRecord & record )
+{
+  const uint64_t head = head_.load( memory_order_relaxed );
+  if ( head - tail_.load( memory_order_acquire ) > mask_ ) {
+    dropped_.fetch_add( 1, memory_order_relaxed );
+    return false;
+  }
+
+  records_[ head & mask_ ] = record;
+  head_.store( head + 1, memory_order_release );
+  return true;
+}
+
+size_t TraceRing::drain( FileDescriptor & file )
+{
+  const uint64_t tail = tail_.load( memory_order_relaxed );
+  const uint64_t head = head_.load( memory_order_acquire );
+  if ( head == tail ) {
+    return 0;
+  }
+
+  /* the waiting records, in at most two pieces (if they wrap around) */
+  const uint64_t first = tail & mask_;
+  const uint64_t count = head - tail;
+  const uint64_t first_count = min( count, mask_ + 1 - first );
+
+  iovec pieces[ 2 ] = { { &records_[ first ], first_count * sizeof( TraceRecord ) },
+			{ &records_[ 0 ], (count - first_count) * sizeof( TraceRecord ) } };
+
+  /* (a regular file, so only a full disk stops this) */
+  int piece = 0;
+  while ( piece < 2 ) {
+    size_t written = file.write( pieces + piece, 2 - piece );
+    while ( piece < 2 and written >= pieces[ piece ].iov_len ) {
+      written -= pieces[ piece ].iov_len;
+      piece++;
+    }
+    if ( piece < 2 ) {
+      pieces[ piece ].iov_base = static_cast< char * >( pieces[ piece ].iov_base ) + written;
+      pieces[ piece ].iov_len -= written;
+    }
+  }
+
+  tail_.store( head, memory_order_release );
+  return count;
+}
+
+/* each Tracer gets a different id */
+static atomic< uint64_t > next_tracer_id( 0 );
+
+Tracer::Tracer( const string & path, const size_t ring_capacity,
+		const uint64_t drain_interval_ms )
+  : id_( next_tracer_id++ ),
+    file_( SystemCall( "open " + path,
+		       open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) ),
+    ring_capacity_( ring_capacity ),
+    drain_interval_ns_( drain_interval_ms * 1000000 ),
+    rings_mutex_(),
+    rings_(),
+    records_written_( 0 ),
+    stop_event_(),
+    drainer_()
+{
+  TraceFileHeader header = TraceFileHeader();
+  copy( TRACE_MAGIC, TRACE_MAGIC + sizeof( TRACE_MAGIC ), header.magic );
+  header.record_size = sizeof( TraceRecord );
+  file_.write( string( reinterpret_cast< const char * >( &header ), sizeof( header ) ) );
+
+  drainer_ = thread( [this] () { drain_loop(); } );
+}
+
+Tracer::~Tracer()
+{
+  try {
+    stop_event_.signal();
+    drainer_.join();
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+}
+
+TraceRing & Tracer::ring()
+{
+  /* this thread's ring in every Tracer it has recorded to (ids are never
+     reused, so a destroyed Tracer's entry is never looked up again) */
+  static thread_local unordered_map< uint64_t, TraceRing * > thread_rings;
+
+  /* the ring this thread last used, and whose it was */
+  static thread_local uint64_t cached_tracer_id = -1;
+  static thread_local TraceRing * cached_ring = nullptr;
+
+  if ( cached_ring == nullptr or cached_tracer_id != id_ ) {
+    TraceRing * & ring = thread_rings[ id_ ];
+    if ( ring == nullptr ) {
+      unique_lock< mutex > lock( rings_mutex_ );
+      rings_.emplace_back( new TraceRing( ring_capacity_ ) );
+      ring = rings_.back().get();
+    }
+    cached_ring = ring;
+    cached_tracer_id = id_;
+  }
+
+  return *cached_ring;
+}
+
+void Tracer::record( TraceRecord record )
+{
+  record.timestamp_ns = fast_monotonic_ns();
+  ring().push( record );
+}
+
+void Tracer::drain()
+{
+  unique_lock< mutex > lock( rings_mutex_ );
+  for ( auto & ring : rings_ ) {
+    records_written_ += ring->drain( file_ );
+  }
+}
+
+void Tracer::drain_loop()
+{
+  try {
+    Poller poller;
+
+    /* first rule: write out what's been recorded every drain interval */
+    poller.add_timer( drain_interval_ns_, [&] () {
+	drain();
+	return ResultType::Continue;
+      }, drain_interval_ns_ );
+
+    /* second rule: write out the rest and quit when asked to */
+    poller.add_action( Action( stop_event_, Direction::In, [&] () {
+	  stop_event_.read_event();
+	  drain();
+	  return ResultType::Exit;
+	} ) );
+
+    while ( poller.poll( -1 ).result != PollResult::Exit ) {}
+  } catch ( const exception & e ) {
+    print_exception( e ); /* e.g. disk full: tracing stops, the program doesn't */
+  }
+}
+
+uint64_t Tracer::dropped()
+{
+  unique_lock< mutex > lock( rings_mutex_ );
+  uint64_t total = 0;
+  for ( const auto & ring : rings_ ) {
+    total += ring->dropped();
+  }
+  return total;
+}
+
+uint64_t Tracer::records_written()
+{
+  unique_lock< mutex > lock( rings_mutex_ );
+  return records_written_;
+}
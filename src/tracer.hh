@@ -0,0 +1,117 @@
+#ifndef TRACER_HH
+#define TRACER_HH
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_descriptor.hh"
+#include "eventfd.hh"
+
+/* one fixed-size binary trace record, written to the trace file as is
+   (in host byte order, after a TraceFileHeader) */
+struct TraceRecord
+{
+  uint64_t timestamp_ns; /* when it was recorded, on the monotonic_ns() timeline */
+  uint16_t event; /* what happened (each program numbers its own events) */
+  uint16_t source; /* e.g. which flow */
+  uint32_t window;
+  uint64_t sequence_number;
+  uint64_t time_ms[ 2 ]; /* event-specific timestamps (e.g. sender's and receiver's clocks) */
+  int64_t estimate;
+  double value; /* e.g. a round-trip time */
+  uint64_t reserved; /* (zero) */
+};
+
+static_assert( sizeof( TraceRecord ) == 64, "TraceRecord should fill one cache line" );
+
+/* start of every trace file */
+struct TraceFileHeader
+{
+  char magic[ 8 ]; /* TRACE_MAGIC */
+  uint32_t record_size; /* sizeof( TraceRecord ) */
+  uint32_t reserved;
+};
+
+static const char TRACE_MAGIC[ 8 ] = { 'D', 'G', 'T', 'R', 'A', 'C', 'E', '1' };
+
+/* single-producer, single-consumer ring of trace records
+   (the producer never waits: when the ring is full, records are dropped) */
+class TraceRing
+{
+private:
+  std::unique_ptr< TraceRecord[] > records_;
+  uint64_t mask_;
+
+  /* kept a cache line apart, so producer and consumer don't contend for one
+     (padded by hand, since C++11's new can't give alignas() over 16 bytes) */
+  std::atomic< uint64_t > head_; /* next record to fill (producer) */
+  char head_padding_[ 64 - sizeof( std::atomic< uint64_t > ) ];
+  std::atomic< uint64_t > tail_; /* next record to drain (consumer) */
+  std::atomic< uint64_t > dropped_;
+
+public:
+  /* capacity is rounded up to a power of two */
+  TraceRing( const size_t capacity );
+
+  /* add a record (producer only); returns false if it was dropped */
+  bool push( const TraceRecord & record );
+
+  /* write every waiting record to file (consumer only); returns how many */
+  size_t drain( FileDescriptor & file );
+
+  uint64_t dropped() const { return dropped_.load( std::memory_order_relaxed ); }
+};
+
+/* Writes trace records to a file without making the recording thread
+   wait: each thread records into its own TraceRing (so record() takes
+   no locks), and a background thread drains them all every few ms. */
+class Tracer
+{
+private:
+  const uint64_t id_; /* keys each thread's table of its rings */
+  FileDescriptor file_;
+  size_t ring_capacity_;
+  uint64_t drain_interval_ns_;
+
+  std::mutex rings_mutex_; /* held only to add a ring, and by the drainer */
+  std::vector< std::unique_ptr< TraceRing > > rings_;
+  uint64_t records_written_;
+
+  EventFD stop_event_;
+  std::thread drainer_;
+
+  /* the calling thread's ring (created on its first record) */
+  TraceRing & ring();
+
+  /* write out every ring (drainer thread only) */
+  void drain();
+
+  void drain_loop();
+
+public:
+  Tracer( const std::string & path, const size_t ring_capacity = 16384,
+	  const uint64_t drain_interval_ms = 10 );
+
+  /* stops the drainer, writing out everything recorded so far */
+  ~Tracer();
+
+  /* record an event (timestamp_ns is filled in); safe from any thread */
+  void record( TraceRecord record );
+
+  /* records lost because a ring was full */
+  uint64_t dropped();
+
+  /* records in the file (complete once the Tracer is destroyed) */
+  uint64_t records_written();
+
+  /* forbid copying or assigning */
+  Tracer( const Tracer & other ) = delete;
+  Tracer & operator=( const Tracer & other ) = delete;
+};
+
+#endif /* TRACER_HH */
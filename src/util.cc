@@ -0,0 +1,20 @@
+#include <algorithm>
+#include <thread>
+
+#include <pthread.h>
+
+#include "util.hh"
+
+using namespace std;
+
+void pin_to_core( const unsigned int core )
+{
+  cpu_set_t cpus;
+  CPU_ZERO( &cpus );
+  CPU_SET( core % max( 1u, thread::hardware_concurrency() ), &cpus );
+
+  const int ret = pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+  if ( ret ) {
+    throw unix_error( "pthread_setaffinity_np", ret );
+  }
+}
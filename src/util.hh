@@ -61,4 +61,7 @@ inline int SystemCall( const std::string & s_attempt, const int return_value )
 /* zero out an arbitrary structure */
 template <typename T> void zero( T & x ) { memset( &x, 0, sizeof( x ) ); }
 
+/* pin the calling thread to one core (taken modulo the number of cores) */
+void pin_to_core( const unsigned int core );
+
 #endif /* UTIL_HH */